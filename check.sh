@@ -0,0 +1,115 @@
+#!/bin/sh
+# Regression check: run metinfo over a small generated corpus and print
+# every output and exit status. make check compares the result with
+# check-expected.txt and make check-update refreshes that file after an
+# intended change.
+#
+# Usage: check.sh DIR
+#
+# DIR is removed and filled with the corpus. METINFO and METGEN name the
+# binaries (./metinfo and ./metgen by default).
+
+set -u
+METINFO=${METINFO:-./metinfo}
+METGEN=${METGEN:-./metgen}
+DATA=${1:?usage: check.sh DIR}
+
+# Local times and sorting must not depend on the machine
+TZ=UTC
+LC_ALL=C
+export TZ LC_ALL
+
+# Run metinfo and print its output, its warnings and its exit status;
+# standard error comes after standard output so the two never interleave
+run() {
+    echo "\$ metinfo $*"
+    "$METINFO" "$@" > "$DATA/stdout" 2> "$DATA/stderr"
+    status=$?
+    cat "$DATA/stdout"
+    sort "$DATA/stderr" | sed 's/^/stderr: /'
+    echo "[exit $status]"
+}
+
+# Same for a run over directories: files come in readdir order, so the
+# lines are sorted. Only for output with one line per file.
+runSorted() {
+    echo "\$ metinfo $* | sort"
+    "$METINFO" "$@" > "$DATA/stdout" 2> "$DATA/stderr"
+    status=$?
+    sort "$DATA/stdout"
+    sort "$DATA/stderr" | sed 's/^/stderr: /'
+    echo "[exit $status]"
+}
+
+# Count the files of two trees that differ in more than bytes bytes
+countChanged() {
+    changed=0
+    for file in $(cd "$1" && find . -name '*.part.met' | sort); do
+        if [ "$(cmp -l "$1/$file" "$2/$file" | wc -l)" -gt "$3" ]; then
+            changed=$((changed + 1))
+        fi
+    done
+    echo "files differing in more than $3 bytes: $changed"
+}
+
+rm -rf "$DATA"
+mkdir -p "$DATA/copies" || exit 1
+"$METGEN" -r 1 -v 14.0 -m "$DATA/v14.0.part.met" &&
+"$METGEN" -r 1 -v 14.1 -m "$DATA/v14.1.part.met" &&
+"$METGEN" -r 1 -d "$DATA/duplicate.part.met" &&
+"$METGEN" -r 1 -s 100M -g 200 -p fragmented "$DATA/fragmented.part.met" &&
+"$METGEN" -r 1 -N 40 -g 20 -u 4 -C 10 "$DATA/tree" || exit 1
+cp "$DATA/tree/000/000001.part.met" "$DATA/tree/000/000002.part.met" "$DATA/copies" || exit 1
+
+echo "=== single files"
+run -f "$DATA/v14.0.part.met" -a
+run -f "$DATA/v14.1.part.met" -a -j
+run -f "$DATA/duplicate.part.met" -z
+run -f "$DATA/duplicate.part.met" -n -S -p -j
+
+echo "=== --where"
+run -f "$DATA/duplicate.part.met" -p -w 'progress >= 50 && status == paused'
+run -f "$DATA/duplicate.part.met" -p -w 'progress > 50'
+run -f "$DATA/duplicate.part.met" -p -w 'progress >'
+run -f "$DATA/duplicate.part.met" -n -w 'name ~ "stale"'
+runSorted -n -w 'status == paused || tags > 40' "$DATA/tree"
+runSorted -p -j -w 'size > 1G' "$DATA/tree"
+
+echo "=== --sort --top"
+run --sort size --top 5 "$DATA/tree"
+run --sort progress -r --top 3 -j "$DATA/tree"
+run --sort gaps --top 4 -w 'status != paused' "$DATA/tree"
+
+echo "=== --summary"
+run --summary "$DATA/tree"
+run --summary -j -w 'progress < 50' "$DATA/tree"
+
+echo "=== --dupes"
+run --dupes "$DATA/tree" "$DATA/copies"
+run --dupes -j "$DATA/tree" "$DATA/copies"
+run --dupes "$DATA/v14.0.part.met" "$DATA/v14.1.part.met"
+run --dupes "$DATA/tree/000/000001.part.met" "$DATA/tree/000/000002.part.met"
+
+echo "=== --set"
+cp -R "$DATA/tree" "$DATA/set" || exit 1
+run --set status=paused,prio=high --jobs 4 "$DATA/set"
+run --set status=paused,prio=high --jobs 4 "$DATA/set"
+run --set ulprio=low -w 'tags > 40' --jobs 1 -j "$DATA/set"
+runSorted -n -w 'status != paused || prio != high' "$DATA/set"
+countChanged "$DATA/tree" "$DATA/set" 12
+
+echo "=== --compact"
+mkdir -p "$DATA/compact" || exit 1
+cp "$DATA/duplicate.part.met" "$DATA/fragmented.part.met" "$DATA/compact" || exit 1
+run --compact -w 'tags > 100' "$DATA/compact"
+"$METINFO" -f "$DATA/duplicate.part.met" -z -j > "$DATA/before" 2>&1
+runSorted --compact "$DATA/compact"
+runSorted --compact -j "$DATA/compact"
+"$METINFO" -f "$DATA/compact/duplicate.part.met" -z -j > "$DATA/after" 2>&1
+echo "-z of duplicate.part.met before and after --compact:"
+tr ',' '\n' < "$DATA/before" > "$DATA/stdout"
+tr ',' '\n' < "$DATA/after" | diff "$DATA/stdout" -
+run -f "$DATA/compact/fragmented.part.met" -z
+run -f "$DATA/fragmented.part.met" -z
+
+rm -f "$DATA/stdout" "$DATA/stderr" "$DATA/before" "$DATA/after"
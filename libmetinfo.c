@@ -0,0 +1,3143 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "libmetinfo.h"
+#include "metprobes.h"
+
+/**
+ * Return a message describing an error code
+ */
+const char *metErrorString(int error) {
+    switch (error) {
+        case MET_OK:            return "Success";
+        case MET_ERR_IO:        return "Error reading file";
+        case MET_ERR_TRUNCATED: return "Unexpected end of file";
+        case MET_ERR_FORMAT:    return "Unrecognized or invalid file format";
+        case MET_ERR_TAG_TYPE:  return "Unrecognized tag type";
+        case MET_ERR_NOMEM:     return "Memory allocation error";
+        case MET_ERR_SYNTAX:    return "Invalid filter expression";
+        case MET_STOP:          return "Stopped by visitor";
+        case MET_NEED_MORE:     return "More data needed";
+        case MET_ERR_SIZE:      return "Tag or block count larger than the file can hold";
+        case MET_ERR_LIMIT:     return "Count or length above the configured limit";
+        default:                return "Unknown error";
+    }
+}
+
+/**
+ * Limits of a parse without a context
+ */
+static const MetLimits defaultLimits = {
+    MET_DEFAULT_MAX_TAGS,
+    MET_DEFAULT_MAX_BLOCKS,
+    MET_DEFAULT_MAX_STRING
+};
+
+/**
+ * Set up a context with the default limits, no counters and no tracing
+ */
+void initMetContext(MetContext *met) {
+    memset(met, 0, sizeof(MetContext));
+    met->limits = defaultLimits;
+}
+
+/**
+ * Return the limits of a parse
+ */
+static const MetLimits *limitsOf(const MetContext *met) {
+    return met != NULL ? &met->limits : &defaultLimits;
+}
+
+/**
+ * Start a traced span. Returns 0 without reading the clock while tracing
+ * is disabled.
+ */
+static double traceStart(const MetContext *met) {
+    struct timespec ts;
+    
+    if (met == NULL || met->tracer == NULL) {
+        return 0.0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * End a traced span and pass it to the callback
+ */
+static void traceEnd(const MetContext *met, const char *name, double start, off_t offset, size_t size) {
+    if (met != NULL && met->tracer != NULL) {
+        met->tracer(met->tracerContext, name, start, traceStart(met), offset, size);
+    }
+}
+
+/**
+ * Check whether a tag of size bytes is traced on its own
+ */
+static int traceTag(const MetContext *met, size_t size) {
+    return met != NULL && met->tracer != NULL && size >= met->traceThreshold;
+}
+
+/**
+ * read() that updates the counters
+ */
+static ssize_t countedRead(const MetContext *met, int fd, void *buffer, size_t len) {
+    ssize_t count = read(fd, buffer, len);
+    if (met != NULL && met->stats != NULL) {
+        met->stats->readCalls++;
+        if (count > 0) {
+            met->stats->bytesRead += count;
+        }
+    }
+    return count;
+}
+
+/**
+ * lseek() that updates the counters
+ */
+static off_t countedSeek(const MetContext *met, int fd, off_t offset, int whence) {
+    if (met != NULL && met->stats != NULL) {
+        met->stats->seekCalls++;
+    }
+    return lseek(fd, offset, whence);
+}
+
+/**
+ * Heap allocation functions that update the counters
+ */
+static void *countedMalloc(const MetContext *met, size_t size) {
+    if (met != NULL && met->stats != NULL) {
+        met->stats->allocations++;
+        met->stats->allocatedBytes += size;
+    }
+    return malloc(size);
+}
+
+static void *countedCalloc(const MetContext *met, size_t count, size_t size) {
+    if (met != NULL && met->stats != NULL) {
+        met->stats->allocations++;
+        met->stats->allocatedBytes += count * size;
+    }
+    return calloc(count, size);
+}
+
+static void *countedRealloc(const MetContext *met, void *ptr, size_t size) {
+    if (met != NULL && met->stats != NULL) {
+        met->stats->allocations++;
+        met->stats->allocatedBytes += size;
+    }
+    return realloc(ptr, size);
+}
+
+/**
+ * Read exactly len bytes from the file
+ */
+static int readBytes(int fd, void *buffer, size_t len, const MetContext *met) {
+    ssize_t count = countedRead(met, fd, buffer, len);
+    if (count == -1) {
+        return MET_ERR_IO;
+    }
+    if ((size_t)count != len) {
+        return MET_ERR_TRUNCATED;
+    }
+    return MET_OK;
+}
+
+/**
+ * Read a byte from the file
+ */
+static int readByte(int fd, unsigned char *byte, const MetContext *met) {
+    return readBytes(fd, byte, 1, met);
+}
+
+/**
+ * Read a word (2 bytes) from the file
+ */
+static int readWord(int fd, unsigned short *word, const MetContext *met) {
+    unsigned char bytes[2];
+    int rc = readBytes(fd, bytes, 2, met);
+    *word = (bytes[0] | (bytes[1] << 8));
+    return rc;
+}
+
+/**
+ * Read a dword (4 bytes) from the file
+ */
+static int readDWord(int fd, unsigned int *dword, const MetContext *met) {
+    unsigned char bytes[4];
+    int rc = readBytes(fd, bytes, 4, met);
+    *dword = (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24));
+    return rc;
+}
+
+/**
+ * Read a string of length len from the file
+ */
+static int readString(int fd, int len, char **str, const MetContext *met) {
+    *str = NULL;
+    if ((unsigned int)len > limitsOf(met)->maxStringLength) {
+        return MET_ERR_LIMIT;
+    }
+    *str = (char *)countedMalloc(met, len + 1);
+    if (*str == NULL) {
+        return MET_ERR_NOMEM;
+    }
+    int rc = readBytes(fd, *str, len, met);
+    if (rc != MET_OK) {
+        free(*str);
+        *str = NULL;
+        return rc;
+    }
+    (*str)[len] = '\0';
+    return MET_OK;
+}
+
+/**
+ * Seek to an absolute position in the file
+ */
+static int seekTo(int fd, off_t position, const MetContext *met) {
+    return countedSeek(met, fd, position, SEEK_SET) == -1 ? MET_ERR_IO : MET_OK;
+}
+
+/**
+ * Read the header of a .part.met file, leaving the file pointer at the
+ * first meta tag
+ */
+int readMetHeader(int fd, MetHeader *header, const MetContext *met) {
+    int starthash;
+    unsigned char version;
+    unsigned short numBlocks;
+    int rc;
+    
+    // Read first byte to determine file version
+    double start = traceStart(met);
+    rc = readByte(fd, &version, met);
+    traceEnd(met, "version probe", start, 0, 1);
+    if (rc != MET_OK) {
+        return rc;
+    }
+    
+    // Determine hash position based on file version
+    switch (version) {
+        case 224:
+            starthash = 5;
+            header->metVersion = 0; // Version 14.0
+            header->versionStr = "14.0";
+            break;
+        case 225:
+            starthash = 6;
+            header->metVersion = 1; // Version 14.1
+            header->versionStr = "14.1";
+            break;
+        default:
+            return MET_ERR_FORMAT;
+    }
+    
+    // Read 16 bytes of the hash
+    start = traceStart(met);
+    if ((rc = seekTo(fd, starthash, met)) == MET_OK) {
+        rc = readBytes(fd, header->rawHash, 16, met);
+    }
+    traceEnd(met, "hash read", start, starthash, 16);
+    if (rc != MET_OK) {
+        return rc;
+    }
+    
+    formatHash(header->rawHash, header->hash);
+    
+    // Position for reading meta tags
+    off_t numTagsPosition;
+    header->numBlocks = 0;
+    
+    if (header->metVersion == 0) { // Version 14.0
+        // In version 14.0 we need to read the number of blocks first
+        if ((rc = seekTo(fd, 21, met)) != MET_OK || // Position of 'Blocks' field
+            (rc = readWord(fd, &numBlocks, met)) != MET_OK) {
+            return rc;
+        }
+        header->numBlocks = numBlocks;
+        if (numBlocks > limitsOf(met)->maxBlocks) {
+            return MET_ERR_LIMIT;
+        }
+        
+        // Calculate position of NumTags field
+        numTagsPosition = 23 + (16 * (off_t)header->numBlocks);
+    } else { // Version 14.1
+        // In version 14.1, NumTags is right after the ED2K hash
+        numTagsPosition = 22;
+    }
+    
+    // The part hashes of a damaged 14.0 header can point past the end
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && numTagsPosition + 4 > st.st_size) {
+        return MET_ERR_SIZE;
+    }
+    
+    // Read number of meta tags
+    if ((rc = seekTo(fd, numTagsPosition, met)) != MET_OK ||
+        (rc = readDWord(fd, &header->numTags, met)) != MET_OK) {
+        return rc;
+    }
+    header->tagsPosition = numTagsPosition + 4;
+    MET_PROBE3(header__decoded, header->metVersion, header->numTags, header->numBlocks);
+    
+    return MET_OK;
+}
+
+/**
+ * Read and parse a meta tag from the file
+ */
+int readMetaTag(int fd, MetaTag **result, const MetContext *met) {
+    unsigned char type;
+    unsigned short length;
+    int rc;
+    
+    *result = NULL;
+    
+    MetaTag *tag = (MetaTag *)countedCalloc(met, 1, sizeof(MetaTag));
+    if (tag == NULL) {
+        return MET_ERR_NOMEM;
+    }
+    
+    // Read tag type, name length and name
+    if ((rc = readByte(fd, &type, met)) != MET_OK ||
+        (rc = readWord(fd, &length, met)) != MET_OK) {
+        free(tag);
+        return rc;
+    }
+    tag->type = type;
+    tag->nameLength = length;
+    
+    if ((rc = readString(fd, tag->nameLength, &tag->name, met)) != MET_OK) {
+        free(tag);
+        return rc;
+    }
+    
+    // Read value based on type
+    if (tag->type == 2) { // String
+        if ((rc = readWord(fd, &length, met)) == MET_OK) {
+            tag->valueLength = length;
+            rc = readString(fd, tag->valueLength, &tag->value.stringValue, met);
+        }
+    } else if (tag->type == 3) { // Integer
+        unsigned int value;
+        rc = readDWord(fd, &value, met);
+        tag->value.intValue = value;
+    } else {
+        rc = MET_ERR_TAG_TYPE;
+    }
+    
+    if (rc != MET_OK) {
+        free(tag->name);
+        free(tag);
+        return rc;
+    }
+    
+    classifyMetaTag(tag);
+    MET_PROBE3(tag__decoded, tag->type, tag->nameLength, tag->valueLength);
+    *result = tag;
+    return MET_OK;
+}
+
+/**
+ * Free memory used by a meta tag
+ */
+void freeMetaTag(MetaTag *tag) {
+    if (tag != NULL) {
+        free(tag->name);
+        if (tag->type == 2) { // String
+            free(tag->value.stringValue);
+        }
+        free(tag);
+    }
+}
+
+/**
+ * Visitor state for filling a MetFile
+ */
+typedef struct {
+    MetFile *file;
+    const MetContext *met;
+} CollectVisit;
+
+/**
+ * Visitor callback keeping a copy of every tag in a MetFile
+ */
+static int collectMetTag(void *context, const MetaTag *tag, off_t offset) {
+    CollectVisit *visit = (CollectVisit *)context;
+    MetFile *file = visit->file;
+    (void)offset;
+    
+    if (file->tags == NULL) {
+        file->tags = (MetaTag **)countedMalloc(visit->met, file->header.numTags * sizeof(MetaTag *));
+        if (file->tags == NULL) {
+            return MET_ERR_NOMEM;
+        }
+    }
+    
+    MetaTag *copy = copyMetaTag(tag, visit->met);
+    if (copy == NULL) {
+        return MET_ERR_NOMEM;
+    }
+    file->tags[file->numTags++] = copy;
+    
+    // Index the last occurrence of every special tag, which is the one
+    // that takes effect when a tag is duplicated
+    if (copy->specialId >= 0) {
+        file->special[copy->specialId] = copy;
+        
+        // Keep track of file size and downloaded bytes
+        if (copy->type == 3) {
+            if (copy->specialId == 2) { // File size
+                file->fileSize = copy->value.intValue;
+            } else if (copy->specialId == 8) { // Downloaded bytes
+                file->downloadedBytes = copy->value.intValue;
+            }
+        }
+    }
+    
+    return MET_OK;
+}
+
+/**
+ * Visitor callback storing the header of a MetFile
+ */
+static int collectMetHeader(void *context, const MetHeader *header) {
+    ((CollectVisit *)context)->file->header = *header;
+    return MET_OK;
+}
+
+/**
+ * Read all meta tags of a file whose header has been read with
+ * readMetHeader. On error no tags are kept.
+ */
+int readMetTags(int fd, MetFile *file, const MetContext *met) {
+    static const MetVisitor visitor = { NULL, collectMetTag, NULL };
+    CollectVisit visit = { file, met };
+    
+    file->tags = NULL;
+    file->numTags = 0;
+    file->fileSize = 0;
+    file->downloadedBytes = 0;
+    memset(file->special, 0, sizeof(file->special));
+    
+    int rc = visitMetTags(fd, &file->header, &visitor, &visit, met);
+    if (rc != MET_OK) {
+        freeMetFile(file);
+    }
+    return rc;
+}
+
+/**
+ * Parse the header and meta tags of an open .part.met file
+ */
+int parseMetFile(int fd, MetFile *file, const MetContext *met) {
+    static const MetVisitor visitor = { collectMetHeader, collectMetTag, NULL };
+    CollectVisit visit = { file, met };
+    
+    memset(file, 0, sizeof(MetFile));
+    
+    int rc = visitMetFile(fd, &visitor, &visit, met);
+    if (rc != MET_OK) {
+        freeMetFile(file);
+    }
+    return rc;
+}
+
+/**
+ * Parse the header and meta tags of a .part.met file held in memory
+ */
+int parseMetBuffer(const void *data, size_t len, MetFile *file, const MetContext *met) {
+    static const MetVisitor visitor = { collectMetHeader, collectMetTag, NULL };
+    CollectVisit visit = { file, met };
+    
+    memset(file, 0, sizeof(MetFile));
+    
+    int rc = visitMetBuffer(data, len, &visitor, &visit, met);
+    if (rc != MET_OK) {
+        freeMetFile(file);
+    }
+    return rc;
+}
+
+/**
+ * Open and parse a .part.met file
+ */
+int loadMetFile(const char *path, MetFile *file, const MetContext *met) {
+    int fd = open(path, O_RDONLY);
+    
+    if (fd == -1) {
+        memset(file, 0, sizeof(MetFile));
+        return MET_ERR_IO;
+    }
+    MET_PROBE2(file__open, path, fd);
+    
+    int rc = parseMetFile(fd, file, met);
+    
+    // Keep errno from the parse for the caller
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    
+    return rc;
+}
+
+/**
+ * Free the meta tags of a parsed file
+ */
+void freeMetFile(MetFile *file) {
+    for (unsigned int i = 0; i < file->numTags; i++) {
+        freeMetaTag(file->tags[i]);
+    }
+    free(file->tags);
+    file->tags = NULL;
+    file->numTags = 0;
+    memset(file->special, 0, sizeof(file->special));
+}
+
+/**
+ * Return the last tag with a special tag ID, or NULL if the file has none
+ */
+const MetaTag *findSpecialTag(const MetFile *file, int id) {
+    return id >= 0 && id < 256 ? file->special[id] : NULL;
+}
+
+/**
+ * Parser states of the streaming visitor
+ */
+typedef enum {
+    PARSE_HEADER,         // Version byte, hash and block count or tag count
+    PARSE_PART_HASHES,    // Part hashes of a 14.0 file, skipped
+    PARSE_NUM_TAGS,       // Tag count of a 14.0 file
+    PARSE_TAGS,           // Meta tags
+    PARSE_DONE
+} ParseState;
+
+/**
+ * Incremental parser state. The buffer only ever holds the unconsumed
+ * tail of the input plus one chunk, so memory does not depend on the
+ * number of tags.
+ */
+struct MetParser {
+    const MetVisitor *visitor;
+    void *context;
+    MetContext met;           // Limits, counters and tracing of the parse
+    ParseState state;
+    int error;                // First error, reported by later calls
+    MetHeader header;
+    unsigned int tagIndex;    // Number of tags visited so far
+    unsigned char *buffer;
+    size_t capacity;          // Allocated size of the buffer
+    size_t start;             // First unconsumed byte
+    size_t end;               // End of the buffered data
+    off_t offset;             // File offset of buffer[start]
+    off_t skip;               // Bytes still to skip before the next field
+    off_t inputSize;          // Total input size, -1 if unknown
+    int salvage;              // Decode up to the first damaged tag
+};
+
+#define MET_READ_CHUNK 65536
+
+/**
+ * Make room for at least len more bytes after the buffered data.
+ * One spare byte is always kept so a borrowed string can be terminated.
+ */
+static int parserReserve(MetParser *parser, size_t len) {
+    if (parser->start > 0) {
+        memmove(parser->buffer, parser->buffer + parser->start, parser->end - parser->start);
+        parser->end -= parser->start;
+        parser->start = 0;
+    }
+    
+    if (parser->end + len + 1 > parser->capacity) {
+        size_t capacity = parser->end + len + 1;
+        unsigned char *buffer = (unsigned char *)countedRealloc(&parser->met, parser->buffer, capacity);
+        if (buffer == NULL) {
+            return MET_ERR_NOMEM;
+        }
+        parser->buffer = buffer;
+        parser->capacity = capacity;
+    }
+    
+    return MET_OK;
+}
+
+/**
+ * Mark len buffered bytes as consumed
+ */
+static void parserConsume(MetParser *parser, size_t len) {
+    parser->start += len;
+    parser->offset += len;
+}
+
+/**
+ * Check that the tag count is within the limit and that the rest of the
+ * input can hold that many tags, before anyone allocates for them. When
+ * salvaging, a count the input cannot hold is left to fail at the first
+ * tag that does not fit, so the tags before it are kept.
+ */
+static int parserCheckTagCount(const MetParser *parser) {
+    if (parser->inputSize >= 0 && !parser->salvage &&
+        parser->header.numTags > (parser->inputSize - parser->offset) / MET_MIN_TAG_SIZE) {
+        return MET_ERR_SIZE;
+    }
+    if (parser->header.numTags > parser->met.limits.maxTags) {
+        return MET_ERR_LIMIT;
+    }
+    return MET_OK;
+}
+
+/**
+ * Check that a tag ending need bytes after the current position fits in
+ * the input, so a damaged length fails before its data is buffered
+ */
+static int parserCheckTagEnd(const MetParser *parser, size_t need) {
+    if (parser->inputSize >= 0 && parser->offset + (off_t)need > parser->inputSize) {
+        return MET_ERR_TRUNCATED;
+    }
+    return MET_OK;
+}
+
+/**
+ * Report the decoded header and start on the meta tags
+ */
+static int parserBeginTags(MetParser *parser) {
+    int rc;
+    
+    parser->state = PARSE_TAGS;
+    parser->header.tagsPosition = parser->offset;
+    
+    if ((rc = parserCheckTagCount(parser)) != MET_OK) {
+        return rc;
+    }
+    MET_PROBE3(header__decoded, parser->header.metVersion, parser->header.numTags, parser->header.numBlocks);
+    
+    if (parser->visitor->onHeader) {
+        return parser->visitor->onHeader(parser->context, &parser->header);
+    }
+    return MET_OK;
+}
+
+/**
+ * Decode as many fields as the buffered data allows. Returns MET_OK when
+ * more data is needed or the parse is complete; check parser->state.
+ */
+static int parserStep(MetParser *parser) {
+    const MetVisitor *visitor = parser->visitor;
+    int rc;
+    
+    while (parser->state != PARSE_DONE) {
+        unsigned char *data = parser->buffer + parser->start;
+        size_t avail = parser->end - parser->start;
+        
+        switch (parser->state) {
+            case PARSE_HEADER: {
+                MetHeader *header = &parser->header;
+                size_t need;
+                
+                if (avail < 1) {
+                    return MET_OK;
+                }
+                switch (data[0]) {
+                    case 224:
+                        header->metVersion = 0; // Version 14.0
+                        header->versionStr = "14.0";
+                        need = 23;              // Up to the block count
+                        break;
+                    case 225:
+                        header->metVersion = 1; // Version 14.1
+                        header->versionStr = "14.1";
+                        need = 26;              // Up to the tag count
+                        break;
+                    default:
+                        return MET_ERR_FORMAT;
+                }
+                if (avail < need) {
+                    return MET_OK;
+                }
+                
+                memcpy(header->rawHash, data + (header->metVersion == 0 ? 5 : 6), 16);
+                formatHash(header->rawHash, header->hash);
+                
+                if (header->metVersion == 0) {
+                    header->numBlocks = data[21] | (data[22] << 8);
+                    if ((unsigned int)header->numBlocks > parser->met.limits.maxBlocks) {
+                        return MET_ERR_LIMIT;
+                    }
+                    parser->skip = 16 * (off_t)header->numBlocks;
+                    if (parser->inputSize >= 0 && parser->offset + (off_t)need + parser->skip + 4 > parser->inputSize) {
+                        return MET_ERR_SIZE;
+                    }
+                    parser->state = PARSE_PART_HASHES;
+                } else {
+                    header->numBlocks = 0;
+                    header->numTags = data[22] | (data[23] << 8) | (data[24] << 16) | ((unsigned int)data[25] << 24);
+                }
+                parserConsume(parser, need);
+                if (header->metVersion == 1 && (rc = parserBeginTags(parser)) != MET_OK) {
+                    return rc;
+                }
+                break;
+            }
+            
+            case PARSE_PART_HASHES: {
+                size_t len = parser->skip < (off_t)avail ? (size_t)parser->skip : avail;
+                parserConsume(parser, len);
+                parser->skip -= len;
+                if (parser->skip > 0) {
+                    return MET_OK;
+                }
+                parser->state = PARSE_NUM_TAGS;
+                break;
+            }
+            
+            case PARSE_NUM_TAGS:
+                if (avail < 4) {
+                    return MET_OK;
+                }
+                parser->header.numTags = data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+                parserConsume(parser, 4);
+                if ((rc = parserBeginTags(parser)) != MET_OK) {
+                    return rc;
+                }
+                break;
+            
+            case PARSE_TAGS: {
+                MetaTag tag;
+                size_t need;
+                
+                if (parser->tagIndex == parser->header.numTags) {
+                    parser->state = PARSE_DONE;
+                    if (visitor->onTrailer && (rc = visitor->onTrailer(parser->context, parser->offset)) != MET_OK) {
+                        return rc;
+                    }
+                    break;
+                }
+                
+                // Type and name length, then the value length or value
+                if (avail < 3) {
+                    return MET_OK;
+                }
+                tag.type = data[0];
+                tag.nameLength = data[1] | (data[2] << 8);
+                need = 3 + tag.nameLength;
+                if (tag.type == 2) {
+                    need += 2;
+                } else if (tag.type == 3) {
+                    need += 4;
+                } else {
+                    return MET_ERR_TAG_TYPE;
+                }
+                if ((unsigned int)tag.nameLength > parser->met.limits.maxStringLength) {
+                    return MET_ERR_LIMIT;
+                }
+                if ((rc = parserCheckTagEnd(parser, need)) != MET_OK) {
+                    return rc;
+                }
+                if (avail < need) {
+                    return MET_OK;
+                }
+                
+                unsigned char *value = data + 3 + tag.nameLength;
+                if (tag.type == 2) {
+                    tag.valueLength = value[0] | (value[1] << 8);
+                    tag.value.stringValue = (char *)value + 2;
+                    need += tag.valueLength;
+                    if ((unsigned int)tag.valueLength > parser->met.limits.maxStringLength) {
+                        return MET_ERR_LIMIT;
+                    }
+                    if ((rc = parserCheckTagEnd(parser, need)) != MET_OK) {
+                        return rc;
+                    }
+                    if (avail < need) {
+                        return MET_OK;
+                    }
+                } else {
+                    tag.valueLength = 0;
+                    tag.value.intValue = value[0] | (value[1] << 8) | (value[2] << 16) | ((unsigned int)value[3] << 24);
+                }
+                
+                // Terminate the borrowed strings in place. The byte after
+                // the name belongs to the value, which is decoded already;
+                // the byte after a string value may start the next tag.
+                // Large tags are traced from here to the end of the visit
+                int traced = traceTag(&parser->met, need);
+                double start = traced ? traceStart(&parser->met) : 0.0;
+                unsigned char saved = data[need];
+                tag.name = (char *)data + 3;
+                tag.name[tag.nameLength] = '\0';
+                data[need] = '\0';
+                classifyMetaTag(&tag);
+                MET_PROBE3(tag__decoded, tag.type, tag.nameLength, tag.valueLength);
+                
+                rc = visitor->onTag ? visitor->onTag(parser->context, &tag, parser->offset) : MET_OK;
+                data[need] = saved;
+                if (traced) {
+                    traceEnd(&parser->met, "tag", start, parser->offset, need);
+                }
+                if (rc != MET_OK) {
+                    return rc;
+                }
+                
+                parserConsume(parser, need);
+                parser->tagIndex++;
+                break;
+            }
+            
+            case PARSE_DONE:
+                break;
+        }
+    }
+    
+    return MET_OK;
+}
+
+/**
+ * Run the parser over newly buffered data. Returns MET_NEED_MORE until
+ * all tags have been visited, then MET_OK; errors are kept for later calls.
+ */
+static int parserAdvance(MetParser *parser) {
+    int rc = parserStep(parser);
+    
+    if (rc == MET_STOP) {
+        parser->state = PARSE_DONE;
+        rc = MET_OK;
+    }
+    if (rc != MET_OK) {
+        parser->error = rc;
+    } else if (parser->state != PARSE_DONE) {
+        rc = MET_NEED_MORE;
+    }
+    return rc;
+}
+
+/**
+ * Feed the rest of the file to a parser until all tags have been visited.
+ * Data is read straight into the parser buffer.
+ */
+static int parserRun(MetParser *parser, int fd) {
+    int rc = MET_NEED_MORE;
+    
+    while (rc == MET_NEED_MORE) {
+        if ((rc = parserReserve(parser, MET_READ_CHUNK)) != MET_OK) {
+            break;
+        }
+        
+        ssize_t count = countedRead(&parser->met, fd, parser->buffer + parser->end, MET_READ_CHUNK);
+        if (count == -1) {
+            rc = MET_ERR_IO;
+        } else if (count == 0) {
+            break; // End of file, finishMetParser reports truncation
+        } else {
+            parser->end += count;
+            rc = parserAdvance(parser);
+        }
+    }
+    
+    if (rc != MET_OK && rc != MET_NEED_MORE) {
+        parser->error = rc;
+    }
+    return finishMetParser(parser);
+}
+
+/**
+ * Prepare a parser for a walk that calls the visitor as data is fed
+ */
+static void initMetParser(MetParser *parser, const MetVisitor *visitor, void *context, const MetContext *met) {
+    memset(parser, 0, sizeof(MetParser));
+    parser->visitor = visitor;
+    parser->context = context;
+    if (met != NULL) {
+        parser->met = *met;
+    } else {
+        initMetContext(&parser->met);
+    }
+    parser->state = PARSE_HEADER;
+    parser->inputSize = -1;
+}
+
+/**
+ * Create an incremental parser that calls the visitor as data is fed with
+ * feedMetParser. Returns NULL if memory runs out. The parser is released
+ * with freeMetParser, after finishMetParser has reported the outcome.
+ */
+MetParser *createMetParser(const MetVisitor *visitor, void *context, const MetContext *met) {
+    MetParser *parser = (MetParser *)countedMalloc(met, sizeof(MetParser));
+    if (parser != NULL) {
+        initMetParser(parser, visitor, context, met);
+    }
+    return parser;
+}
+
+/**
+ * Tell an incremental parser the total size of its input, so counts and
+ * lengths that cannot fit are rejected before any data is buffered
+ */
+void setMetInputSize(MetParser *parser, off_t size) {
+    parser->inputSize = size;
+}
+
+/**
+ * Feed the next chunk of a file to an incremental parser. Returns
+ * MET_NEED_MORE while the file is incomplete, MET_OK once every tag has
+ * been visited (further data is ignored) or an error code.
+ */
+int feedMetParser(MetParser *parser, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    int rc;
+    
+    if (parser->error != MET_OK) {
+        return parser->error;
+    }
+    rc = parser->state == PARSE_DONE ? MET_OK : MET_NEED_MORE;
+    
+    // Copy at most one read chunk at a time so a large input does not
+    // have to be buffered as a whole
+    while (rc == MET_NEED_MORE && len > 0) {
+        size_t chunk = len < MET_READ_CHUNK ? len : MET_READ_CHUNK;
+        
+        if ((rc = parserReserve(parser, chunk)) != MET_OK) {
+            parser->error = rc;
+            break;
+        }
+        memcpy(parser->buffer + parser->end, bytes, chunk);
+        parser->end += chunk;
+        bytes += chunk;
+        len -= chunk;
+        
+        rc = parserAdvance(parser);
+    }
+    
+    return rc;
+}
+
+/**
+ * Tell an incremental parser that the input has ended and release its
+ * buffer. Returns MET_OK if the whole file was visited, MET_ERR_TRUNCATED
+ * if the data ended early or the first error.
+ */
+int finishMetParser(MetParser *parser) {
+    int rc = parser->error;
+    
+    if (rc == MET_OK && parser->state != PARSE_DONE) {
+        rc = MET_ERR_TRUNCATED;
+    }
+    free(parser->buffer);
+    parser->buffer = NULL;
+    parser->capacity = parser->start = parser->end = 0;
+    
+    return rc;
+}
+
+/**
+ * Free a parser from createMetParser
+ */
+void freeMetParser(MetParser *parser) {
+    if (parser != NULL) {
+        free(parser->buffer);
+        free(parser);
+    }
+}
+
+/**
+ * Walk a .part.met file from the beginning, calling the visitor for the
+ * header, for every meta tag as it is decoded and at the end of the tags.
+ */
+int visitMetFile(int fd, const MetVisitor *visitor, void *context, const MetContext *met) {
+    MetParser parser;
+    struct stat st;
+    
+    initMetParser(&parser, visitor, context, met);
+    
+    if (fstat(fd, &st) == -1 || seekTo(fd, 0, met) != MET_OK) {
+        return MET_ERR_IO;
+    }
+    if (S_ISREG(st.st_mode)) {
+        setMetInputSize(&parser, st.st_size);
+    }
+    return parserRun(&parser, fd);
+}
+
+/**
+ * Walk the meta tags of a file whose header has been read with
+ * readMetHeader. onHeader is not called.
+ */
+int visitMetTags(int fd, const MetHeader *header, const MetVisitor *visitor, void *context, const MetContext *met) {
+    MetParser parser;
+    
+    struct stat st;
+    int rc;
+    
+    initMetParser(&parser, visitor, context, met);
+    parser.state = PARSE_TAGS;
+    parser.header = *header;
+    parser.offset = header->tagsPosition;
+    
+    if (fstat(fd, &st) == -1) {
+        return MET_ERR_IO;
+    }
+    if (S_ISREG(st.st_mode)) {
+        setMetInputSize(&parser, st.st_size);
+    }
+    if ((rc = parserCheckTagCount(&parser)) != MET_OK) {
+        return rc;
+    }
+    return parserRun(&parser, fd);
+}
+
+/**
+ * Walk a .part.met file held in memory
+ */
+int visitMetBuffer(const void *data, size_t len, const MetVisitor *visitor, void *context, const MetContext *met) {
+    MetParser parser;
+    
+    initMetParser(&parser, visitor, context, met);
+    setMetInputSize(&parser, (off_t)len);
+    feedMetParser(&parser, data, len);
+    return finishMetParser(&parser);
+}
+
+/**
+ * Make an owned copy of a meta tag, such as one borrowed from a visitor
+ */
+MetaTag *copyMetaTag(const MetaTag *tag, const MetContext *met) {
+    MetaTag *copy = (MetaTag *)countedMalloc(met, sizeof(MetaTag));
+    if (copy == NULL) {
+        return NULL;
+    }
+    
+    *copy = *tag;
+    copy->name = (char *)countedMalloc(met, tag->nameLength + 1);
+    if (copy->name == NULL) {
+        free(copy);
+        return NULL;
+    }
+    memcpy(copy->name, tag->name, tag->nameLength);
+    copy->name[tag->nameLength] = '\0';
+    
+    if (tag->type == 2) { // String
+        copy->value.stringValue = (char *)countedMalloc(met, tag->valueLength + 1);
+        if (copy->value.stringValue == NULL) {
+            free(copy->name);
+            free(copy);
+            return NULL;
+        }
+        memcpy(copy->value.stringValue, tag->value.stringValue, tag->valueLength);
+        copy->value.stringValue[tag->valueLength] = '\0';
+    }
+    
+    return copy;
+}
+
+/**
+ * Parse an open .part.met file, keeping the tags decoded before any
+ * damage. Fails only if the header cannot be read; otherwise a damaged
+ * file is returned with partial set, the error in damage and the offset
+ * of the first undecodable byte in damageOffset.
+ */
+int salvageMetFile(int fd, MetFile *file, const MetContext *met) {
+    static const MetVisitor visitor = { collectMetHeader, collectMetTag, NULL };
+    CollectVisit visit = { file, met };
+    MetParser parser;
+    struct stat st;
+    
+    memset(file, 0, sizeof(MetFile));
+    initMetParser(&parser, &visitor, &visit, met);
+    
+    if (fstat(fd, &st) == -1 || seekTo(fd, 0, met) != MET_OK) {
+        return MET_ERR_IO;
+    }
+    if (S_ISREG(st.st_mode)) {
+        setMetInputSize(&parser, st.st_size);
+    }
+    parser.salvage = 1;
+    
+    int rc = parserRun(&parser, fd);
+    if (rc == MET_OK) {
+        return MET_OK;
+    }
+    
+    // Nothing to keep if the header is damaged or memory ran out
+    if (parser.state != PARSE_TAGS || rc == MET_ERR_NOMEM) {
+        freeMetFile(file);
+        return rc;
+    }
+    
+    // The header is complete even if the tag count failed its check
+    // before onHeader was called
+    file->header = parser.header;
+    file->partial = 1;
+    file->damage = rc;
+    file->damageOffset = parser.offset;
+    return MET_OK;
+}
+
+/**
+ * Check whether salvaged file a holds more than salvaged file b
+ */
+static int isMoreComplete(const MetFile *a, const MetFile *b) {
+    if (a->partial != b->partial) {
+        return !a->partial;
+    }
+    return a->numTags > b->numTags;
+}
+
+/**
+ * Salvage a .part.met file, falling back to the .part.met.bak copy that
+ * eMule keeps next to it when the file is damaged or unreadable. The more
+ * complete of the two is returned; fromBackup tells which one it was.
+ */
+int loadSalvagedMetFile(const char *path, MetFile *file, int *fromBackup, const MetContext *met) {
+    MetFile backup;
+    int rc = MET_ERR_IO;
+    int backupRc;
+    int fd;
+    
+    *fromBackup = 0;
+    memset(file, 0, sizeof(MetFile));
+    
+    if ((fd = open(path, O_RDONLY)) != -1) {
+        MET_PROBE2(file__open, path, fd);
+        rc = salvageMetFile(fd, file, met);
+        close(fd);
+    }
+    if (rc == MET_OK && !file->partial) {
+        return MET_OK;
+    }
+    
+    size_t length = strlen(path) + sizeof(".bak");
+    char *backupPath = (char *)countedMalloc(met, length);
+    if (backupPath == NULL) {
+        freeMetFile(file);
+        return MET_ERR_NOMEM;
+    }
+    snprintf(backupPath, length, "%s.bak", path);
+    
+    int saved = errno;
+    backupRc = MET_ERR_IO;
+    if ((fd = open(backupPath, O_RDONLY)) != -1) {
+        MET_PROBE2(file__open, backupPath, fd);
+        backupRc = salvageMetFile(fd, &backup, met);
+        close(fd);
+    }
+    free(backupPath);
+    
+    if (backupRc == MET_OK && (rc != MET_OK || isMoreComplete(&backup, file))) {
+        freeMetFile(file);
+        *file = backup;
+        *fromBackup = 1;
+        return MET_OK;
+    }
+    if (backupRc == MET_OK) {
+        freeMetFile(&backup);
+    }
+    
+    // Report the error of the original file
+    errno = saved;
+    return rc;
+}
+
+/**
+ * Schema of the special tags, the single source for their descriptions,
+ * printers and filter fields. Each entry is
+ * X(id, kind, key, field, description) where kind selects the value
+ * handlers below, key names the value in single field output (-n, -S,
+ * -d) and field is the --where field the value feeds.
+ */
+#define SPECIAL_TAGS(X) \
+    X(1,  String,     "filename",  MET_FIELD_NAME,       "Filename") \
+    X(2,  Size,       "filesize",  MET_FIELD_SIZE,       "File size in bytes") \
+    X(3,  String,     NULL,        MET_FIELD_COUNT,      "File type") \
+    X(4,  String,     NULL,        MET_FIELD_COUNT,      "File format") \
+    X(5,  Date,       "last_seen", MET_FIELD_LASTSEEN,   "Last time file was seen complete on network") \
+    X(8,  Size,       NULL,        MET_FIELD_DOWNLOADED, "Number of bytes downloaded so far") \
+    X(18, String,     NULL,        MET_FIELD_COUNT,      "Temporary (.part) filename") \
+    X(19, Integer,    NULL,        MET_FIELD_COUNT,      "Download priority (eDonkey/Overnet <0.49)") \
+    X(20, Status,     NULL,        MET_FIELD_STATUS,     "Download status") \
+    X(24, Priority,   NULL,        MET_FIELD_PRIORITY,   "Download priority") \
+    X(25, UlPriority, NULL,        MET_FIELD_ULPRIORITY, "Upload priority")
+
+/**
+ * Values of the enumerated special tags: X(value, description, detail)
+ * where detail is appended in verbose text output
+ */
+#define STATUS_VALUES(X) \
+    X(0, "Download status: Ready",            " - File is ready for download") \
+    X(1, "Download status: Empty",            "") \
+    X(2, "Download status: Waiting for hash", "") \
+    X(3, "Download status: Hashing",          "") \
+    X(4, "Download status: Error",            "") \
+    X(6, "Download status: Unknown",          "") \
+    X(7, "Download status: Paused",           " - Download is manually paused") \
+    X(8, "Download status: Completing",       "") \
+    X(9, "Download status: Completed",        " - Download is fully completed")
+
+#define PRIORITY_VALUES(X) \
+    X(0, "Download priority: Low",       "") \
+    X(1, "Download priority: Normal",    "") \
+    X(2, "Download priority: High",      "") \
+    X(3, "Download priority: Very high (eMule) / Highest/Horde (eDonkey/Overnet)", "") \
+    X(4, "Download priority: Very low (eMule)", "") \
+    X(5, "Download priority: Auto (eMule)",     "")
+
+#define UL_PRIORITY_VALUES(X) \
+    X(0, "Upload priority: Low",       "") \
+    X(1, "Upload priority: Normal",    "") \
+    X(2, "Upload priority: High",      "") \
+    X(3, "Upload priority: Very high", "") \
+    X(4, "Upload priority: Very low",  "") \
+    X(5, "Upload priority: Auto",      "")
+
+#define VALUE_DESCRIPTION_CASE(value, description, detail) case value: return description;
+#define VALUE_DETAIL_CASE(value, description, detail) case value: text = detail; break;
+
+/**
+ * Define the description lookup and verbose text details of an
+ * enumerated kind
+ */
+#define DEFINE_VALUE_LOOKUPS(kind, values, unknown) \
+    static const char *describe##kind(const char *description, int value) { \
+        (void)description; \
+        switch (value) { \
+            values(VALUE_DESCRIPTION_CASE) \
+            default: return unknown; \
+        } \
+    } \
+    static void print##kind##Text(FILE *out, const MetaTag *tag, int timeFormat) { \
+        const char *text = ""; \
+        (void)timeFormat; \
+        switch (tag->value.intValue) { \
+            values(VALUE_DETAIL_CASE) \
+        } \
+        fputs(text, out); \
+    }
+
+DEFINE_VALUE_LOOKUPS(Status, STATUS_VALUES, "Download status: Unknown")
+DEFINE_VALUE_LOOKUPS(Priority, PRIORITY_VALUES, "Download priority: Unknown")
+DEFINE_VALUE_LOOKUPS(UlPriority, UL_PRIORITY_VALUES, "Upload priority: Unknown")
+
+/**
+ * Description of kinds whose description does not depend on the value
+ */
+static const char *describeFixed(const char *description, int value) {
+    (void)value;
+    return description;
+}
+
+/**
+ * Verbose text details and extra JSON members of integer values
+ */
+static void printNoDetails(FILE *out, const MetaTag *tag, int timeFormat) {
+    (void)out;
+    (void)tag;
+    (void)timeFormat;
+}
+
+static void printSizeText(FILE *out, const MetaTag *tag, int timeFormat) {
+    (void)timeFormat;
+    fprintf(out, " (%.2f MB)", tag->value.intValue / 1048576.0);
+}
+
+static void printSizeJson(FILE *out, const MetaTag *tag, int timeFormat) {
+    (void)timeFormat;
+    fprintf(out, ",\"value_mb\":%.2f", tag->value.intValue / 1048576.0);
+}
+
+static void printDateText(FILE *out, const MetaTag *tag, int timeFormat) {
+    char date[MET_TIMESTAMP_SIZE];
+    fprintf(out, " (%s)", formatTimestamp(tag->value.intValue, timeFormat, date, sizeof(date)));
+}
+
+static void printDateJson(FILE *out, const MetaTag *tag, int timeFormat) {
+    char date[MET_TIMESTAMP_SIZE];
+    fprintf(out, ",\"value_date\":\"%s\"", formatTimestamp(tag->value.intValue, timeFormat, date, sizeof(date)));
+}
+
+/**
+ * Single field output (-n, -S, -d). Nothing is printed for a value of
+ * the wrong type.
+ */
+static void printStringField(FILE *out, const char *key, const MetaTag *tag, int verbose, int json_output, int timeFormat) {
+    (void)verbose;
+    (void)timeFormat;
+    if (tag->type != 2) {
+        return;
+    }
+    if (json_output) {
+        char *escapedValue = jsonEscapeString(tag->value.stringValue);
+        fprintf(out, "{\"%s\":\"%s\"}", key, escapedValue ? escapedValue : "");
+        free(escapedValue);
+    } else {
+        fprintf(out, "%s", tag->value.stringValue);
+    }
+}
+
+static void printIntegerField(FILE *out, const char *key, const MetaTag *tag, int verbose, int json_output, int timeFormat) {
+    (void)verbose;
+    (void)timeFormat;
+    if (tag->type != 3) {
+        return;
+    }
+    if (json_output) {
+        fprintf(out, "{\"%s\":%u}", key, tag->value.intValue);
+    } else {
+        fprintf(out, "%u", tag->value.intValue);
+    }
+}
+
+static void printSizeField(FILE *out, const char *key, const MetaTag *tag, int verbose, int json_output, int timeFormat) {
+    (void)timeFormat;
+    if (tag->type != 3) {
+        return;
+    }
+    if (json_output) {
+        fprintf(out, "{\"%s\":%u", key, tag->value.intValue);
+        if (verbose) {
+            fprintf(out, ",\"%s_mb\":%.2f", key, tag->value.intValue / 1048576.0);
+        }
+        fprintf(out, "}");
+    } else {
+        fprintf(out, "%u", tag->value.intValue);
+    }
+}
+
+static void printDateField(FILE *out, const char *key, const MetaTag *tag, int verbose, int json_output, int timeFormat) {
+    char date[MET_TIMESTAMP_SIZE];
+    
+    if (tag->type != 3) {
+        return;
+    }
+    if (json_output) {
+        fprintf(out, "{\"%s\":%u", key, tag->value.intValue);
+        if (verbose) {
+            fprintf(out, ",\"%s_date\":\"%s\"", key, formatTimestamp(tag->value.intValue, timeFormat, date, sizeof(date)));
+        }
+        fprintf(out, "}");
+    } else if (verbose) {
+        fprintf(out, "%s", formatTimestamp(tag->value.intValue, timeFormat, date, sizeof(date)));
+    } else {
+        fprintf(out, "%u", tag->value.intValue);
+    }
+}
+
+/**
+ * Handlers of each kind: describe, verbose text details, JSON extras and
+ * single field output
+ */
+#define String_HANDLERS     describeFixed,      printNoDetails,  printNoDetails, printStringField
+#define Integer_HANDLERS    describeFixed,      printNoDetails,  printNoDetails, printIntegerField
+#define Size_HANDLERS       describeFixed,      printSizeText,   printSizeJson,  printSizeField
+#define Date_HANDLERS       describeFixed,      printDateText,   printDateJson,  printDateField
+#define Status_HANDLERS     describeStatus,     printStatusText,     printNoDetails, printIntegerField
+#define Priority_HANDLERS   describePriority,   printPriorityText,   printNoDetails, printIntegerField
+#define UlPriority_HANDLERS describeUlPriority, printUlPriorityText, printNoDetails, printIntegerField
+
+/**
+ * Schema entry of a special tag ID
+ */
+typedef struct {
+    const char *description;  // NULL for unknown IDs
+    const char *key;          // Single field output name, or NULL
+    MetFilterField field;     // --where field, MET_FIELD_COUNT if none
+    const char *(*describe)(const char *description, int value);
+    void (*printText)(FILE *out, const MetaTag *tag, int timeFormat);
+    void (*printJson)(FILE *out, const MetaTag *tag, int timeFormat);
+    void (*printField)(FILE *out, const char *key, const MetaTag *tag, int verbose, int json_output, int timeFormat);
+} SpecialTagSchema;
+
+#define SPECIAL_TAG_ENTRY(id, kind, key, field, description) \
+    [id] = { description, key, field, kind##_HANDLERS },
+
+static const SpecialTagSchema specialTagSchema[256] = {
+    SPECIAL_TAGS(SPECIAL_TAG_ENTRY)
+};
+
+/**
+ * Return a description for known special tags
+ */
+const char *getSpecialTagDescription(int nameValue, int intValue) {
+    if (nameValue < 0 || nameValue > 255 || specialTagSchema[nameValue].description == NULL) {
+        return NULL;
+    }
+    const SpecialTagSchema *schema = &specialTagSchema[nameValue];
+    return schema->describe(schema->description, intValue);
+}
+
+/**
+ * Return a description for a gap tag
+ */
+const char *getGapTagDescription(unsigned char firstChar) {
+    switch (firstChar) {
+        case 9:
+            return "Start of gap (undownloaded area)";
+        case 10:
+            return "End of gap (undownloaded area)";
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Known standard tags, in the order of their standardIndex
+ */
+static const struct {
+    const char *name;
+    const char *description;
+} standardTags[] = {
+    { "Artist",  "Media file artist" },
+    { "Album",   "Media file album" },
+    { "Title",   "Media file title" },
+    { "length",  "Media file duration" },
+    { "bitrate", "Media file bitrate" },
+    { "codec",   "Media file codec" }
+};
+
+/**
+ * Perfect hash of the standard tag names:
+ * (3 * tolower(name[0]) + tolower(name[1]) + length) & 7 is distinct for
+ * every name above. Slots hold the standardTags index, -1 if unused.
+ * Adding a name means searching new multipliers that keep it collision-free.
+ */
+#define STANDARD_TAG_HASH(first, second, length) ((3 * (first) + (second) + (length)) & 7)
+
+static const signed char standardTagSlots[8] = { -1, -1, 2, 0, 1, 5, 4, 3 };
+
+/**
+ * Return the index of a standard tag name (case-insensitive), or -1
+ */
+int findStandardTag(const char *name, int length) {
+    if (length < 2) {
+        return -1;
+    }
+    
+    int index = standardTagSlots[STANDARD_TAG_HASH(tolower((unsigned char)name[0]),
+                                                   tolower((unsigned char)name[1]), length)];
+    if (index >= 0 && strlen(standardTags[index].name) == (size_t)length &&
+        strncasecmp(name, standardTags[index].name, length) == 0) {
+        return index;
+    }
+    return -1;
+}
+
+/**
+ * Return a description for known standard tags
+ */
+const char *getStandardTagDescription(const char *tagName) {
+    int index = findStandardTag(tagName, strlen(tagName));
+    return index >= 0 ? standardTags[index].description : NULL;
+}
+
+/**
+ * Work out the class, special ID and standard tag index of a tag.
+ * Called once when the tag is decoded.
+ */
+void classifyMetaTag(MetaTag *tag) {
+    tag->specialId = -1;
+    tag->standardIndex = -1;
+    
+    // Special tag (1-byte name)
+    if (tag->nameLength == 1) {
+        tag->tagClass = 1;
+        tag->specialId = (unsigned char)tag->name[0];
+    }
+    // Gap tag (name starts with 9 or 10)
+    else if (tag->nameLength >= 2 && (tag->name[0] == 9 || tag->name[0] == 10)) {
+        tag->tagClass = 2;
+    }
+    // Standard tag or unknown
+    else {
+        tag->standardIndex = findStandardTag(tag->name, tag->nameLength);
+        tag->tagClass = tag->standardIndex >= 0 ? 3 : 4;
+    }
+}
+
+/**
+ * Determine tag type for filtering
+ * Returns: 1=special, 2=gap, 3=standard, 4=unknown
+ */
+int determineTagType(MetaTag *tag) {
+    // Tags built outside the parser are classified on first use
+    if (tag->tagClass == 0) {
+        classifyMetaTag(tag);
+    }
+    return tag->tagClass;
+}
+
+/**
+ * Number of days between 1970-01-01 and a civil date
+ */
+static long daysFromCivil(long year, unsigned int month, unsigned int day) {
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    unsigned long yearOfEra = (unsigned long)(year - era * 400);
+    unsigned long dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned long dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + (long)dayOfEra - 719468;
+}
+
+/**
+ * Civil date of a number of days since 1970-01-01
+ */
+static void civilFromDays(long days, long *year, unsigned int *month, unsigned int *day) {
+    days += 719468;
+    long era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned long dayOfEra = (unsigned long)(days - era * 146097);
+    unsigned long yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    unsigned long dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    unsigned long monthIndex = (5 * dayOfYear + 2) / 153;
+    
+    *day = (unsigned int)(dayOfYear - (153 * monthIndex + 2) / 5 + 1);
+    *month = (unsigned int)(monthIndex < 10 ? monthIndex + 3 : monthIndex - 9);
+    *year = (long)yearOfEra + era * 400 + (*month <= 2);
+}
+
+/**
+ * Return the UTC offset of the local timezone at a timestamp
+ */
+static int offsetAt(time_t t, long *offset) {
+    struct tm local;
+    
+    if (localtime_r(&t, &local) == NULL) {
+        return 0;
+    }
+    *offset = (daysFromCivil(local.tm_year + 1900L, local.tm_mon + 1, local.tm_mday) * 86400 +
+               local.tm_hour * 3600L + local.tm_min * 60L + local.tm_sec) - (long)t;
+    return 1;
+}
+
+#ifdef HAVE_THREAD_LOCAL
+
+/**
+ * How far a cached offset reaches on either side of the timestamp it was
+ * looked up for, and the step of the search for the transitions that
+ * bound it. No zone changes its offset twice within one step.
+ */
+#define OFFSET_SPAN (366 * 86400L)
+#define OFFSET_STEP (7 * 86400L)
+
+/**
+ * UTC offset of the local timezone between two transitions, with the TZ
+ * it was looked up under
+ */
+typedef struct {
+    int valid;
+    time_t first;                 // First and last second with this offset
+    time_t last;
+    long offset;
+    int hasTz;                    // TZ was set, to the value in tz
+    char tz[128];
+} OffsetCache;
+
+static __thread OffsetCache offsetCache;
+
+/**
+ * Find the last second before (direction -1) or after (direction 1) a
+ * timestamp that still has its offset: step to the first probe with
+ * another offset, then bisect down to the second. The search stops at
+ * OFFSET_SPAN.
+ */
+static int findOffsetEdge(time_t t, long offset, int direction, time_t *edge) {
+    time_t same = t;
+    long other;
+    
+    for (long span = 0; span < OFFSET_SPAN; span += OFFSET_STEP) {
+        time_t differ = same + direction * OFFSET_STEP;
+        if (!offsetAt(differ, &other)) {
+            return 0;
+        }
+        if (other != offset) {
+            while (differ - same > 1 || same - differ > 1) {
+                time_t middle = same + (differ - same) / 2;
+                if (!offsetAt(middle, &other)) {
+                    return 0;
+                }
+                if (other == offset) {
+                    same = middle;
+                } else {
+                    differ = middle;
+                }
+            }
+            break;
+        }
+        same = differ;
+    }
+    *edge = same;
+    return 1;
+}
+
+/**
+ * Return the UTC offset of the local timezone at a timestamp. Each thread
+ * caches the offset with the previous and next transition around it, so
+ * localtime_r is only called again for a timestamp outside that range or
+ * after TZ changed. Returns 0 if localtime_r fails.
+ */
+static int localOffset(time_t t, long *offset) {
+    OffsetCache *cache = &offsetCache;
+    const char *tz = getenv("TZ");
+    int sameTz = (tz != NULL) == cache->hasTz && (tz == NULL || strcmp(tz, cache->tz) == 0);
+    
+    if (cache->valid && sameTz && t >= cache->first && t <= cache->last) {
+        *offset = cache->offset;
+        return 1;
+    }
+    if (!sameTz) {
+        // localtime_r need not read TZ again by itself
+        tzset();
+    }
+    
+    cache->valid = 0;
+    if (!offsetAt(t, offset)) {
+        return 0;
+    }
+    if (tz != NULL && strlen(tz) >= sizeof(cache->tz)) {
+        return 1;
+    }
+    if (findOffsetEdge(t, *offset, -1, &cache->first) && findOffsetEdge(t, *offset, 1, &cache->last)) {
+        cache->offset = *offset;
+        cache->hasTz = tz != NULL;
+        snprintf(cache->tz, sizeof(cache->tz), "%s", tz != NULL ? tz : "");
+        cache->valid = 1;
+    }
+    return 1;
+}
+
+#else
+
+/**
+ * Return the UTC offset of the local timezone at a timestamp. Without
+ * thread-local storage nothing is cached.
+ */
+static int localOffset(time_t t, long *offset) {
+    return offsetAt(t, offset);
+}
+
+#endif
+
+/**
+ * Format a 16 byte ED2K hash as 32 uppercase hexadecimal digits into a
+ * caller buffer of at least 33 bytes
+ */
+char *formatHash(const unsigned char *rawHash, char *hex) {
+    for (int i = 0; i < 16; i++) {
+        sprintf(hex + 2 * i, "%.2X", rawHash[i]);
+    }
+    return hex;
+}
+
+/**
+ * Format a Unix timestamp into a caller buffer of at least
+ * MET_TIMESTAMP_SIZE bytes, as local time ("2024-01-31 18:05:09") or,
+ * with MET_TIME_UTC, as ISO-8601 UTC ("2024-01-31T17:05:09Z"). Local
+ * time that cannot be determined is written as UTC, with its Z suffix.
+ * Safe to call from several threads.
+ */
+char *formatTimestamp(unsigned int timestamp, int timeFormat, char *buffer, size_t size) {
+    long long seconds = timestamp;
+    long offset;
+    
+    if (timeFormat != MET_TIME_UTC) {
+        if (localOffset((time_t)timestamp, &offset)) {
+            seconds += offset;
+        } else {
+            timeFormat = MET_TIME_UTC;
+        }
+    }
+    
+    long days = (long)(seconds >= 0 ? seconds / 86400 : (seconds - 86399) / 86400);
+    long secondOfDay = (long)(seconds - (long long)days * 86400);
+    long year;
+    unsigned int month;
+    unsigned int day;
+    civilFromDays(days, &year, &month, &day);
+    
+    snprintf(buffer, size, timeFormat == MET_TIME_UTC ? "%04ld-%02u-%02uT%02ld:%02ld:%02ldZ" : "%04ld-%02u-%02u %02ld:%02ld:%02ld",
+             year, month, day, secondOfDay / 3600, secondOfDay / 60 % 60, secondOfDay % 60);
+    
+    return buffer;
+}
+
+/**
+ * JSON escape a string
+ */
+char *jsonEscapeString(const char *str) {
+    if (str == NULL) return NULL;
+    
+    size_t len = strlen(str);
+    // Each character could expand up to "\\u00XX" (6 characters)
+    // so allocate enough space for the worst case
+    size_t escaped_len = len * 6 + 1;
+    
+    char *escaped = (char *)malloc(escaped_len);
+    if (escaped == NULL) {
+        return NULL;
+    }
+    
+    size_t j = 0;
+    for (size_t i = 0; i < len; i++) {
+        switch (str[i]) {
+            case '\\': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = '\\'; 
+                break;
+            case '"': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = '"'; 
+                break;
+            case '\b': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = 'b'; 
+                break;
+            case '\f': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = 'f'; 
+                break;
+            case '\n': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = 'n'; 
+                break;
+            case '\r': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = 'r'; 
+                break;
+            case '\t': 
+                escaped[j++] = '\\'; 
+                escaped[j++] = 't'; 
+                break;
+            default:
+                if ((unsigned char)str[i] < 32) {
+                    // Non-printable control characters
+                    sprintf(escaped + j, "\\u%04x", (unsigned char)str[i]);
+                    j += 6;
+                } else {
+                    escaped[j++] = str[i];
+                }
+                break;
+        }
+    }
+    escaped[j] = '\0';
+    
+    return escaped;
+}
+
+/**
+ * Print meta tag information with optional verbosity
+ */
+void printMetaTag(FILE *out, MetaTag *tag, int verbose, int json_output, int timeFormat) {
+    int tagType = determineTagType(tag);
+    
+    if (json_output) {
+        fprintf(out, "{\"type\":");
+        
+        // Tag type
+        switch (tagType) {
+            case 1: fprintf(out, "\"special\""); break;
+            case 2: fprintf(out, "\"gap\""); break;
+            case 3: fprintf(out, "\"standard\""); break;
+            case 4: fprintf(out, "\"unknown\""); break;
+        }
+        
+        // Tag ID for special tags
+        if (tagType == 1) {
+            fprintf(out, ",\"id\":%d", (unsigned char)tag->name[0]);
+        }
+        
+        // Tag name for non-special tags
+        if (tagType != 1) {
+            if (tagType == 2) {
+                // Gap tag
+                unsigned char firstChar = tag->name[0];
+                fprintf(out, ",\"gap_type\":");
+                if (firstChar == 9) {
+                    fprintf(out, "\"start\"");
+                } else if (firstChar == 10) {
+                    fprintf(out, "\"end\"");
+                } else {
+                    fprintf(out, "\"unknown\"");
+                }
+                
+                // Extract reference number
+                if (tag->nameLength > 1) {
+                    char refNum[tag->nameLength];
+                    memcpy(refNum, tag->name + 1, tag->nameLength - 1);
+                    refNum[tag->nameLength - 1] = '\0';
+                    fprintf(out, ",\"reference\":\"%s\"", refNum);
+                }
+            } else {
+                // Standard or unknown tag
+                char *escapedName = jsonEscapeString(tag->name);
+                fprintf(out, ",\"name\":\"%s\"", escapedName ? escapedName : "");
+                free(escapedName);
+            }
+        }
+        
+        // Description for known tags
+        if (tagType == 1) {
+            const char *desc = getSpecialTagDescription(tag->specialId, 
+                                                       tag->type == 3 ? tag->value.intValue : 0);
+            if (desc) {
+                char *escapedDesc = jsonEscapeString(desc);
+                fprintf(out, ",\"description\":\"%s\"", escapedDesc ? escapedDesc : "");
+                free(escapedDesc);
+            }
+        }
+        
+        // Value
+        if (tag->type == 3) { // Integer
+            fprintf(out, ",\"value\":%d", tag->value.intValue);
+            
+            // Add additional info for known special tags
+            if (tagType == 1 && specialTagSchema[tag->specialId].description) {
+                specialTagSchema[tag->specialId].printJson(out, tag, timeFormat);
+            }
+        } else { // String
+            char *escapedValue = jsonEscapeString(tag->value.stringValue);
+            fprintf(out, ",\"value\":\"%s\"", escapedValue ? escapedValue : "");
+            free(escapedValue);
+        }
+        
+        fprintf(out, "}");
+    } else {
+        // Special tag (1-byte name)
+        if (tagType == 1) {
+            int nameValue = tag->specialId;
+            fprintf(out, "Tag: (Special, %d) ", nameValue);
+            
+            const char *desc = NULL;
+            if (tag->type == 3) { // Integer
+                desc = getSpecialTagDescription(nameValue, tag->value.intValue);
+                if (desc) {
+                    fprintf(out, "%s = %d", desc, tag->value.intValue);
+                    
+                    // Extra details in verbose mode
+                    if (verbose) {
+                        specialTagSchema[nameValue].printText(out, tag, timeFormat);
+                    }
+                } else {
+                    fprintf(out, "Name: %d, Value: %d", nameValue, tag->value.intValue);
+                }
+            } else { // String
+                desc = getSpecialTagDescription(nameValue, 0);
+                if (desc) {
+                    fprintf(out, "%s = \"%s\"", desc, tag->value.stringValue);
+                } else {
+                    fprintf(out, "Name: %d, Value: \"%s\"", nameValue, tag->value.stringValue);
+                }
+            }
+        }
+        // Gap tag
+        else if (tagType == 2) {
+            const char *desc = getGapTagDescription(tag->name[0]);
+            if (desc) {
+                // Extract reference number
+                char refNum[tag->nameLength];
+                memcpy(refNum, tag->name + 1, tag->nameLength - 1);
+                refNum[tag->nameLength - 1] = '\0';
+                
+                fprintf(out, "Tag: (Gap) %s, Reference: %s", desc, refNum);
+                
+                if (tag->type == 3) { // Integer
+                    fprintf(out, ", Value: %d", tag->value.intValue);
+                    if (verbose) {
+                        fprintf(out, " (%.2f MB)", tag->value.intValue / 1048576.0);
+                    }
+                } else { // String
+                    fprintf(out, ", Value: \"%s\"", tag->value.stringValue);
+                }
+            } else {
+                fprintf(out, "Tag: Unrecognized gap tag");
+            }
+        }
+        // Standard tag
+        else if (tagType == 3) {
+            fprintf(out, "Tag: (Standard) %s = ", tag->name);
+            if (tag->type == 3) { // Integer
+                fprintf(out, "%d", tag->value.intValue);
+            } else { // String
+                fprintf(out, "\"%s\"", tag->value.stringValue);
+            }
+            if (verbose) {
+                fprintf(out, " - %s", standardTags[tag->standardIndex].description);
+            }
+        }
+        // Unknown tag
+        else {
+            fprintf(out, "Tag: (Unknown) Name: \"%s\", ", tag->name);
+            if (tag->type == 3) { // Integer
+                fprintf(out, "Value: %d", tag->value.intValue);
+            } else { // String
+                fprintf(out, "Value: \"%s\"", tag->value.stringValue);
+            }
+        }
+        
+        fprintf(out, "\n");
+    }
+}
+
+/**
+ * Display a specific special tag value (-n, -S, -d), or null in JSON mode
+ * if the file does not have it
+ */
+void displaySpecificField(FILE *out, const MetFile *file, int fieldType, int verbose, int json_output, int timeFormat) {
+    const SpecialTagSchema *schema = fieldType >= 0 && fieldType < 256 ? &specialTagSchema[fieldType] : NULL;
+    
+    if (schema == NULL || schema->key == NULL) {
+        return;
+    }
+    
+    const MetaTag *tag = findSpecialTag(file, fieldType);
+    if (tag != NULL) {
+        schema->printField(out, schema->key, tag, verbose, json_output, timeFormat);
+    } else if (json_output) {
+        fprintf(out, "{\"%s\":null}", schema->key);
+    }
+    // For script usage, output nothing if field not found
+}
+
+/**
+ * Display download progress information
+ */
+void displayProgress(FILE *out, unsigned int fileSize, unsigned int downloadedBytes, int json_output) {
+    double percentage = 0.0;
+    if (fileSize > 0) {
+        percentage = (downloadedBytes * 100.0) / fileSize;
+    }
+    
+    if (json_output) {
+        fprintf(out, "{\"total_bytes\":%u,\"downloaded_bytes\":%u,\"total_mb\":%.2f,\"downloaded_mb\":%.2f,\"percentage\":%.1f}",
+               fileSize, downloadedBytes,
+               fileSize / 1048576.0, downloadedBytes / 1048576.0,
+               percentage);
+    } else {
+        // For script usage, just output the percentage
+        fprintf(out, "%.1f", percentage);
+    }
+}
+
+/**
+ * A gap start or end tag, found by collectGaps and compactMetBuffer
+ */
+typedef struct {
+    const unsigned char *number;  // Gap number after the 0x09/0x0A byte
+    unsigned short length;        // Length of the gap number
+    unsigned char isEnd;
+    unsigned int index;           // Position among the meta tags
+    unsigned int value;
+} GapTag;
+
+/**
+ * Tag layout collected by compactMetBuffer
+ */
+typedef struct {
+    const unsigned char *data;
+    const MetContext *met;
+    off_t tagsPosition;
+    off_t *offsets;               // Start of every tag, then the end of the tags
+    unsigned int numTags;
+    GapTag *gapTags;
+    unsigned int numGapTags;
+} CompactVisit;
+
+/**
+ * Visitor callback sizing the tag layout of compactMetBuffer
+ */
+static int compactHeader(void *context, const MetHeader *header) {
+    CompactVisit *visit = (CompactVisit *)context;
+    
+    // The tag count has been checked against the input size
+    visit->tagsPosition = header->tagsPosition;
+    visit->offsets = (off_t *)countedMalloc(visit->met, ((size_t)header->numTags + 1) * sizeof(off_t));
+    visit->gapTags = (GapTag *)countedMalloc(visit->met, ((size_t)header->numTags + 1) * sizeof(GapTag));
+    return visit->offsets == NULL || visit->gapTags == NULL ? MET_ERR_NOMEM : MET_OK;
+}
+
+/**
+ * Visitor callback recording where each tag starts and which are gap tags
+ */
+static int compactTag(void *context, const MetaTag *tag, off_t offset) {
+    CompactVisit *visit = (CompactVisit *)context;
+    
+    if (tag->type == 3 && tag->nameLength >= 2 && (tag->name[0] == 9 || tag->name[0] == 10)) {
+        GapTag *gap = &visit->gapTags[visit->numGapTags++];
+        gap->number = visit->data + offset + 4;
+        gap->length = tag->nameLength - 1;
+        gap->isEnd = tag->name[0] == 10;
+        gap->index = visit->numTags;
+        gap->value = tag->value.intValue;
+    }
+    visit->offsets[visit->numTags++] = offset;
+    return MET_OK;
+}
+
+/**
+ * Visitor callback recording where the tags end
+ */
+static int compactTrailer(void *context, off_t endOffset) {
+    CompactVisit *visit = (CompactVisit *)context;
+    
+    visit->offsets[visit->numTags] = endOffset;
+    return MET_OK;
+}
+
+/**
+ * Compare the numbers of two gap tags
+ */
+static int compareGapNumbers(const GapTag *x, const GapTag *y) {
+    int rc = memcmp(x->number, y->number, x->length < y->length ? x->length : y->length);
+    
+    if (rc == 0 && x->length != y->length) {
+        rc = x->length < y->length ? -1 : 1;
+    }
+    return rc;
+}
+
+/**
+ * Order gap tags by number, starts before ends, then by position
+ */
+static int compareGapTags(const void *a, const void *b) {
+    const GapTag *x = (const GapTag *)a;
+    const GapTag *y = (const GapTag *)b;
+    int rc = compareGapNumbers(x, y);
+    
+    if (rc == 0 && x->isEnd != y->isEnd) {
+        rc = x->isEnd ? 1 : -1;
+    }
+    if (rc == 0) {
+        rc = x->index < y->index ? -1 : x->index > y->index;
+    }
+    return rc;
+}
+
+/**
+ * Order gap tags by position
+ */
+static int compareGapIndexes(const void *a, const void *b) {
+    const GapTag *x = (const GapTag *)a;
+    const GapTag *y = (const GapTag *)b;
+    
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Order gaps by start position
+ */
+static int compareGaps(const void *a, const void *b) {
+    const GapInfo *x = (const GapInfo *)a;
+    const GapInfo *y = (const GapInfo *)b;
+    
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**
+ * Pair the last start and the last end tag of every gap number, as
+ * clients do, into gaps ordered by start. Gaps without both tags, or
+ * empty ones, are dropped; numPairs counts the pairs found before that.
+ * Sorts tags. *result is NULL when there are no gaps.
+ */
+static int pairGapTags(GapTag *tags, unsigned int numTags, GapInfo **result, unsigned int *numGaps,
+                       unsigned int *numPairs, const MetContext *met) {
+    GapInfo *gaps = NULL;
+    
+    *result = NULL;
+    *numGaps = 0;
+    *numPairs = 0;
+    if (numTags == 0) {
+        return MET_OK;
+    }
+    if ((gaps = (GapInfo *)countedMalloc(met, numTags * sizeof(GapInfo))) == NULL) {
+        return MET_ERR_NOMEM;
+    }
+    
+    qsort(tags, numTags, sizeof(GapTag), compareGapTags);
+    for (unsigned int i = 0, j; i < numTags; i = j) {
+        const GapTag *start = NULL;
+        const GapTag *end = NULL;
+        
+        for (j = i; j < numTags && compareGapNumbers(&tags[i], &tags[j]) == 0; j++) {
+            if (tags[j].isEnd) {
+                end = &tags[j];
+            } else {
+                start = &tags[j];
+            }
+        }
+        if (start != NULL && end != NULL) {
+            (*numPairs)++;
+            if (start->value < end->value) {
+                gaps[*numGaps].start = start->value;
+                gaps[*numGaps].end = end->value;
+                (*numGaps)++;
+            }
+        }
+    }
+    qsort(gaps, *numGaps, sizeof(GapInfo), compareGaps);
+    
+    *result = gaps;
+    return MET_OK;
+}
+
+/**
+ * Collect the gaps of the gap tags into an array ordered by start, with
+ * the same pairing as compactMetBuffer
+ */
+int collectGaps(MetaTag **tags, int numTags, GapInfo **result, int *numGaps, const MetContext *met) {
+    GapTag *gapTags = NULL;
+    unsigned int count = 0;
+    unsigned int gapCount = 0;
+    unsigned int numPairs;
+    int rc;
+    
+    *result = NULL;
+    *numGaps = 0;
+    for (int i = 0; i < numTags; i++) {
+        if (tags[i]->type == 3 && tags[i]->nameLength >= 2 && (tags[i]->name[0] == 9 || tags[i]->name[0] == 10)) {
+            count++;
+        }
+    }
+    if (count > 0 && (gapTags = (GapTag *)countedMalloc(met, count * sizeof(GapTag))) == NULL) {
+        return MET_ERR_NOMEM;
+    }
+    
+    count = 0;
+    for (int i = 0; i < numTags; i++) {
+        if (tags[i]->type == 3 && tags[i]->nameLength >= 2 && (tags[i]->name[0] == 9 || tags[i]->name[0] == 10)) {
+            GapTag *gap = &gapTags[count++];
+            gap->number = (const unsigned char *)tags[i]->name + 1;
+            gap->length = tags[i]->nameLength - 1;
+            gap->isEnd = tags[i]->name[0] == 10;
+            gap->index = (unsigned int)i;
+            gap->value = tags[i]->value.intValue;
+        }
+    }
+    
+    rc = pairGapTags(gapTags, count, result, &gapCount, &numPairs, met);
+    free(gapTags);
+    if (rc != MET_OK) {
+        return rc;
+    }
+    
+    MET_PROBE2(gaps__collected, numTags, gapCount);
+    *numGaps = (int)gapCount;
+    return MET_OK;
+}
+
+/**
+ * Append a gap start or end tag named after gap number to out
+ */
+static size_t putGapTag(unsigned char *out, unsigned char kind, unsigned int number, unsigned int value) {
+    char name[16];
+    int length = snprintf(name, sizeof(name), "%u", number) + 1;
+    
+    out[0] = 3;
+    out[1] = length & 0xFF;
+    out[2] = (length >> 8) & 0xFF;
+    out[3] = kind;
+    memcpy(out + 4, name, length - 1);
+    out += 3 + length;
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+    out[2] = (value >> 16) & 0xFF;
+    out[3] = (value >> 24) & 0xFF;
+    return 3 + length + 4;
+}
+
+/**
+ * Rewrite the gap tags of a .part.met file held in memory. Gaps that
+ * overlap or touch are merged and the merged set is numbered from 0 in
+ * file order, in place of the first gap tag; every other tag and the
+ * header are copied byte for byte. As clients do, the last start and end
+ * tag of each gap number count, and gaps without both, or empty ones,
+ * are dropped. *result is a new buffer for the caller to free, or NULL if
+ * the gaps are compact already. info may be NULL.
+ */
+int compactMetBuffer(const void *data, size_t len, unsigned char **result, size_t *resultLen, MetCompaction *info,
+                     const MetContext *met) {
+    MetVisitor visitor = { compactHeader, compactTag, compactTrailer };
+    CompactVisit visit;
+    GapInfo *gaps = NULL;
+    unsigned int numPairs = 0;
+    unsigned int numGaps = 0;
+    int rc;
+    
+    *result = NULL;
+    *resultLen = 0;
+    memset(&visit, 0, sizeof(visit));
+    visit.data = (const unsigned char *)data;
+    visit.met = met;
+    
+    rc = visitMetBuffer(data, len, &visitor, &visit, met);
+    if (rc == MET_OK) {
+        rc = pairGapTags(visit.gapTags, visit.numGapTags, &gaps, &numGaps, &numPairs, met);
+    }
+    if (rc != MET_OK) {
+        free(visit.offsets);
+        free(visit.gapTags);
+        return rc;
+    }
+    
+    // Merge gaps that overlap or touch
+    unsigned int merged = 0;
+    for (unsigned int i = 0; i < numGaps; i++) {
+        if (merged > 0 && gaps[i].start <= gaps[merged - 1].end) {
+            if (gaps[i].end > gaps[merged - 1].end) {
+                gaps[merged - 1].end = gaps[i].end;
+            }
+        } else {
+            gaps[merged++] = gaps[i];
+        }
+    }
+    
+    if (info != NULL) {
+        info->gapsBefore = numPairs;
+        info->gapsAfter = merged;
+        info->droppedTags = visit.numGapTags - 2 * numPairs;
+    }
+    
+    // Nothing to do unless tags go away
+    if (2 * merged < visit.numGapTags) {
+        const unsigned char *bytes = (const unsigned char *)data;
+        size_t size = len + (size_t)merged * 2 * (3 + 1 + 10 + 4);
+        unsigned char *out = (unsigned char *)countedMalloc(met, size);
+        unsigned int numTags = visit.numTags - visit.numGapTags + 2 * merged;
+        size_t pos = (size_t)visit.tagsPosition - 4;
+        unsigned int nextGap = 0;
+        
+        if (out == NULL) {
+            free(gaps);
+            free(visit.offsets);
+            free(visit.gapTags);
+            return MET_ERR_NOMEM;
+        }
+        
+        // Gap tags are sorted by number now; find them by position
+        qsort(visit.gapTags, visit.numGapTags, sizeof(GapTag), compareGapIndexes);
+        
+        memcpy(out, bytes, pos);
+        out[pos++] = numTags & 0xFF;
+        out[pos++] = (numTags >> 8) & 0xFF;
+        out[pos++] = (numTags >> 16) & 0xFF;
+        out[pos++] = (numTags >> 24) & 0xFF;
+        for (unsigned int i = 0; i < visit.numTags; i++) {
+            if (nextGap < visit.numGapTags && visit.gapTags[nextGap].index == i) {
+                if (nextGap++ == 0) {
+                    for (unsigned int g = 0; g < merged; g++) {
+                        pos += putGapTag(out + pos, 9, g, gaps[g].start);
+                        pos += putGapTag(out + pos, 10, g, gaps[g].end);
+                    }
+                }
+                continue;
+            }
+            size_t length = (size_t)(visit.offsets[i + 1] - visit.offsets[i]);
+            memcpy(out + pos, bytes + visit.offsets[i], length);
+            pos += length;
+        }
+        
+        // Anything after the tags is kept too
+        memcpy(out + pos, bytes + visit.offsets[visit.numTags], len - (size_t)visit.offsets[visit.numTags]);
+        pos += len - (size_t)visit.offsets[visit.numTags];
+        
+        *result = out;
+        *resultLen = pos;
+    }
+    
+    free(gaps);
+    free(visit.offsets);
+    free(visit.gapTags);
+    return MET_OK;
+}
+
+/**
+ * Visualize file download status with gaps
+ */
+void visualizeFileStatus(FILE *out, GapInfo *gaps, int numGaps, unsigned int fileSize, unsigned int downloadedBytes, int json_output) {
+    const int barWidth = 70; // Width of visualization bar
+    
+    if (json_output) {
+        fprintf(out, "{\"visualization\":{");
+        fprintf(out, "\"total_size\":%u,\"total_size_mb\":%.2f,", fileSize, fileSize / 1048576.0);
+        fprintf(out, "\"downloaded\":%u,\"downloaded_mb\":%.2f,", downloadedBytes, downloadedBytes / 1048576.0);
+        double perc = 0.0;
+        if (fileSize > 0) {
+            perc = (downloadedBytes * 100.0) / fileSize;
+        }
+        fprintf(out, "\"percentage\":%.1f,", perc);
+        
+        // Gap statistics
+        fprintf(out, "\"gaps\":{\"count\":%d,", numGaps);
+        
+        if (numGaps > 0) {
+            unsigned int totalGapSize = 0;
+            for (int i = 0; i < numGaps; i++) {
+                totalGapSize += (gaps[i].end - gaps[i].start);
+            }
+            
+            double gapPerc = 0.0;
+            if (fileSize > 0) {
+                gapPerc = (totalGapSize * 100.0) / fileSize;
+            }
+            fprintf(out, "\"total_size\":%u,\"total_size_mb\":%.2f,\"percentage\":%.1f,",
+                   totalGapSize, totalGapSize / 1048576.0, gapPerc);
+            
+            // Add gap details
+            fprintf(out, "\"details\":[");
+            for (int i = 0; i < numGaps; i++) {
+                fprintf(out, "{\"start\":%u,\"end\":%u,\"size\":%u,\"size_mb\":%.2f}",
+                       gaps[i].start, gaps[i].end,
+                       gaps[i].end - gaps[i].start,
+                       (gaps[i].end - gaps[i].start) / 1048576.0);
+                
+                if (i < numGaps - 1) {
+                    fprintf(out, ",");
+                }
+            }
+            fprintf(out, "]");
+        } else {
+            fprintf(out, "\"total_size\":0,\"total_size_mb\":0.0,\"percentage\":0.0,\"details\":[]");
+        }
+        
+        fprintf(out, "}");  // Close gaps object
+        
+        // Visual representation as array
+        fprintf(out, ",\"bar\":[");
+        for (int i = 0; i < barWidth; i++) {
+            // Calculate file position this bar position represents
+            unsigned int posStart = (unsigned int)((i / (double)barWidth) * fileSize);
+            unsigned int posEnd = (unsigned int)(((i + 1) / (double)barWidth) * fileSize);
+            
+            // Check if this position is in a gap
+            int inGap = 0;
+            for (int j = 0; j < numGaps; j++) {
+                // If there's any overlap between this bar position and a gap
+                if (!(posEnd <= gaps[j].start || posStart >= gaps[j].end)) {
+                    inGap = 1;
+                    break;
+                }
+            }
+            
+            fprintf(out, "%d", inGap ? 0 : 1);
+            if (i < barWidth - 1) {
+                fprintf(out, ",");
+            }
+        }
+        fprintf(out, "]");
+        
+        fprintf(out, "}}");  // Close visualization and outer objects
+    } else {
+        fprintf(out, "\n=== FILE DOWNLOAD VISUALIZATION ===\n");
+        
+        // Show basic info
+        fprintf(out, "Total size: %u bytes (%.2f MB)\n", fileSize, fileSize / 1048576.0);
+        double perc = 0.0;
+        if (fileSize > 0) {
+            perc = (downloadedBytes * 100.0) / fileSize;
+        }
+        fprintf(out, "Downloaded: %u bytes (%.2f MB, %.1f%%)\n",
+               downloadedBytes,
+               downloadedBytes / 1048576.0,
+               perc);
+        
+        // Draw progress bar
+        fprintf(out, "[");
+        
+        // For each position in the progress bar
+        for (int i = 0; i < barWidth; i++) {
+            // Calculate file position this bar position represents
+            unsigned int posStart = (unsigned int)((i / (double)barWidth) * fileSize);
+            unsigned int posEnd = (unsigned int)(((i + 1) / (double)barWidth) * fileSize);
+            
+            // Check if this position is in a gap
+            int inGap = 0;
+            for (int j = 0; j < numGaps; j++) {
+                // If there's any overlap between this bar position and a gap
+                if (!(posEnd <= gaps[j].start || posStart >= gaps[j].end)) {
+                    inGap = 1;
+                    break;
+                }
+            }
+            
+            // Print character based on gap status
+            if (inGap) {
+                fprintf(out, " "); // Gap/missing part
+            } else {
+                fprintf(out, "#"); // Downloaded part
+            }
+        }
+        
+        fprintf(out, "]\n\n");
+        
+        // Show gap statistics
+        if (numGaps > 0) {
+            fprintf(out, "Gaps: %d\n", numGaps);
+            
+            // Calculate total gap size
+            unsigned int totalGapSize = 0;
+            for (int i = 0; i < numGaps; i++) {
+                totalGapSize += (gaps[i].end - gaps[i].start);
+            }
+            
+            double gapPerc = 0.0;
+            if (fileSize > 0) {
+                gapPerc = (totalGapSize * 100.0) / fileSize;
+            }
+            fprintf(out, "Total gap size: %.2f MB (%.1f%% of file)\n\n",
+                   totalGapSize / 1048576.0,
+                   gapPerc);
+        }
+    }
+}
+
+/**
+ * Node types of a compiled filter expression
+ */
+typedef enum {
+    NODE_CMP,             // Field comparison
+    NODE_AND,             // Logical and of left and right
+    NODE_OR,              // Logical or of left and right
+    NODE_NOT              // Logical negation of left
+} FilterNodeType;
+
+/**
+ * Comparison operators
+ */
+typedef enum {
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE,
+    OP_MATCH              // Substring match (names only)
+} FilterOp;
+
+/**
+ * Node of a compiled filter expression
+ */
+typedef struct {
+    FilterNodeType type;
+    MetFilterField field; // Compared field (NODE_CMP)
+    FilterOp op;          // Comparison operator (NODE_CMP)
+    double number;        // Numeric operand
+    char *text;           // String operand (name comparisons)
+    int left;             // Index of the left/only child
+    int right;            // Index of the right child
+} FilterNode;
+
+#define FILTER_MAX_NODES 64
+
+/**
+ * Compiled filter expression: a predicate tree stored in a flat array
+ */
+struct MetFilter {
+    FilterNode nodes[FILTER_MAX_NODES];
+    int numNodes;
+    int root;
+    unsigned int fields;  // Bitmask of referenced fields
+    const char *expr;     // Source expression, for error messages
+    const char *pos;      // Parser position
+    const char *error;    // Syntax error message, if compiling failed
+    int errorOffset;      // Offset of the syntax error in the expression
+};
+
+/**
+ * Field values gathered while tags are decoded
+ */
+typedef struct {
+    double values[MET_FIELD_COUNT];
+    char *name;           // Filename, only copied when referenced
+    unsigned int known;   // Bitmask of fields whose value is final
+    unsigned int present; // Bitmask of fields found in the file
+} FilterState;
+
+/**
+ * Names accepted for each field
+ */
+static const struct {
+    const char *name;
+    MetFilterField field;
+} filterFieldNames[] = {
+    { "name",       MET_FIELD_NAME },
+    { "filename",   MET_FIELD_NAME },
+    { "size",       MET_FIELD_SIZE },
+    { "downloaded", MET_FIELD_DOWNLOADED },
+    { "remaining",  MET_FIELD_REMAINING },
+    { "progress",   MET_FIELD_PROGRESS },
+    { "lastseen",   MET_FIELD_LASTSEEN },
+    { "date",       MET_FIELD_LASTSEEN },
+    { "status",     MET_FIELD_STATUS },
+    { "prio",       MET_FIELD_PRIORITY },
+    { "priority",   MET_FIELD_PRIORITY },
+    { "ulprio",     MET_FIELD_ULPRIORITY },
+    { "tags",       MET_FIELD_TAGS },
+    { "version",    MET_FIELD_VERSION },
+    { NULL,         MET_FIELD_COUNT }
+};
+
+/**
+ * Symbolic values for status and priority fields
+ */
+static const struct {
+    const char *name;
+    int value;
+} filterStatusNames[] = {
+    { "ready", 0 }, { "empty", 1 }, { "waiting", 2 }, { "hashing", 3 },
+    { "error", 4 }, { "unknown", 6 }, { "paused", 7 }, { "completing", 8 },
+    { "completed", 9 }, { "complete", 9 }, { NULL, 0 }
+}, filterPriorityNames[] = {
+    { "low", 0 }, { "normal", 1 }, { "high", 2 }, { "veryhigh", 3 },
+    { "highest", 3 }, { "verylow", 4 }, { "auto", 5 }, { NULL, 0 }
+};
+
+/**
+ * Record a syntax error in a filter expression. Only the first error is
+ * kept. Returns -1 so that parse functions can return it directly.
+ */
+static int filterSyntaxError(MetFilter *filter, const char *message) {
+    if (filter->error == NULL) {
+        filter->error = message;
+        filter->errorOffset = (int)(filter->pos - filter->expr);
+    }
+    return -1;
+}
+
+/**
+ * Skip whitespace in a filter expression
+ */
+static void filterSkipSpace(MetFilter *filter) {
+    while (isspace((unsigned char)*filter->pos)) {
+        filter->pos++;
+    }
+}
+
+/**
+ * Append a node to a filter and return its index
+ */
+static int filterAddNode(MetFilter *filter, FilterNodeType type, int left, int right) {
+    if (left < 0 || (type != NODE_NOT && type != NODE_CMP && right < 0)) {
+        return -1;
+    }
+    if (filter->numNodes >= FILTER_MAX_NODES) {
+        return filterSyntaxError(filter, "expression too long");
+    }
+    FilterNode *node = &filter->nodes[filter->numNodes];
+    memset(node, 0, sizeof(FilterNode));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return filter->numNodes++;
+}
+
+/**
+ * Parse the operand of a comparison for the given field
+ */
+static int filterParseValue(MetFilter *filter, FilterNode *node) {
+    char word[256];
+    size_t len = 0;
+    
+    filterSkipSpace(filter);
+    
+    // Quoted string or bare word
+    if (*filter->pos == '"' || *filter->pos == '\'') {
+        char quote = *filter->pos++;
+        while (*filter->pos && *filter->pos != quote) {
+            if (len < sizeof(word) - 1) {
+                word[len++] = *filter->pos;
+            }
+            filter->pos++;
+        }
+        if (*filter->pos != quote) {
+            return filterSyntaxError(filter, "unterminated string");
+        }
+        filter->pos++;
+    } else {
+        while (*filter->pos && !isspace((unsigned char)*filter->pos) &&
+               strchr("()&|!<>=~", *filter->pos) == NULL) {
+            if (len < sizeof(word) - 1) {
+                word[len++] = *filter->pos;
+            }
+            filter->pos++;
+        }
+        if (len == 0) {
+            return filterSyntaxError(filter, "missing value");
+        }
+    }
+    word[len] = '\0';
+    
+    // Filenames are compared as strings
+    if (node->field == MET_FIELD_NAME) {
+        if (node->op != OP_EQ && node->op != OP_NE && node->op != OP_MATCH) {
+            return filterSyntaxError(filter, "names only support ==, != and ~");
+        }
+        node->text = strdup(word);
+        if (node->text == NULL) {
+            return filterSyntaxError(filter, "out of memory");
+        }
+        return 0;
+    }
+    
+    if (node->op == OP_MATCH) {
+        return filterSyntaxError(filter, "~ only applies to names");
+    }
+    
+    // Symbolic status and priority values
+    if (node->field == MET_FIELD_STATUS || node->field == MET_FIELD_PRIORITY ||
+        node->field == MET_FIELD_ULPRIORITY) {
+        int value = filterValueNumber(node->field, word);
+        if (value != -1) {
+            node->number = value;
+            return 0;
+        }
+    }
+    
+    // Dates (YYYY-MM-DD, local time) for the last seen field
+    if (node->field == MET_FIELD_LASTSEEN) {
+        struct tm tm_info;
+        char rest;
+        memset(&tm_info, 0, sizeof(tm_info));
+        if (sscanf(word, "%d-%d-%d%c", &tm_info.tm_year, &tm_info.tm_mon,
+                   &tm_info.tm_mday, &rest) == 3) {
+            tm_info.tm_year -= 1900;
+            tm_info.tm_mon -= 1;
+            tm_info.tm_isdst = -1;
+            node->number = (double)mktime(&tm_info);
+            return 0;
+        }
+    }
+    
+    // Numbers with optional binary size suffix (K, M, G, T) or percent sign
+    char *end;
+    node->number = strtod(word, &end);
+    if (end == word) {
+        return filterSyntaxError(filter, "invalid value");
+    }
+    switch (toupper((unsigned char)*end)) {
+        case 'K': node->number *= 1024.0; end++; break;
+        case 'M': node->number *= 1048576.0; end++; break;
+        case 'G': node->number *= 1073741824.0; end++; break;
+        case 'T': node->number *= 1099511627776.0; end++; break;
+        case '%': end++; break;
+    }
+    if (toupper((unsigned char)*end) == 'I') {
+        end++;
+    }
+    if (toupper((unsigned char)*end) == 'B') {
+        end++;
+    }
+    if (*end != '\0') {
+        return filterSyntaxError(filter, "invalid value suffix");
+    }
+    
+    return 0;
+}
+
+static int filterParseOr(MetFilter *filter);
+
+/**
+ * Parse a comparison, negation or parenthesized expression
+ */
+static int filterParseUnary(MetFilter *filter) {
+    filterSkipSpace(filter);
+    
+    if (*filter->pos == '!' && filter->pos[1] != '=') {
+        filter->pos++;
+        int child = filterParseUnary(filter);
+        return filterAddNode(filter, NODE_NOT, child, -1);
+    }
+    
+    if (*filter->pos == '(') {
+        filter->pos++;
+        int child = filterParseOr(filter);
+        if (child < 0) {
+            return -1;
+        }
+        filterSkipSpace(filter);
+        if (*filter->pos != ')') {
+            return filterSyntaxError(filter, "missing ')'");
+        }
+        filter->pos++;
+        return child;
+    }
+    
+    // Field name
+    const char *start = filter->pos;
+    while (isalnum((unsigned char)*filter->pos) || *filter->pos == '_') {
+        filter->pos++;
+    }
+    size_t len = filter->pos - start;
+    if (len == 0) {
+        return filterSyntaxError(filter, "expected field name");
+    }
+    
+    MetFilterField field = MET_FIELD_COUNT;
+    for (int i = 0; filterFieldNames[i].name; i++) {
+        if (strlen(filterFieldNames[i].name) == len &&
+            strncasecmp(start, filterFieldNames[i].name, len) == 0) {
+            field = filterFieldNames[i].field;
+            break;
+        }
+    }
+    if (field == MET_FIELD_COUNT) {
+        filter->pos = start;
+        return filterSyntaxError(filter, "unknown field");
+    }
+    
+    // Operator
+    FilterOp op;
+    filterSkipSpace(filter);
+    if (strncmp(filter->pos, "<=", 2) == 0) {
+        op = OP_LE;
+        filter->pos += 2;
+    } else if (strncmp(filter->pos, ">=", 2) == 0) {
+        op = OP_GE;
+        filter->pos += 2;
+    } else if (strncmp(filter->pos, "==", 2) == 0) {
+        op = OP_EQ;
+        filter->pos += 2;
+    } else if (strncmp(filter->pos, "!=", 2) == 0) {
+        op = OP_NE;
+        filter->pos += 2;
+    } else if (*filter->pos == '<') {
+        op = OP_LT;
+        filter->pos++;
+    } else if (*filter->pos == '>') {
+        op = OP_GT;
+        filter->pos++;
+    } else if (*filter->pos == '=') {
+        op = OP_EQ;
+        filter->pos++;
+    } else if (*filter->pos == '~') {
+        op = OP_MATCH;
+        filter->pos++;
+    } else {
+        return filterSyntaxError(filter, "expected comparison operator");
+    }
+    
+    int index = filterAddNode(filter, NODE_CMP, 0, 0);
+    if (index < 0) {
+        return -1;
+    }
+    FilterNode *node = &filter->nodes[index];
+    node->field = field;
+    node->op = op;
+    if (filterParseValue(filter, node) < 0) {
+        return -1;
+    }
+    
+    // Derived fields depend on the fields they are computed from
+    filter->fields |= 1u << field;
+    if (field == MET_FIELD_REMAINING || field == MET_FIELD_PROGRESS) {
+        filter->fields |= (1u << MET_FIELD_SIZE) | (1u << MET_FIELD_DOWNLOADED);
+    }
+    
+    return index;
+}
+
+/**
+ * Parse a sequence of comparisons joined by &&
+ */
+static int filterParseAnd(MetFilter *filter) {
+    int left = filterParseUnary(filter);
+    
+    while (left >= 0) {
+        filterSkipSpace(filter);
+        if (strncmp(filter->pos, "&&", 2) != 0) {
+            return left;
+        }
+        filter->pos += 2;
+        int right = filterParseUnary(filter);
+        left = filterAddNode(filter, NODE_AND, left, right);
+    }
+    return -1;
+}
+
+/**
+ * Parse a sequence of conjunctions joined by ||
+ */
+static int filterParseOr(MetFilter *filter) {
+    int left = filterParseAnd(filter);
+    
+    while (left >= 0) {
+        filterSkipSpace(filter);
+        if (strncmp(filter->pos, "||", 2) != 0) {
+            return left;
+        }
+        filter->pos += 2;
+        int right = filterParseAnd(filter);
+        left = filterAddNode(filter, NODE_OR, left, right);
+    }
+    return -1;
+}
+
+/**
+ * Free memory used by a compiled filter
+ */
+void freeMetFilter(MetFilter *filter) {
+    if (filter == NULL) {
+        return;
+    }
+    for (int i = 0; i < filter->numNodes; i++) {
+        free(filter->nodes[i].text);
+    }
+    free(filter);
+}
+
+/**
+ * Compile a --where expression into a predicate tree. Returns MET_OK with
+ * the filter stored in *filter, MET_ERR_NOMEM, or MET_ERR_SYNTAX with the
+ * message and offset of the error stored in error and errorOffset.
+ */
+int createMetFilter(const char *expr, MetFilter **result, const char **error, int *errorOffset) {
+    MetFilter *filter = (MetFilter *)malloc(sizeof(MetFilter));
+    
+    *result = NULL;
+    if (filter == NULL) {
+        return MET_ERR_NOMEM;
+    }
+    filter->numNodes = 0;
+    filter->fields = 0;
+    filter->expr = expr;
+    filter->pos = expr;
+    filter->error = NULL;
+    filter->errorOffset = 0;
+    
+    filter->root = filterParseOr(filter);
+    
+    if (filter->root >= 0) {
+        filterSkipSpace(filter);
+        if (*filter->pos != '\0') {
+            filterSyntaxError(filter, "unexpected trailing input");
+        }
+    }
+    
+    if (filter->error != NULL) {
+        *error = filter->error;
+        *errorOffset = filter->errorOffset;
+        freeMetFilter(filter);
+        return MET_ERR_SYNTAX;
+    }
+    *result = filter;
+    return MET_OK;
+}
+
+/**
+ * Evaluate a filter node against the fields known so far
+ */
+static int evaluateFilterNode(const MetFilter *filter, int index, const FilterState *state) {
+    const FilterNode *node = &filter->nodes[index];
+    int left, right;
+    
+    switch (node->type) {
+        case NODE_AND:
+            left = evaluateFilterNode(filter, node->left, state);
+            if (left == MET_FILTER_FALSE) {
+                return MET_FILTER_FALSE;
+            }
+            right = evaluateFilterNode(filter, node->right, state);
+            if (right == MET_FILTER_FALSE) {
+                return MET_FILTER_FALSE;
+            }
+            return (left == MET_FILTER_TRUE && right == MET_FILTER_TRUE) ? MET_FILTER_TRUE : MET_FILTER_UNKNOWN;
+            
+        case NODE_OR:
+            left = evaluateFilterNode(filter, node->left, state);
+            if (left == MET_FILTER_TRUE) {
+                return MET_FILTER_TRUE;
+            }
+            right = evaluateFilterNode(filter, node->right, state);
+            if (right == MET_FILTER_TRUE) {
+                return MET_FILTER_TRUE;
+            }
+            return (left == MET_FILTER_FALSE && right == MET_FILTER_FALSE) ? MET_FILTER_FALSE : MET_FILTER_UNKNOWN;
+            
+        case NODE_NOT:
+            left = evaluateFilterNode(filter, node->left, state);
+            return left == MET_FILTER_UNKNOWN ? MET_FILTER_UNKNOWN : !left;
+            
+        case NODE_CMP:
+            break;
+    }
+    
+    if (!(state->known & (1u << node->field))) {
+        return MET_FILTER_UNKNOWN;
+    }
+    
+    // Comparisons against fields missing from the file never match
+    if (!(state->present & (1u << node->field))) {
+        return MET_FILTER_FALSE;
+    }
+    
+    if (node->field == MET_FIELD_NAME) {
+        if (node->op == OP_MATCH) {
+            return strstr(state->name, node->text) != NULL;
+        }
+        return (strcmp(state->name, node->text) == 0) == (node->op == OP_EQ);
+    }
+    
+    double value = state->values[node->field];
+    switch (node->op) {
+        case OP_LT: return value < node->number;
+        case OP_LE: return value <= node->number;
+        case OP_GT: return value > node->number;
+        case OP_GE: return value >= node->number;
+        case OP_EQ: return value == node->number;
+        case OP_NE: return value != node->number;
+        default:    return MET_FILTER_FALSE;
+    }
+}
+
+/**
+ * Record the value of a field and derive dependent fields
+ */
+static void setFilterField(FilterState *state, MetFilterField field, double value) {
+    const unsigned int sizeBits = (1u << MET_FIELD_SIZE) | (1u << MET_FIELD_DOWNLOADED);
+    
+    state->values[field] = value;
+    state->known |= 1u << field;
+    state->present |= 1u << field;
+    
+    if ((state->known & sizeBits) == sizeBits) {
+        double size = state->values[MET_FIELD_SIZE];
+        double downloaded = state->values[MET_FIELD_DOWNLOADED];
+        state->values[MET_FIELD_REMAINING] = size - downloaded;
+        state->values[MET_FIELD_PROGRESS] = size > 0 ? (downloaded * 100.0) / size : 0.0;
+        state->known |= (1u << MET_FIELD_REMAINING) | (1u << MET_FIELD_PROGRESS);
+        state->present |= (1u << MET_FIELD_REMAINING) | (1u << MET_FIELD_PROGRESS);
+    }
+}
+
+/**
+ * Mark every field as final once all tags are decoded: fields still
+ * unknown are missing from the file. Size and downloaded bytes default
+ * to 0 like the progress output.
+ */
+static void completeFilterState(FilterState *state) {
+    if (!(state->known & (1u << MET_FIELD_SIZE))) {
+        setFilterField(state, MET_FIELD_SIZE, 0);
+    }
+    if (!(state->known & (1u << MET_FIELD_DOWNLOADED))) {
+        setFilterField(state, MET_FIELD_DOWNLOADED, 0);
+    }
+    state->known = ~0u;
+}
+
+/**
+ * Visitor state for evaluating a filter while tags are decoded, in front
+ * of the visitor that receives the tags
+ */
+typedef struct {
+    const MetFilter *filter;
+    FilterState state;
+    int result;                   // MET_FILTER_UNKNOWN until decided
+    const MetVisitor *visitor;    // May be NULL
+    void *context;
+    const MetContext *met;
+} FilterMatch;
+
+/**
+ * Start matching a filter against a file, with the header fields known
+ */
+static void initFilterMatch(FilterMatch *match, const MetFilter *filter, const MetHeader *header,
+                            const MetVisitor *visitor, void *context, const MetContext *met) {
+    memset(match, 0, sizeof(FilterMatch));
+    match->filter = filter;
+    match->visitor = visitor;
+    match->context = context;
+    match->met = met;
+    setFilterField(&match->state, MET_FIELD_TAGS, header->numTags);
+    setFilterField(&match->state, MET_FIELD_VERSION, header->metVersion == 0 ? 14.0 : 14.1);
+    match->result = evaluateFilterNode(filter, filter->root, &match->state);
+}
+
+/**
+ * Record the filter field of a special tag and decide the filter if the
+ * field is referenced. The filename is only copied when the filter
+ * refers to it.
+ */
+static int filterMatchValue(FilterMatch *match, const MetaTag *tag) {
+    FilterState *state = &match->state;
+    
+    if (tag->specialId < 0 || specialTagSchema[tag->specialId].description == NULL) {
+        return MET_OK;
+    }
+    
+    MetFilterField field = specialTagSchema[tag->specialId].field;
+    if (field == MET_FIELD_COUNT || !(match->filter->fields & (1u << field))) {
+        return MET_OK;
+    }
+    if (field == MET_FIELD_NAME && tag->type == 2) {
+        char *name = (char *)countedMalloc(match->met, tag->valueLength + 1);
+        if (name == NULL) {
+            return MET_ERR_NOMEM;
+        }
+        memcpy(name, tag->value.stringValue, tag->valueLength);
+        name[tag->valueLength] = '\0';
+        free(state->name);
+        state->name = name;
+        state->known |= 1u << MET_FIELD_NAME;
+        state->present |= 1u << MET_FIELD_NAME;
+    } else if (field != MET_FIELD_NAME && tag->type == 3) {
+        setFilterField(state, field, (unsigned int)tag->value.intValue);
+    } else {
+        return MET_OK;
+    }
+    
+    match->result = evaluateFilterNode(match->filter, match->filter->root, state);
+    return MET_OK;
+}
+
+/**
+ * Visitor callback deciding the filter as tags are decoded. A rejected
+ * file ends the walk at once; a matching one ends it too unless the inner
+ * visitor wants the remaining tags.
+ */
+static int filterMatchTag(void *context, const MetaTag *tag, off_t offset) {
+    FilterMatch *match = (FilterMatch *)context;
+    int rc;
+    
+    if (match->result == MET_FILTER_UNKNOWN && (rc = filterMatchValue(match, tag)) != MET_OK) {
+        return rc;
+    }
+    if (match->result == MET_FILTER_FALSE) {
+        return MET_STOP;
+    }
+    if (match->visitor == NULL || match->visitor->onTag == NULL) {
+        return match->result == MET_FILTER_TRUE ? MET_STOP : MET_OK;
+    }
+    return match->visitor->onTag(match->context, tag, offset);
+}
+
+/**
+ * Visitor callback deciding a filter that is still open after the last
+ * tag: fields never seen are missing from the file
+ */
+static int filterMatchTrailer(void *context, off_t endOffset) {
+    FilterMatch *match = (FilterMatch *)context;
+    
+    if (match->result == MET_FILTER_UNKNOWN) {
+        completeFilterState(&match->state);
+        match->result = evaluateFilterNode(match->filter, match->filter->root, &match->state);
+    }
+    if (match->result == MET_FILTER_TRUE && match->visitor != NULL && match->visitor->onTrailer != NULL) {
+        return match->visitor->onTrailer(match->context, endOffset);
+    }
+    return MET_OK;
+}
+
+/**
+ * Walk the meta tags of a file whose header has been read with
+ * readMetHeader, deciding the filter in the same pass. The filter sees
+ * each tag before the visitor does. The walk ends as soon as the file is
+ * rejected, or as soon as it matches if the visitor has no onTag, so
+ * string values and the tags behind the deciding ones are never decoded
+ * for nothing. A tag repeated after the outcome is decided does not
+ * change it. matched receives MET_FILTER_TRUE or MET_FILTER_FALSE; with a
+ * NULL filter every file matches.
+ */
+int visitMatchingTags(int fd, const MetHeader *header, const MetFilter *filter,
+                      const MetVisitor *visitor, void *context, int *matched, const MetContext *met) {
+    static const MetVisitor matchVisitor = { NULL, filterMatchTag, filterMatchTrailer };
+    FilterMatch match;
+    int rc = MET_OK;
+    
+    if (filter == NULL) {
+        *matched = MET_FILTER_TRUE;
+        return visitor != NULL ? visitMetTags(fd, header, visitor, context, met) : MET_OK;
+    }
+    
+    // A filter on the header fields alone may need no tags at all
+    initFilterMatch(&match, filter, header, visitor, context, met);
+    int needTags = match.result == MET_FILTER_UNKNOWN ||
+                   (match.result == MET_FILTER_TRUE && visitor != NULL && visitor->onTag != NULL);
+    if (needTags) {
+        rc = visitMetTags(fd, header, &matchVisitor, &match, met);
+    }
+    free(match.state.name);
+    *matched = match.result;
+    return rc;
+}
+
+/**
+ * Read the meta tags of a file whose header has been read with
+ * readMetHeader, if it passes the filter. The filter is decided while the
+ * tags are decoded; a rejected file keeps no tags.
+ */
+int readMatchingTags(int fd, MetFile *file, const MetFilter *filter, int *matched, const MetContext *met) {
+    static const MetVisitor visitor = { NULL, collectMetTag, NULL };
+    CollectVisit visit = { file, met };
+    
+    file->tags = NULL;
+    file->numTags = 0;
+    file->fileSize = 0;
+    file->downloadedBytes = 0;
+    memset(file->special, 0, sizeof(file->special));
+    
+    int rc = visitMatchingTags(fd, &file->header, filter, &visitor, &visit, matched, met);
+    if (rc != MET_OK || *matched != MET_FILTER_TRUE) {
+        freeMetFile(file);
+    }
+    return rc;
+}
+
+/**
+ * Run the filter over the tags of a file that is already in memory, such
+ * as a salvaged one, with the same rules as visitMatchingTags
+ */
+int matchFilterTags(const MetFilter *filter, const MetFile *file, int *matched, const MetContext *met) {
+    FilterMatch match;
+    int rc = MET_OK;
+    
+    initFilterMatch(&match, filter, &file->header, NULL, NULL, met);
+    for (unsigned int i = 0; i < file->numTags && match.result == MET_FILTER_UNKNOWN && rc == MET_OK; i++) {
+        rc = filterMatchValue(&match, file->tags[i]);
+    }
+    if (rc == MET_OK) {
+        filterMatchTrailer(&match, 0);
+        *matched = match.result;
+    }
+    free(match.state.name);
+    return rc;
+}
+
+/**
+ * Return the status or priority value of a name used by --where, or -1 if
+ * the name is unknown
+ */
+int filterValueNumber(MetFilterField field, const char *name) {
+    if (field == MET_FIELD_STATUS) {
+        for (int i = 0; filterStatusNames[i].name; i++) {
+            if (strcasecmp(name, filterStatusNames[i].name) == 0) {
+                return filterStatusNames[i].value;
+            }
+        }
+    } else {
+        for (int i = 0; filterPriorityNames[i].name; i++) {
+            if (strcasecmp(name, filterPriorityNames[i].name) == 0) {
+                return filterPriorityNames[i].value;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return the name used by --where for a status or priority value
+ */
+const char *filterValueName(MetFilterField field, int value) {
+    if (field == MET_FIELD_STATUS) {
+        for (int i = 0; filterStatusNames[i].name; i++) {
+            if (filterStatusNames[i].value == value) {
+                return filterStatusNames[i].name;
+            }
+        }
+    } else {
+        for (int i = 0; filterPriorityNames[i].name; i++) {
+            if (filterPriorityNames[i].value == value) {
+                return filterPriorityNames[i].name;
+            }
+        }
+    }
+    return NULL;
+}
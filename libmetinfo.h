@@ -0,0 +1,245 @@
+#ifndef LIBMETINFO_H
+#define LIBMETINFO_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * Error codes returned by the parse functions
+ */
+#define MET_OK              0   // Success
+#define MET_ERR_IO          1   // Read or seek error, errno is set
+#define MET_ERR_TRUNCATED   2   // File ends in the middle of a field
+#define MET_ERR_FORMAT      3   // Unrecognized or invalid file format
+#define MET_ERR_TAG_TYPE    4   // Unrecognized meta tag type
+#define MET_ERR_NOMEM       5   // Memory allocation error
+#define MET_ERR_SYNTAX      6   // Invalid filter expression
+#define MET_STOP            7   // Returned by a visitor to end the walk early
+#define MET_NEED_MORE       8   // Incremental parser needs more data
+#define MET_ERR_SIZE        9   // Tag or block count larger than the file can hold
+#define MET_ERR_LIMIT      10   // Count or length above the configured limit
+
+/**
+ * Limits on counts and lengths read from a file, checked before anything
+ * is allocated for them (see MetContext)
+ */
+typedef struct {
+    unsigned int maxTags;         // Meta tags per file
+    unsigned int maxBlocks;       // Part hashes of a 14.0 file
+    unsigned int maxStringLength; // Length of a tag name or string value
+} MetLimits;
+
+#define MET_DEFAULT_MAX_TAGS    1048576
+#define MET_DEFAULT_MAX_BLOCKS  65535
+#define MET_DEFAULT_MAX_STRING  65535
+
+#define MET_MIN_TAG_SIZE        5   // Type, name length and empty string value
+
+/**
+ * Counters updated by the parses of a MetContext that points to them
+ */
+typedef struct {
+    unsigned long long readCalls;       // read() system calls
+    unsigned long long bytesRead;       // Bytes returned by read()
+    unsigned long long seekCalls;       // lseek() system calls
+    unsigned long long allocations;     // Heap allocations and reallocations
+    unsigned long long allocatedBytes;  // Bytes requested from the heap
+} MetStats;
+
+/**
+ * Receives a span of library work from the parses of a MetContext with
+ * a tracer. Times are CLOCK_MONOTONIC seconds; offset and size give the
+ * bytes of the file the span covers.
+ */
+typedef void (*MetSpanCallback)(void *context, const char *name, double start, double end, off_t offset, size_t size);
+
+/**
+ * Limits, counters and tracing of a parse, passed to every function that
+ * reads a file, allocates for one or checks a limit. NULL stands for the
+ * default limits without counters or tracing. The library keeps no state
+ * of its own, so threads can parse at the same time; a context that
+ * counts or traces must only be used by one of them at a time.
+ */
+typedef struct {
+    MetLimits limits;
+    MetStats *stats;              // Counters to update, or NULL
+    MetSpanCallback tracer;       // Span callback, or NULL
+    void *tracerContext;          // Passed to tracer
+    size_t traceThreshold;        // Smallest tag traced on its own
+} MetContext;
+
+/**
+ * Structure to store a meta tag
+ */
+typedef struct {
+    int type;             // 2=String, 3=Integer
+    int nameLength;       // Length of the name
+    char *name;           // Tag name
+    int valueLength;      // Length of the value (strings only)
+    union {
+        char *stringValue;  // String value
+        int intValue;       // Integer value
+    } value;
+    int tagClass;         // 1=special, 2=gap, 3=standard, 4=unknown, 0=not classified
+    int specialId;        // Name byte of special tags, -1 otherwise
+    int standardIndex;    // Index of known standard tags, -1 otherwise
+} MetaTag;
+
+/**
+ * Structure to store gap information
+ */
+typedef struct {
+    unsigned int start;   // Gap start position (bytes)
+    unsigned int end;     // Gap end position (bytes)
+} GapInfo;
+
+/**
+ * Header fields of a .part.met file
+ */
+typedef struct {
+    int metVersion;           // 0 = Version 14.0, 1 = Version 14.1
+    const char *versionStr;   // "14.0" or "14.1"
+    unsigned char rawHash[16];// ED2K hash bytes
+    char hash[33];            // ED2K hash as uppercase hexadecimal string
+    int numBlocks;            // Number of part hashes (14.0 only)
+    off_t tagsPosition;       // Offset of the first meta tag
+    unsigned int numTags;     // Number of meta tags
+} MetHeader;
+
+/**
+ * A parsed .part.met file. The caller owns the structure and releases the
+ * tags with freeMetFile.
+ */
+typedef struct {
+    MetHeader header;
+    MetaTag **tags;               // Decoded meta tags
+    unsigned int numTags;         // Number of decoded meta tags
+    unsigned int fileSize;        // File size in bytes (special tag 2)
+    unsigned int downloadedBytes; // Bytes downloaded so far (special tag 8)
+    MetaTag *special[256];        // Last tag with each special tag ID, or NULL
+    int partial;                  // Set by salvageMetFile if tags were lost
+    int damage;                   // Error that stopped a partial parse
+    off_t damageOffset;           // Offset of the first undecodable byte
+} MetFile;
+
+/**
+ * Gap counts reported by compactMetBuffer
+ */
+typedef struct {
+    unsigned int gapsBefore;      // Gaps with a start and an end tag
+    unsigned int gapsAfter;       // Gaps left after merging
+    unsigned int droppedTags;     // Stale copies and gap tags without a partner
+} MetCompaction;
+
+/**
+ * Timestamp formats for formatTimestamp and the printers
+ */
+#define MET_TIME_LOCAL      0   // Local time, "2024-01-31 18:05:09"
+#define MET_TIME_UTC        1   // ISO-8601 UTC, "2024-01-31T17:05:09Z"
+#define MET_TIMESTAMP_SIZE  32  // Buffer size for a formatted timestamp
+
+/**
+ * Callbacks for visitMetFile. Every meta tag is passed as soon as it is
+ * decoded: its name and string value point into the read buffer and are
+ * only valid during the call (use copyMetaTag to keep one). Callbacks may
+ * be NULL. Returning anything but MET_OK ends the walk with that code;
+ * MET_STOP ends it without an error.
+ */
+typedef struct {
+    int (*onHeader)(void *context, const MetHeader *header);
+    int (*onTag)(void *context, const MetaTag *tag, off_t offset);
+    int (*onTrailer)(void *context, off_t endOffset);
+} MetVisitor;
+
+/**
+ * Incremental parser, see createMetParser. Its state is private to the
+ * library.
+ */
+typedef struct MetParser MetParser;
+
+/**
+ * Fields that can be referenced in a --where expression
+ */
+typedef enum {
+    MET_FIELD_NAME,           // Filename (special tag 1)
+    MET_FIELD_SIZE,           // File size in bytes (special tag 2)
+    MET_FIELD_DOWNLOADED,     // Downloaded bytes (special tag 8)
+    MET_FIELD_REMAINING,      // File size minus downloaded bytes
+    MET_FIELD_PROGRESS,       // Download percentage
+    MET_FIELD_LASTSEEN,       // Last seen complete timestamp (special tag 5)
+    MET_FIELD_STATUS,         // Download status (special tag 20)
+    MET_FIELD_PRIORITY,       // Download priority (special tag 24)
+    MET_FIELD_ULPRIORITY,     // Upload priority (special tag 25)
+    MET_FIELD_TAGS,           // Number of meta tags
+    MET_FIELD_VERSION,        // .part.met version (14.0 or 14.1)
+    MET_FIELD_COUNT
+} MetFilterField;
+
+/**
+ * Compiled filter expression, see createMetFilter. Its layout is private
+ * to the library.
+ */
+typedef struct MetFilter MetFilter;
+
+/**
+ * Filter result: the outcome may not be known until more tags are decoded
+ */
+#define MET_FILTER_FALSE    0
+#define MET_FILTER_TRUE     1
+#define MET_FILTER_UNKNOWN -1
+
+/* Parsing */
+const char *metErrorString(int error);
+void initMetContext(MetContext *met);
+int readMetHeader(int fd, MetHeader *header, const MetContext *met);
+int readMetaTag(int fd, MetaTag **tag, const MetContext *met);
+void freeMetaTag(MetaTag *tag);
+int readMetTags(int fd, MetFile *file, const MetContext *met);
+int parseMetFile(int fd, MetFile *file, const MetContext *met);
+int parseMetBuffer(const void *data, size_t len, MetFile *file, const MetContext *met);
+int loadMetFile(const char *path, MetFile *file, const MetContext *met);
+int salvageMetFile(int fd, MetFile *file, const MetContext *met);
+int loadSalvagedMetFile(const char *path, MetFile *file, int *fromBackup, const MetContext *met);
+void freeMetFile(MetFile *file);
+const MetaTag *findSpecialTag(const MetFile *file, int id);
+int visitMetFile(int fd, const MetVisitor *visitor, void *context, const MetContext *met);
+int visitMetTags(int fd, const MetHeader *header, const MetVisitor *visitor, void *context, const MetContext *met);
+int visitMetBuffer(const void *data, size_t len, const MetVisitor *visitor, void *context, const MetContext *met);
+MetParser *createMetParser(const MetVisitor *visitor, void *context, const MetContext *met);
+void setMetInputSize(MetParser *parser, off_t size);
+int feedMetParser(MetParser *parser, const void *data, size_t len);
+int finishMetParser(MetParser *parser);
+void freeMetParser(MetParser *parser);
+MetaTag *copyMetaTag(const MetaTag *tag, const MetContext *met);
+int collectGaps(MetaTag **tags, int numTags, GapInfo **gaps, int *numGaps, const MetContext *met);
+int compactMetBuffer(const void *data, size_t len, unsigned char **result, size_t *resultLen, MetCompaction *info,
+                     const MetContext *met);
+
+/* Tag classification and descriptions */
+const char *getSpecialTagDescription(int nameValue, int intValue);
+const char *getGapTagDescription(unsigned char firstChar);
+const char *getStandardTagDescription(const char *tagName);
+int findStandardTag(const char *name, int length);
+void classifyMetaTag(MetaTag *tag);
+int determineTagType(MetaTag *tag);
+
+/* Formatting */
+char *formatHash(const unsigned char *rawHash, char *hex);
+char *formatTimestamp(unsigned int timestamp, int timeFormat, char *buffer, size_t size);
+char *jsonEscapeString(const char *str);
+void printMetaTag(FILE *out, MetaTag *tag, int verbose, int json_output, int timeFormat);
+void displaySpecificField(FILE *out, const MetFile *file, int fieldType, int verbose, int json_output, int timeFormat);
+void displayProgress(FILE *out, unsigned int fileSize, unsigned int downloadedBytes, int json_output);
+void visualizeFileStatus(FILE *out, GapInfo *gaps, int numGaps, unsigned int fileSize, unsigned int downloadedBytes, int json_output);
+
+/* Filter expressions */
+int createMetFilter(const char *expr, MetFilter **filter, const char **error, int *errorOffset);
+void freeMetFilter(MetFilter *filter);
+int visitMatchingTags(int fd, const MetHeader *header, const MetFilter *filter,
+                      const MetVisitor *visitor, void *context, int *matched, const MetContext *met);
+int readMatchingTags(int fd, MetFile *file, const MetFilter *filter, int *matched, const MetContext *met);
+int matchFilterTags(const MetFilter *filter, const MetFile *file, int *matched, const MetContext *met);
+const char *filterValueName(MetFilterField field, int value);
+int filterValueNumber(MetFilterField field, const char *name);
+
+#endif
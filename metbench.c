@@ -0,0 +1,913 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmetinfo.h"
+
+/**
+ * End-to-end benchmark: runs the metinfo binary over sets of .part.met
+ * files once per file and scenario, and reports throughput and per-file
+ * latency percentiles as JSON. With --check it instead compares repeated
+ * batch runs against a stored baseline.
+ */
+
+#define BATCH_FILES     1000    // Files per invocation of a batch run
+#define MAX_ARGS        8       // Scenario arguments plus program and files
+
+#define TIME_TOLERANCE      100.0   // Default allowed rise in percent, timings
+#define COUNTER_TOLERANCE   5.0     // Default allowed rise in percent, --stats counters
+#define MAD_THRESHOLD       3.0     // Rises within this many scaled MADs are noise
+
+/**
+ * A way of running metinfo: the output path it exercises
+ */
+typedef struct {
+    const char *name;
+    const char *args[MAX_ARGS];
+    const char *cheaperThan;  // Scenario it must beat on every set in --check, or NULL
+} Scenario;
+
+static const Scenario scenarios[] = {
+    { "text",       { NULL },                          NULL },
+    { "json",       { "-j", NULL },                    NULL },
+    { "visualize",  { "-z", NULL },                    NULL },
+    { "hash",       { "-e", NULL },                    NULL },
+    { "name",       { "-n", NULL },                    NULL },
+    { "size",       { "-S", NULL },                    NULL },
+    { "date",       { "-d", NULL },                    NULL },
+    { "progress",   { "-p", NULL },                    NULL },
+    { "metversion", { "-m", NULL },                    NULL },
+    { "tagcount",   { "-c", NULL },                    NULL },
+    { "where",      { "-w", "progress > 95", NULL },   "text" }     // Few files match
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/**
+ * A named set of input files
+ */
+typedef struct {
+    const char *name;
+    char **paths;
+    off_t *sizes;
+    size_t count;
+    size_t capacity;
+    off_t bytes;              // Total size of the files
+} InputSet;
+
+/**
+ * Benchmark settings
+ */
+typedef struct {
+    const char *metinfo;      // Binary under test
+    const char *label;        // Free text identifying the build
+    const char *scenarios;    // Comma separated scenario names, NULL = all
+    size_t samples;           // Latency samples wanted per scenario
+    double maxTime;           // Seconds per scenario after the first pass
+    int batch;                // Also time multi-file invocations
+    int runs;                 // Repeated batch runs per scenario (--check)
+    const char *check;        // Baseline to compare against, or NULL
+    const char *update;       // Baseline to write, or NULL
+} BenchOptions;
+
+/**
+ * Metrics compared against the baseline, all of them per file and worse
+ * when higher
+ */
+typedef enum {
+    METRIC_TIME,              // Microseconds per file in a batch run
+    METRIC_READS,             // read() calls per file
+    METRIC_SEEKS,             // lseek() calls per file
+    METRIC_ALLOCATIONS,       // Heap allocations per file
+    METRIC_COUNT
+} Metric;
+
+static const char *metricNames[METRIC_COUNT] = {
+    "us_per_file", "reads_per_file", "seeks_per_file", "allocs_per_file"
+};
+
+/**
+ * A baseline value, or a measurement of the current build
+ */
+typedef struct {
+    char set[64];
+    char scenario[64];
+    Metric metric;
+    double value;             // Median for timings
+    double mad;               // Median absolute deviation, 0 for counters
+    double tolerance;         // Allowed rise in percent
+} CheckEntry;
+
+/**
+ * Baseline entries and the measurements of a --check run
+ */
+typedef struct {
+    CheckEntry *baseline;
+    size_t numBaseline;
+    CheckEntry *current;
+    size_t numCurrent;
+    size_t capacity;
+    int regressions;
+    int notCheaper;           // Metrics of a scenario not below its cheaperThan
+} CheckReport;
+
+/**
+ * Current time in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Add a file to a set
+ */
+static void addInput(InputSet *set, const char *path, off_t size) {
+    if (set->count == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : 64;
+        set->paths = realloc(set->paths, set->capacity * sizeof(char *));
+        set->sizes = realloc(set->sizes, set->capacity * sizeof(off_t));
+        if (set->paths == NULL || set->sizes == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+    }
+    set->paths[set->count] = strdup(path);
+    if (set->paths[set->count] == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    set->sizes[set->count++] = size;
+    set->bytes += size;
+}
+
+/**
+ * Add a file, or every .part.met file below a directory, to a set
+ */
+static void addPath(InputSet *set, const char *path) {
+    struct stat st;
+    
+    if (stat(path, &st) == -1) {
+        err(EXIT_FAILURE, "Unable to open %s", path);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        addInput(set, path, st.st_size);
+        return;
+    }
+    
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        err(EXIT_FAILURE, "Unable to open directory %s", path);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        
+        char *child = malloc(strlen(path) + length + 2);
+        if (child == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        sprintf(child, "%s/%s", path, entry->d_name);
+        if (lstat(child, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                addPath(set, child);
+            } else if (length >= 9 && strcmp(entry->d_name + length - 9, ".part.met") == 0) {
+                addInput(set, child, st.st_size);
+            }
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+/**
+ * Run metinfo with output discarded and return the elapsed time. Standard
+ * error goes to errorPath, or is discarded if it is NULL. Sets failed if
+ * metinfo crashed or exited with a status above 1 (1 is what metinfo
+ * returns for damaged files and unmatched filters).
+ */
+static double runMetinfo(const BenchOptions *options, const Scenario *scenario,
+                         char **files, size_t numFiles, const char *errorPath, int *failed) {
+    char **argv = malloc((numFiles + MAX_ARGS + 2) * sizeof(char *));
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status;
+    int argc = 0;
+    
+    if (argv == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    argv[argc++] = (char *)options->metinfo;
+    for (int i = 0; scenario->args[i] != NULL; i++) {
+        argv[argc++] = (char *)scenario->args[i];
+    }
+    for (size_t i = 0; i < numFiles; i++) {
+        argv[argc++] = files[i];
+    }
+    argv[argc] = NULL;
+    
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, errorPath ? errorPath : "/dev/null",
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    
+    double start = now();
+    int error = posix_spawn(&pid, options->metinfo, &actions, NULL, argv, NULL);
+    if (error != 0) {
+        errno = error;
+        err(EXIT_FAILURE, "Cannot run %s", options->metinfo);
+    }
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            err(EXIT_FAILURE, "waitpid");
+        }
+    }
+    double elapsed = now() - start;
+    
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv);
+    *failed = !WIFEXITED(status) || WEXITSTATUS(status) > 1;
+    return elapsed;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Nearest-rank percentile of sorted samples
+ */
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t rank = (size_t)(p * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Check whether a scenario was selected with --scenarios
+ */
+static int scenarioSelected(const BenchOptions *options, const char *name) {
+    if (options->scenarios == NULL) {
+        return 1;
+    }
+    size_t length = strlen(name);
+    for (const char *p = options->scenarios; *p; ) {
+        const char *comma = strchr(p, ',');
+        size_t itemLength = comma ? (size_t)(comma - p) : strlen(p);
+        if (itemLength == length && strncmp(p, name, length) == 0) {
+            return 1;
+        }
+        p += itemLength + (comma != NULL);
+    }
+    return 0;
+}
+
+/**
+ * Benchmark one scenario over a set and print its JSON object
+ */
+static void benchScenario(FILE *out, const BenchOptions *options, const InputSet *set, const Scenario *scenario) {
+    size_t passes = (options->samples + set->count - 1) / set->count;
+    double *latencies = malloc(passes * set->count * sizeof(double));
+    size_t numSamples = 0;
+    size_t failures = 0;
+    double total = 0.0;
+    off_t bytes = 0;
+    int failed;
+    
+    if (latencies == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    
+    // Warm up the page cache and the binary
+    runMetinfo(options, scenario, set->paths, 1, NULL, &failed);
+    
+    // Whole passes over the set until enough samples are taken, stopping
+    // early after the first pass when the time budget is used up
+    double deadline = now() + options->maxTime;
+    for (size_t pass = 0; pass < passes; pass++) {
+        if (pass > 0 && now() > deadline) {
+            break;
+        }
+        for (size_t i = 0; i < set->count; i++) {
+            double elapsed = runMetinfo(options, scenario, &set->paths[i], 1, NULL, &failed);
+            latencies[numSamples++] = elapsed;
+            failures += failed;
+            total += elapsed;
+            bytes += set->sizes[i];
+        }
+    }
+    qsort(latencies, numSamples, sizeof(double), compareDoubles);
+    
+    fprintf(out, "{\"name\":\"%s\",\"args\":\"%s\",\"samples\":%zu,\"failures\":%zu,",
+            scenario->name, scenario->args[0] ? scenario->args[0] : "", numSamples, failures);
+    fprintf(out, "\"files_per_sec\":%.1f,\"mb_per_sec\":%.3f,",
+            numSamples / total, bytes / 1048576.0 / total);
+    fprintf(out, "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+            total / numSamples * 1e6,
+            percentile(latencies, numSamples, 0.50) * 1e6,
+            percentile(latencies, numSamples, 0.99) * 1e6,
+            percentile(latencies, numSamples, 0.999) * 1e6,
+            latencies[numSamples - 1] * 1e6);
+    fprintf(stderr, "%-10s %-10s %8zu %10.1f %10.1f %10.1f %10.1f %10.3f",
+            set->name, scenario->name, numSamples,
+            percentile(latencies, numSamples, 0.50) * 1e6,
+            percentile(latencies, numSamples, 0.99) * 1e6,
+            percentile(latencies, numSamples, 0.999) * 1e6,
+            numSamples / total, bytes / 1048576.0 / total);
+    
+    // One process for many files shows the cost without process startup
+    if (options->batch) {
+        double batchTime = 0.0;
+        for (size_t i = 0; i < set->count; i += BATCH_FILES) {
+            size_t count = set->count - i < BATCH_FILES ? set->count - i : BATCH_FILES;
+            batchTime += runMetinfo(options, scenario, &set->paths[i], count, NULL, &failed);
+        }
+        fprintf(out, ",\"batch\":{\"seconds\":%.6f,\"files_per_sec\":%.1f,\"mb_per_sec\":%.3f}",
+                batchTime, set->count / batchTime, set->bytes / 1048576.0 / batchTime);
+        fprintf(stderr, " %10.1f %10.3f", set->count / batchTime, set->bytes / 1048576.0 / batchTime);
+    }
+    fprintf(out, "}");
+    fprintf(stderr, "\n");
+    
+    free(latencies);
+}
+
+/**
+ * Median of samples, which are sorted in place
+ */
+static double median(double *samples, size_t count) {
+    qsort(samples, count, sizeof(double), compareDoubles);
+    if (count % 2 == 1) {
+        return samples[count / 2];
+    }
+    return (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+/**
+ * Find an entry of a set, scenario and metric
+ */
+static CheckEntry *findCheckEntry(CheckEntry *entries, size_t count, const char *set,
+                                  const char *scenario, Metric metric) {
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].metric == metric && strcmp(entries[i].set, set) == 0 &&
+            strcmp(entries[i].scenario, scenario) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record a measurement, with the tolerance of the baseline entry if any
+ */
+static void addMeasurement(CheckReport *report, const InputSet *set, const Scenario *scenario,
+                           Metric metric, double value, double mad) {
+    if (report->numCurrent == report->capacity) {
+        report->capacity = report->capacity ? report->capacity * 2 : 64;
+        report->current = realloc(report->current, report->capacity * sizeof(CheckEntry));
+        if (report->current == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+    }
+    
+    CheckEntry *entry = &report->current[report->numCurrent++];
+    snprintf(entry->set, sizeof(entry->set), "%s", set->name);
+    snprintf(entry->scenario, sizeof(entry->scenario), "%s", scenario->name);
+    entry->metric = metric;
+    entry->value = value;
+    entry->mad = mad;
+    
+    CheckEntry *base = findCheckEntry(report->baseline, report->numBaseline, entry->set, entry->scenario, metric);
+    if (base != NULL) {
+        entry->tolerance = base->tolerance;
+    } else {
+        entry->tolerance = metric == METRIC_TIME ? TIME_TOLERANCE : COUNTER_TOLERANCE;
+    }
+}
+
+/**
+ * Load a baseline: lines of set, scenario, metric, value and tolerance in
+ * percent, separated by tabs or spaces. Lines starting with # are comments.
+ * A missing file is an empty baseline.
+ */
+static void loadBaseline(const char *path, CheckReport *report) {
+    FILE *in = fopen(path, "r");
+    char line[512];
+    size_t capacity = 0;
+    int lineNumber = 0;
+    
+    if (in == NULL) {
+        if (errno != ENOENT) {
+            err(EXIT_FAILURE, "Unable to open %s", path);
+        }
+        return;
+    }
+    
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char set[64], scenario[64], metric[32];
+        double value, tolerance;
+        int m;
+        
+        lineNumber++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if (sscanf(line, "%63s %63s %31s %lf %lf%%", set, scenario, metric, &value, &tolerance) != 5) {
+            errx(EXIT_FAILURE, "%s:%d: expected SET SCENARIO METRIC VALUE TOLERANCE%%", path, lineNumber);
+        }
+        m = 0;
+        while (m < METRIC_COUNT && strcmp(metric, metricNames[m]) != 0) {
+            m++;
+        }
+        if (m == METRIC_COUNT) {
+            errx(EXIT_FAILURE, "%s:%d: unknown metric %s", path, lineNumber, metric);
+        }
+        
+        if (report->numBaseline == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            report->baseline = realloc(report->baseline, capacity * sizeof(CheckEntry));
+            if (report->baseline == NULL) {
+                err(EXIT_FAILURE, "Memory allocation error");
+            }
+        }
+        CheckEntry *entry = &report->baseline[report->numBaseline++];
+        snprintf(entry->set, sizeof(entry->set), "%s", set);
+        snprintf(entry->scenario, sizeof(entry->scenario), "%s", scenario);
+        entry->metric = (Metric)m;
+        entry->value = value;
+        entry->mad = 0.0;
+        entry->tolerance = tolerance;
+    }
+    fclose(in);
+}
+
+/**
+ * Write the measurements as the new baseline
+ */
+static void writeBaseline(const char *path, const BenchOptions *options, const CheckReport *report) {
+    FILE *out = fopen(path, "w");
+    
+    if (out == NULL) {
+        err(EXIT_FAILURE, "Cannot create %s", path);
+    }
+    fprintf(out, "# metbench baseline: medians of %d batch runs%s%s\n", options->runs,
+            *options->label ? ", " : "", options->label);
+    fprintf(out, "# set\tscenario\tmetric\tvalue\ttolerance\n");
+    for (size_t i = 0; i < report->numCurrent; i++) {
+        const CheckEntry *entry = &report->current[i];
+        fprintf(out, "%s\t%s\t%s\t%.3f\t%g%%\n", entry->set, entry->scenario,
+                metricNames[entry->metric], entry->value, entry->tolerance);
+    }
+    if (fclose(out) != 0) {
+        err(EXIT_FAILURE, "Error writing %s", path);
+    }
+}
+
+/**
+ * Run a scenario over a whole set once with --stats and add up the
+ * library counters it prints
+ */
+static void readStatsCounters(const BenchOptions *options, const InputSet *set, const Scenario *scenario,
+                              double *counters) {
+    Scenario withStats = *scenario;
+    char errorPath[] = "/tmp/metbench.XXXXXX";
+    char line[1024];
+    int failed;
+    int i = 0;
+    
+    while (withStats.args[i] != NULL) {
+        i++;
+    }
+    withStats.args[i] = "--stats";
+    withStats.args[i + 1] = NULL;
+    
+    int fd = mkstemp(errorPath);
+    if (fd == -1) {
+        err(EXIT_FAILURE, "Cannot create a temporary file");
+    }
+    close(fd);
+    
+    // Totals are printed once per invocation, after the per-file lines
+    counters[METRIC_READS] = counters[METRIC_SEEKS] = counters[METRIC_ALLOCATIONS] = 0.0;
+    for (size_t j = 0; j < set->count; j += BATCH_FILES) {
+        size_t count = set->count - j < BATCH_FILES ? set->count - j : BATCH_FILES;
+        unsigned long long reads = 0, bytes = 0, seeks = 0, allocations = 0;
+        
+        runMetinfo(options, &withStats, &set->paths[j], count, errorPath, &failed);
+        FILE *in = fopen(errorPath, "r");
+        if (in == NULL) {
+            err(EXIT_FAILURE, "Unable to open %s", errorPath);
+        }
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (strncmp(line, "{\"stats\":", 9) == 0) {
+                // Totals of a JSON scenario
+                const char *field;
+                if ((field = strstr(line, "\"read_calls\":")) != NULL) {
+                    sscanf(field, "\"read_calls\":%llu", &reads);
+                }
+                if ((field = strstr(line, "\"seek_calls\":")) != NULL) {
+                    sscanf(field, "\"seek_calls\":%llu", &seeks);
+                }
+                if ((field = strstr(line, "\"allocations\":")) != NULL) {
+                    sscanf(field, "\"allocations\":%llu", &allocations);
+                }
+            } else {
+                sscanf(line, "Read calls: %llu (%llu bytes), seeks: %llu", &reads, &bytes, &seeks);
+                sscanf(line, "Allocations: %llu", &allocations);
+            }
+        }
+        fclose(in);
+        counters[METRIC_READS] += reads;
+        counters[METRIC_SEEKS] += seeks;
+        counters[METRIC_ALLOCATIONS] += allocations;
+    }
+    unlink(errorPath);
+    
+    for (int m = METRIC_READS; m < METRIC_COUNT; m++) {
+        counters[m] /= set->count;
+    }
+}
+
+/**
+ * Measure one scenario over a set for --check: the median and MAD of the
+ * time per file over repeated batch runs, and the --stats counters
+ */
+static void checkScenario(CheckReport *report, const BenchOptions *options, const InputSet *set,
+                          const Scenario *scenario) {
+    double *times = malloc(options->runs * sizeof(double));
+    double counters[METRIC_COUNT];
+    int failed;
+    
+    if (times == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    
+    // Warm up the page cache and the binary
+    runMetinfo(options, scenario, set->paths, set->count < BATCH_FILES ? set->count : BATCH_FILES, NULL, &failed);
+    
+    for (int run = 0; run < options->runs; run++) {
+        double elapsed = 0.0;
+        for (size_t i = 0; i < set->count; i += BATCH_FILES) {
+            size_t count = set->count - i < BATCH_FILES ? set->count - i : BATCH_FILES;
+            elapsed += runMetinfo(options, scenario, &set->paths[i], count, NULL, &failed);
+        }
+        times[run] = elapsed / set->count * 1e6;
+    }
+    double middle = median(times, options->runs);
+    for (int run = 0; run < options->runs; run++) {
+        times[run] = times[run] > middle ? times[run] - middle : middle - times[run];
+    }
+    addMeasurement(report, set, scenario, METRIC_TIME, middle, median(times, options->runs));
+    free(times);
+    
+    readStatsCounters(options, set, scenario, counters);
+    for (int m = METRIC_READS; m < METRIC_COUNT; m++) {
+        addMeasurement(report, set, scenario, (Metric)m, counters[m], 0.0);
+    }
+}
+
+/**
+ * Compare the measurements with the baseline and print a table of the
+ * differences. A metric regresses when it rises by more than its
+ * tolerance and, for timings, by more than the run-to-run noise.
+ */
+static void compareWithBaseline(CheckReport *report) {
+    printf("%-10s %-10s %-16s %12s %12s %10s %9s %6s  %s\n",
+           "set", "scenario", "metric", "baseline", "current", "+-MAD", "change", "limit", "status");
+    
+    for (size_t i = 0; i < report->numCurrent; i++) {
+        const CheckEntry *entry = &report->current[i];
+        const CheckEntry *base = findCheckEntry(report->baseline, report->numBaseline,
+                                                entry->set, entry->scenario, entry->metric);
+        const char *status;
+        char change[16] = "";
+        
+        if (base == NULL) {
+            status = "new";
+        } else {
+            double rise = entry->value - base->value;
+            double allowed = base->value * base->tolerance / 100.0;
+            double noise = MAD_THRESHOLD * 1.4826 * entry->mad;
+            if (base->value > 0) {
+                snprintf(change, sizeof(change), "%+.1f%%", rise * 100.0 / base->value);
+            }
+            if (rise > allowed && rise > noise) {
+                status = "REGRESSION";
+                report->regressions++;
+            } else if (-rise > allowed && -rise > noise) {
+                status = "improved";
+            } else {
+                status = "ok";
+            }
+        }
+        
+        char baseValue[32] = "-";
+        if (base != NULL) {
+            snprintf(baseValue, sizeof(baseValue), "%.3f", base->value);
+        }
+        printf("%-10s %-10s %-16s %12s %12.3f %10.3f %9s %5g%%  %s\n",
+               entry->set, entry->scenario, metricNames[entry->metric],
+               baseValue, entry->value, entry->mad, change, entry->tolerance, status);
+    }
+}
+
+/**
+ * Compare each scenario that names a cheaperThan scenario with it on the
+ * same set. It must take less time and fewer allocations per file, and no
+ * more reads or seeks.
+ */
+static void compareScenarios(CheckReport *report) {
+    int first = 1;
+    
+    for (size_t i = 0; i < report->numCurrent; i++) {
+        const CheckEntry *entry = &report->current[i];
+        const char *cheaperThan = NULL;
+        
+        for (size_t j = 0; j < NUM_SCENARIOS; j++) {
+            if (strcmp(scenarios[j].name, entry->scenario) == 0) {
+                cheaperThan = scenarios[j].cheaperThan;
+            }
+        }
+        const CheckEntry *other = cheaperThan == NULL ? NULL :
+            findCheckEntry(report->current, report->numCurrent, entry->set, cheaperThan, entry->metric);
+        if (other == NULL) {
+            continue;
+        }
+        
+        if (first) {
+            printf("\n%-10s %-10s %-16s %-10s %12s %12s  %s\n",
+                   "set", "scenario", "metric", "than", "other", "current", "status");
+            first = 0;
+        }
+        int strict = entry->metric == METRIC_TIME || entry->metric == METRIC_ALLOCATIONS;
+        int cheaper = strict ? entry->value < other->value : entry->value <= other->value;
+        if (!cheaper) {
+            report->notCheaper++;
+        }
+        printf("%-10s %-10s %-16s %-10s %12.3f %12.3f  %s\n", entry->set, entry->scenario,
+               metricNames[entry->metric], cheaperThan, other->value, entry->value,
+               cheaper ? "ok" : "NOT CHEAPER");
+    }
+}
+
+/**
+ * Free the input sets
+ */
+static void freeInputSets(InputSet *sets, int numSets) {
+    for (int i = 0; i < numSets; i++) {
+        for (size_t j = 0; j < sets[i].count; j++) {
+            free(sets[i].paths[j]);
+        }
+        free(sets[i].paths);
+        free(sets[i].sizes);
+    }
+    free(sets);
+}
+
+/**
+ * Measure the selected scenarios over all sets and compare them with the
+ * baseline (--check) and with each other, or write a new baseline
+ * (--update). Returns the exit status: 1 if a metric regressed or a
+ * scenario was not cheaper than its cheaperThan, and no new baseline was
+ * written.
+ */
+static int runCheck(const BenchOptions *options, InputSet *sets, int numSets) {
+    CheckReport report;
+    
+    memset(&report, 0, sizeof(report));
+    if (options->check != NULL) {
+        loadBaseline(options->check, &report);
+    }
+    
+    for (int i = 0; i < numSets; i++) {
+        for (size_t j = 0; j < NUM_SCENARIOS; j++) {
+            if (scenarioSelected(options, scenarios[j].name)) {
+                checkScenario(&report, options, &sets[i], &scenarios[j]);
+            }
+        }
+    }
+    
+    compareWithBaseline(&report);
+    compareScenarios(&report);
+    fflush(stdout);
+    if (options->update != NULL) {
+        writeBaseline(options->update, options, &report);
+        fprintf(stderr, "Baseline written to %s\n", options->update);
+    } else if (report.regressions > 0) {
+        fprintf(stderr, "%d metric%s regressed against %s\n", report.regressions,
+                report.regressions > 1 ? "s" : "", options->check);
+    }
+    if (options->update == NULL && report.notCheaper > 0) {
+        fprintf(stderr, "%d metric%s not cheaper than the scenario compared with\n", report.notCheaper,
+                report.notCheaper > 1 ? "s" : "");
+    }
+    
+    int failed = report.regressions > 0 || report.notCheaper > 0;
+    free(report.baseline);
+    free(report.current);
+    freeInputSets(sets, numSets);
+    return failed && options->update == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Show program usage instructions
+ */
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options] NAME=PATH[,PATH...]...\n", progname);
+    fprintf(stderr, "Time metinfo over named sets of .part.met files (PATH may be a directory)\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -x, --metinfo=PATH   Binary to benchmark (default ./metinfo)\n");
+    fprintf(stderr, "  -s, --scenarios=LIST Only run these scenarios, e.g. text,json,hash\n");
+    fprintf(stderr, "  -n, --samples=N      Latency samples per scenario (default 1000, at least\n");
+    fprintf(stderr, "                       one per file)\n");
+    fprintf(stderr, "  -t, --time=SECONDS   Time budget per scenario after the first pass (default 10)\n");
+    fprintf(stderr, "  -B, --no-batch       Skip the multi-file invocations\n");
+    fprintf(stderr, "  -L, --label=TEXT     Label stored in the results, e.g. a commit\n");
+    fprintf(stderr, "  -o, --output=FILE    Write the JSON results to FILE (default stdout)\n");
+    fprintf(stderr, "\nRegression check:\n");
+    fprintf(stderr, "  -c, --check=FILE     Compare batch runs with the baseline in FILE and exit\n");
+    fprintf(stderr, "                       with status 1 if a metric rose past its tolerance\n");
+    fprintf(stderr, "  -u, --update=FILE    Write the measurements as a new baseline to FILE,\n");
+    fprintf(stderr, "                       keeping the tolerances of --check\n");
+    fprintf(stderr, "  -r, --runs=N         Batch runs per scenario for the median (default 7)\n");
+    fprintf(stderr, "  -h, --help           Show this help message\n");
+    fprintf(stderr, "\nScenarios:");
+    for (size_t i = 0; i < NUM_SCENARIOS; i++) {
+        fprintf(stderr, " %s", scenarios[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    char *end;
+    const char *output = NULL;
+    FILE *out = stdout;
+    
+    // Default options
+    BenchOptions options = {
+        .metinfo = "./metinfo",
+        .label = "",
+        .scenarios = NULL,
+        .samples = 1000,
+        .maxTime = 10.0,
+        .batch = 1,
+        .runs = 7,
+        .check = NULL,
+        .update = NULL
+    };
+    
+    static struct option longopts[] = {
+        { "metinfo",   required_argument, NULL, 'x' },
+        { "scenarios", required_argument, NULL, 's' },
+        { "samples",   required_argument, NULL, 'n' },
+        { "time",      required_argument, NULL, 't' },
+        { "no-batch",  no_argument,       NULL, 'B' },
+        { "label",     required_argument, NULL, 'L' },
+        { "output",    required_argument, NULL, 'o' },
+        { "check",     required_argument, NULL, 'c' },
+        { "update",    required_argument, NULL, 'u' },
+        { "runs",      required_argument, NULL, 'r' },
+        { "help",      no_argument,       NULL, 'h' },
+        { NULL,        0,                 NULL,  0  }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "x:s:n:t:BL:o:c:u:r:h", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'x':
+                options.metinfo = optarg;
+                break;
+            case 's':
+                options.scenarios = optarg;
+                break;
+            case 'n':
+                options.samples = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || options.samples == 0) {
+                    errx(EXIT_FAILURE, "Invalid sample count: %s", optarg);
+                }
+                break;
+            case 't':
+                options.maxTime = strtod(optarg, &end);
+                if (*optarg == '\0' || *end != '\0' || options.maxTime < 0) {
+                    errx(EXIT_FAILURE, "Invalid time: %s", optarg);
+                }
+                break;
+            case 'B':
+                options.batch = 0;
+                break;
+            case 'L':
+                options.label = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'c':
+                options.check = optarg;
+                break;
+            case 'u':
+                options.update = optarg;
+                break;
+            case 'r':
+                options.runs = (int)strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || options.runs <= 0) {
+                    errx(EXIT_FAILURE, "Invalid run count: %s", optarg);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+    
+    // Input sets
+    int numSets = argc - optind;
+    InputSet *sets = calloc(numSets, sizeof(InputSet));
+    if (sets == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    for (int i = 0; i < numSets; i++) {
+        char *spec = argv[optind + i];
+        char *paths = strchr(spec, '=');
+        if (paths == NULL || paths == spec) {
+            errx(EXIT_FAILURE, "Input set must be NAME=PATH: %s", spec);
+        }
+        *paths++ = '\0';
+        sets[i].name = spec;
+        for (char *path = strtok(paths, ","); path != NULL; path = strtok(NULL, ",")) {
+            addPath(&sets[i], path);
+        }
+        if (sets[i].count == 0) {
+            errx(EXIT_FAILURE, "No .part.met files in set %s", spec);
+        }
+    }
+    
+    if (options.check != NULL || options.update != NULL) {
+        return runCheck(&options, sets, numSets);
+    }
+    
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        err(EXIT_FAILURE, "Cannot create %s", output);
+    }
+    
+    char *label = jsonEscapeString(options.label);
+    char *metinfo = jsonEscapeString(options.metinfo);
+    fprintf(out, "{\"label\":\"%s\",\"metinfo\":\"%s\",\"timestamp\":%lld,\"sets\":[",
+            label ? label : "", metinfo ? metinfo : "", (long long)time(NULL));
+    free(label);
+    free(metinfo);
+    
+    fprintf(stderr, "%-10s %-10s %8s %10s %10s %10s %10s %10s",
+            "set", "scenario", "samples", "p50 us", "p99 us", "p999 us", "files/s", "MB/s");
+    if (options.batch) {
+        fprintf(stderr, " %10s %10s", "batch f/s", "batch MB/s");
+    }
+    fprintf(stderr, "\n");
+    
+    for (int i = 0; i < numSets; i++) {
+        char *name = jsonEscapeString(sets[i].name);
+        fprintf(out, "%s{\"name\":\"%s\",\"files\":%zu,\"bytes\":%lld,\"scenarios\":[",
+                i > 0 ? "," : "", name ? name : "", sets[i].count, (long long)sets[i].bytes);
+        free(name);
+        
+        int first = 1;
+        for (size_t j = 0; j < NUM_SCENARIOS; j++) {
+            if (!scenarioSelected(&options, scenarios[j].name)) {
+                continue;
+            }
+            if (!first) {
+                fprintf(out, ",");
+            }
+            first = 0;
+            benchScenario(out, &options, &sets[i], &scenarios[j]);
+            fflush(out);
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "]}\n");
+    
+    if (out != stdout && fclose(out) != 0) {
+        err(EXIT_FAILURE, "Error writing %s", output);
+    }
+    
+    freeInputSets(sets, numSets);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,781 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <getopt.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * Synthetic .part.met generator: writes single files or directory trees of
+ * valid or deliberately damaged files for testing and benchmarking metinfo.
+ * Output is fully determined by the options and the seed.
+ */
+
+#define PART_SIZE       9728000U    // ED2K part size, one part hash per part
+#define MAX_FILE_SIZE   0xFFFFFFFFU // Largest size a 32 bit tag can hold
+#define MAX_BLOCKS      65535       // Block count is a 16 bit field
+#define FILES_PER_DIR   1000        // Files per subdirectory in tree mode
+#define FLIPPED_BITS    8           // Bits changed by the flip corruption
+
+/**
+ * Placement of the gaps within the file
+ */
+typedef enum {
+    PATTERN_EVEN,         // Same size gaps spread over the whole file
+    PATTERN_RANDOM,       // Random gap and data run lengths
+    PATTERN_CLUSTERED,    // Random gaps in the last quarter only
+    PATTERN_FRAGMENTED,   // Random gaps split into touching and overlapping pieces
+    PATTERN_COUNT
+} GapPattern;
+
+/**
+ * Deliberate damage applied after the file is built
+ */
+typedef enum {
+    CORRUPT_NONE,
+    CORRUPT_TRUNCATE,     // Cut the file inside the tag list
+    CORRUPT_FLIP,         // Flip random bits after the header
+    CORRUPT_TAG_TYPE,     // Invalid type byte on a random tag
+    CORRUPT_TAG_COUNT,    // Tag count larger than the file can hold
+    CORRUPT_BLOCKS,       // Block count larger than the file can hold (14.0)
+    CORRUPT_STRING,       // Filename length past the end of the file
+    CORRUPT_COUNT
+} Corruption;
+
+static const char *patternNames[PATTERN_COUNT] = {
+    "even", "random", "clustered", "fragmented"
+};
+
+static const char *corruptionNames[CORRUPT_COUNT] = {
+    "none", "truncate", "flip", "tagtype", "tagcount", "blocks", "string"
+};
+
+/**
+ * Media tag names recognized by metinfo as standard tags
+ */
+static const char *mediaTags[] = {
+    "Artist", "Album", "Title", "length", "bitrate", "codec"
+};
+
+/**
+ * Parameters of one generated file
+ */
+typedef struct {
+    int version;              // 0 = Version 14.0, 1 = Version 14.1
+    unsigned int size;        // File size in bytes
+    int blocks;               // Part hashes of a 14.0 file, -1 = from size
+    unsigned int gaps;        // Number of gaps
+    GapPattern pattern;       // Gap placement
+    int nameLength;           // Length of the filename
+    int media;                // Add the media tags
+    unsigned int unknown;     // Number of unknown tags
+    int stringLength;         // Length of unknown string values
+    int duplicate;            // Stale copies of the size and progress tags
+    Corruption corruption;    // Damage to apply
+} FileOptions;
+
+/**
+ * Options that were given explicitly and are not randomized in tree mode
+ */
+typedef struct {
+    int version;
+    int size;
+    int pattern;
+    int media;
+    int corruption;
+} FixedOptions;
+
+/**
+ * Output buffer and the offsets needed to damage the file afterwards
+ */
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+    size_t blocksOffset;      // Offset of the 14.0 block count
+    size_t countOffset;       // Offset of the tag count
+    size_t tagsOffset;        // Offset of the first tag
+    size_t nameOffset;        // Offset of the filename length field
+    unsigned int numTags;     // Tags written so far
+    unsigned int markTag;     // Index of the tag whose offset is kept
+    size_t markOffset;        // Offset of that tag
+} Writer;
+
+static unsigned long long randomState;
+
+/**
+ * Next pseudo random number (xorshift64*)
+ */
+static unsigned long long nextRandom(void) {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 2685821657736338717ULL;
+}
+
+/**
+ * Pseudo random number in [0, bound)
+ */
+static unsigned int randomBelow(unsigned int bound) {
+    return bound ? (unsigned int)((nextRandom() >> 32) % bound) : 0;
+}
+
+/**
+ * Seed the generator, zero is not a valid xorshift state
+ */
+static void seedRandom(unsigned long long seed) {
+    randomState = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (int i = 0; i < 4; i++) {
+        nextRandom();
+    }
+}
+
+/**
+ * Make room for more bytes in the output buffer
+ */
+static unsigned char *reserve(Writer *writer, size_t length) {
+    if (writer->length + length > writer->capacity) {
+        size_t capacity = writer->capacity ? writer->capacity : 4096;
+        while (capacity < writer->length + length) {
+            capacity *= 2;
+        }
+        unsigned char *data = realloc(writer->data, capacity);
+        if (data == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        writer->data = data;
+        writer->capacity = capacity;
+    }
+    unsigned char *p = writer->data + writer->length;
+    writer->length += length;
+    return p;
+}
+
+static void putByte(Writer *writer, unsigned int value) {
+    *reserve(writer, 1) = (unsigned char)value;
+}
+
+static void putWord(Writer *writer, unsigned int value) {
+    unsigned char *p = reserve(writer, 2);
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void putDWord(Writer *writer, unsigned int value) {
+    unsigned char *p = reserve(writer, 4);
+    for (int i = 0; i < 4; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static void putRandomBytes(Writer *writer, size_t length) {
+    unsigned char *p = reserve(writer, length);
+    for (size_t i = 0; i < length; i++) {
+        p[i] = (unsigned char)randomBelow(256);
+    }
+}
+
+/**
+ * Random lowercase text, used for names and string values
+ */
+static void putRandomText(Writer *writer, size_t length) {
+    unsigned char *p = reserve(writer, length);
+    for (size_t i = 0; i < length; i++) {
+        p[i] = 'a' + randomBelow(26);
+    }
+}
+
+/**
+ * Start a tag: type, name length and name
+ */
+static void beginTag(Writer *writer, int type, const char *name, size_t nameLength) {
+    if (writer->numTags++ == writer->markTag) {
+        writer->markOffset = writer->length;
+    }
+    putByte(writer, type);
+    putWord(writer, (unsigned int)nameLength);
+    memcpy(reserve(writer, nameLength), name, nameLength);
+}
+
+static void putIntTag(Writer *writer, const char *name, size_t nameLength, unsigned int value) {
+    beginTag(writer, 3, name, nameLength);
+    putDWord(writer, value);
+}
+
+static void putSpecialInt(Writer *writer, int id, unsigned int value) {
+    char name = (char)id;
+    putIntTag(writer, &name, 1, value);
+}
+
+/**
+ * Fill positions[0..2*count) with strictly increasing offsets inside
+ * [from, from + length): gap i runs from positions[2i] to positions[2i+1]
+ */
+static void placeRandomGaps(unsigned int *positions, unsigned int count, unsigned int from, unsigned int length) {
+    unsigned int points = 2 * count;
+    unsigned long long total = 0;
+    
+    // Random run lengths, scaled to the free bytes left after giving every
+    // gap and every data run between gaps at least one byte
+    for (unsigned int i = 0; i < points; i++) {
+        positions[i] = 1 + randomBelow(1024);
+        total += positions[i];
+    }
+    total += 1 + randomBelow(1024);
+    
+    unsigned long long freeBytes = length - points;
+    unsigned long long sum = 0;
+    for (unsigned int i = 0; i < points; i++) {
+        sum += positions[i];
+        positions[i] = from + i + (unsigned int)(freeBytes * sum / total);
+    }
+}
+
+/**
+ * Compute the gap positions of a file
+ */
+static void placeGaps(const FileOptions *options, unsigned int *positions) {
+    if (options->gaps == 0) {
+        return;
+    }
+    switch (options->pattern) {
+        case PATTERN_EVEN: {
+            unsigned int slot = options->size / options->gaps;
+            for (unsigned int i = 0; i < options->gaps; i++) {
+                positions[2 * i] = i * slot + slot / 4;
+                positions[2 * i + 1] = positions[2 * i] + slot / 2;
+            }
+            break;
+        }
+        case PATTERN_CLUSTERED: {
+            unsigned int quarter = options->size / 4;
+            placeRandomGaps(positions, options->gaps, options->size - quarter, quarter);
+            break;
+        }
+        case PATTERN_FRAGMENTED: {
+            // Up to four pieces per gap, as left by a long download. Every
+            // other piece starts halfway into the one before it.
+            unsigned int whole = (options->gaps + 3) / 4;
+            placeRandomGaps(positions, whole, 0, options->size);
+            for (unsigned int i = options->gaps; i-- > 0; ) {
+                unsigned int gap = i / 4;
+                unsigned int pieces = options->gaps - 4 * gap < 4 ? options->gaps - 4 * gap : 4;
+                unsigned int start = positions[2 * gap];
+                unsigned int length = positions[2 * gap + 1] - start;
+                unsigned int piece = i % 4;
+                unsigned int from = start + (unsigned int)((unsigned long long)length * piece / pieces);
+                unsigned int to = start + (unsigned int)((unsigned long long)length * (piece + 1) / pieces);
+                if (piece % 2 == 1) {
+                    from -= (from - (start + (unsigned int)((unsigned long long)length * (piece - 1) / pieces))) / 2;
+                }
+                positions[2 * i] = from;
+                positions[2 * i + 1] = to;
+            }
+            break;
+        }
+        default:
+            placeRandomGaps(positions, options->gaps, 0, options->size);
+    }
+}
+
+/**
+ * Largest number of gaps a file of the given size can hold with a pattern
+ */
+static unsigned int maxGaps(unsigned int size, GapPattern pattern) {
+    switch (pattern) {
+        case PATTERN_EVEN:      return size / 4;
+        case PATTERN_CLUSTERED: return size / 4 / 2;
+        default:                return size / 2;
+    }
+}
+
+/**
+ * Number of part hashes stored by a 14.0 file
+ */
+static int defaultBlocks(unsigned int size) {
+    unsigned int blocks = size / PART_SIZE + (size % PART_SIZE != 0);
+    return blocks > MAX_BLOCKS ? MAX_BLOCKS : (int)blocks;
+}
+
+/**
+ * Build a file in the writer
+ */
+static void buildFile(Writer *writer, const FileOptions *options) {
+    unsigned int *positions = NULL;
+    unsigned int missing = 0;
+    unsigned int numTags;
+    
+    if (options->gaps > 0) {
+        positions = malloc(2 * (size_t)options->gaps * sizeof(unsigned int));
+        if (positions == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        placeGaps(options, positions);
+        
+        // Gaps come in order of their start; count overlaps once
+        unsigned int covered = 0;
+        for (unsigned int i = 0; i < options->gaps; i++) {
+            unsigned int from = positions[2 * i] > covered ? positions[2 * i] : covered;
+            if (positions[2 * i + 1] > from) {
+                missing += positions[2 * i + 1] - from;
+                covered = positions[2 * i + 1];
+            }
+        }
+    }
+    
+    numTags = 8 + 2 * options->gaps + options->unknown;
+    if (options->media) {
+        numTags += sizeof(mediaTags) / sizeof(mediaTags[0]);
+    }
+    if (options->duplicate) {
+        numTags += options->gaps > 0 ? 5 : 3;
+    }
+    writer->length = 0;
+    writer->numTags = 0;
+    writer->markTag = randomBelow(numTags);
+    writer->markOffset = 0;
+    
+    // Header
+    unsigned int lastSeen = 1500000000 + randomBelow(300000000);
+    if (options->version == 0) {
+        int blocks = options->blocks >= 0 ? options->blocks : defaultBlocks(options->size);
+        putByte(writer, 0xE0);
+        putDWord(writer, lastSeen);
+        putRandomBytes(writer, 16);
+        writer->blocksOffset = writer->length;
+        putWord(writer, (unsigned int)blocks);
+        putRandomBytes(writer, 16 * (size_t)blocks);
+    } else {
+        putByte(writer, 0xE1);
+        putDWord(writer, lastSeen);
+        putByte(writer, 0);
+        putRandomBytes(writer, 16);
+    }
+    writer->countOffset = writer->length;
+    putDWord(writer, numTags);
+    writer->tagsOffset = writer->length;
+    
+    // Special tags in the order eMule writes them
+    char name = 1;
+    if (options->duplicate) {
+        // Readers must use the last copy of a tag, as eMule does
+        beginTag(writer, 2, &name, 1);
+        putWord(writer, 9);
+        memcpy(reserve(writer, 9), "stale.avi", 9);
+    }
+    beginTag(writer, 2, &name, 1);
+    writer->nameOffset = writer->length;
+    putWord(writer, (unsigned int)options->nameLength + 4);
+    putRandomText(writer, options->nameLength);
+    memcpy(reserve(writer, 4), ".avi", 4);
+    if (options->duplicate) {
+        putSpecialInt(writer, 0x02, options->size / 2);
+        putSpecialInt(writer, 0x08, 0);
+    }
+    putSpecialInt(writer, 0x02, options->size);
+    putSpecialInt(writer, 0x08, options->size - missing);
+    putSpecialInt(writer, 0x05, lastSeen);
+    putSpecialInt(writer, 0x14, (unsigned int[]){ 0, 1, 2, 3, 4, 6, 7, 8, 9 }[randomBelow(9)]);
+    putSpecialInt(writer, 0x18, randomBelow(6));
+    putSpecialInt(writer, 0x19, randomBelow(6));
+    name = 0x12;
+    beginTag(writer, 2, &name, 1);
+    putWord(writer, 8);
+    memcpy(reserve(writer, 8), "001.part", 8);
+    
+    if (options->media) {
+        for (size_t i = 0; i < sizeof(mediaTags) / sizeof(mediaTags[0]); i++) {
+            const char *tag = mediaTags[i];
+            if (strcmp(tag, "length") == 0 || strcmp(tag, "bitrate") == 0) {
+                putIntTag(writer, tag, strlen(tag), randomBelow(10000));
+            } else {
+                beginTag(writer, 2, tag, strlen(tag));
+                putWord(writer, 12);
+                putRandomText(writer, 12);
+            }
+        }
+    }
+    
+    // Unknown tags alternate between strings and integers
+    for (unsigned int i = 0; i < options->unknown; i++) {
+        char tag[16];
+        int length = snprintf(tag, sizeof(tag), "ext%u", i);
+        if (i % 2 == 0) {
+            beginTag(writer, 2, tag, (size_t)length);
+            putWord(writer, (unsigned int)options->stringLength);
+            putRandomText(writer, (size_t)options->stringLength);
+        } else {
+            putIntTag(writer, tag, (size_t)length, (unsigned int)nextRandom());
+        }
+    }
+    
+    // Gap start and end tags, named after the gap number as eMule does
+    if (options->duplicate && options->gaps > 0) {
+        char tag[2] = { 0x09, '0' };
+        putIntTag(writer, tag, 2, 0);
+        tag[0] = 0x0A;
+        putIntTag(writer, tag, 2, options->size);
+    }
+    for (unsigned int i = 0; i < options->gaps; i++) {
+        char tag[16];
+        int length = snprintf(tag + 1, sizeof(tag) - 1, "%u", i) + 1;
+        tag[0] = 0x09;
+        putIntTag(writer, tag, (size_t)length, positions[2 * i]);
+        tag[0] = 0x0A;
+        putIntTag(writer, tag, (size_t)length, positions[2 * i + 1]);
+    }
+    
+    free(positions);
+}
+
+/**
+ * Damage a built file
+ */
+static void corruptFile(Writer *writer, Corruption corruption) {
+    size_t tagBytes = writer->length - writer->tagsOffset;
+    
+    switch (corruption) {
+        case CORRUPT_TRUNCATE:
+            writer->length = writer->tagsOffset + randomBelow((unsigned int)tagBytes);
+            break;
+        case CORRUPT_FLIP:
+            for (int i = 0; i < FLIPPED_BITS; i++) {
+                writer->data[writer->tagsOffset + randomBelow((unsigned int)tagBytes)] ^= 1 << randomBelow(8);
+            }
+            break;
+        case CORRUPT_TAG_TYPE:
+            writer->data[writer->markOffset] = 0x7F;
+            break;
+        case CORRUPT_TAG_COUNT:
+            memset(writer->data + writer->countOffset, 0xFF, 4);
+            break;
+        case CORRUPT_BLOCKS:
+            memset(writer->data + writer->blocksOffset, 0xFF, 2);
+            break;
+        case CORRUPT_STRING:
+            memset(writer->data + writer->nameOffset, 0xFF, 2);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Write the output buffer to a file
+ */
+static void writeFile(const char *path, const Writer *writer) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        err(EXIT_FAILURE, "Cannot create %s", path);
+    }
+    if (fwrite(writer->data, 1, writer->length, fp) != writer->length || fclose(fp) != 0) {
+        err(EXIT_FAILURE, "Error writing %s", path);
+    }
+}
+
+/**
+ * Check that the options describe a file that can be built
+ */
+static void checkOptions(const FileOptions *options) {
+    if (options->gaps > maxGaps(options->size, options->pattern)) {
+        errx(EXIT_FAILURE, "%u %s gaps do not fit in %u bytes", options->gaps,
+             patternNames[options->pattern], options->size);
+    }
+    if (options->corruption == CORRUPT_BLOCKS && options->version != 0) {
+        errx(EXIT_FAILURE, "Block count corruption needs version 14.0");
+    }
+}
+
+/**
+ * File size between 64 KiB and 4 GiB, uniform on a log scale
+ */
+static unsigned int randomSize(void) {
+    unsigned int bits = 16 + randomBelow(16);
+    unsigned long long size = (1ULL << bits) + (nextRandom() & ((1ULL << bits) - 1));
+    return size > MAX_FILE_SIZE ? MAX_FILE_SIZE : (unsigned int)size;
+}
+
+/**
+ * Create a directory, it may already exist
+ */
+static void makeDirectory(const char *path) {
+    if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+        err(EXIT_FAILURE, "Cannot create %s", path);
+    }
+}
+
+/**
+ * Write a tree of files with randomized parameters. The options are upper
+ * bounds for counts, and fixed values for what was given explicitly.
+ */
+static void generateTree(const char *dir, unsigned int count, const FileOptions *options,
+                         const FixedOptions *fixed, unsigned int damagedPercent) {
+    Writer writer = { 0 };
+    size_t pathSize = strlen(dir) + 32;
+    char *path = malloc(pathSize);
+    if (path == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    
+    makeDirectory(dir);
+    for (unsigned int i = 0; i < count; i++) {
+        FileOptions file = *options;
+        
+        if (i % FILES_PER_DIR == 0) {
+            snprintf(path, pathSize, "%s/%03u", dir, i / FILES_PER_DIR);
+            makeDirectory(path);
+        }
+        if (!fixed->version) {
+            file.version = (int)randomBelow(2);
+        }
+        if (!fixed->size) {
+            file.size = randomSize();
+        }
+        if (!fixed->pattern) {
+            // Fragmented gaps are left to -p, so trees stay as they were
+            file.pattern = (GapPattern)randomBelow(PATTERN_FRAGMENTED);
+        }
+        if (!fixed->media) {
+            file.media = (int)randomBelow(2);
+        }
+        file.gaps = randomBelow(options->gaps + 1);
+        if (file.gaps > maxGaps(file.size, file.pattern)) {
+            file.gaps = maxGaps(file.size, file.pattern);
+        }
+        file.unknown = randomBelow(options->unknown + 1);
+        file.nameLength = 1 + (int)randomBelow((unsigned int)options->nameLength * 2);
+        if (file.nameLength > 65535 - 4) {
+            file.nameLength = 65535 - 4;
+        }
+        if (!fixed->corruption) {
+            file.corruption = CORRUPT_NONE;
+            if (randomBelow(100) < damagedPercent) {
+                file.corruption = (Corruption)(1 + randomBelow(CORRUPT_COUNT - 1));
+                if (file.corruption == CORRUPT_BLOCKS && file.version != 0) {
+                    file.corruption = CORRUPT_TAG_COUNT;
+                }
+            }
+        } else if (file.corruption == CORRUPT_BLOCKS) {
+            file.version = 0;
+        }
+        
+        buildFile(&writer, &file);
+        corruptFile(&writer, file.corruption);
+        snprintf(path, pathSize, "%s/%03u/%06u.part.met", dir, i / FILES_PER_DIR, i);
+        writeFile(path, &writer);
+    }
+    
+    free(path);
+    free(writer.data);
+}
+
+/**
+ * Parse a byte count with an optional K, M or G suffix
+ */
+static unsigned int parseSize(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    
+    switch (*end) {
+        case 'K': case 'k': value <<= 10; end++; break;
+        case 'M': case 'm': value <<= 20; end++; break;
+        case 'G': case 'g': value <<= 30; end++; break;
+        default: break;
+    }
+    if (errno != 0 || *arg == '\0' || *end != '\0' || value == 0) {
+        errx(EXIT_FAILURE, "Invalid size: %s", arg);
+    }
+    if (value > MAX_FILE_SIZE) {
+        value = MAX_FILE_SIZE;
+    }
+    return (unsigned int)value;
+}
+
+/**
+ * Parse an unsigned count
+ */
+static unsigned int parseCount(const char *arg, unsigned int max) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (errno != 0 || *arg == '\0' || *end != '\0' || value > max) {
+        errx(EXIT_FAILURE, "Invalid count: %s", arg);
+    }
+    return (unsigned int)value;
+}
+
+/**
+ * Find a name in a table of option values
+ */
+static int parseName(const char *arg, const char **names, int count, const char *what) {
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(arg, names[i]) == 0) {
+            return i;
+        }
+    }
+    errx(EXIT_FAILURE, "Unknown %s: %s", what, arg);
+}
+
+/**
+ * Show program usage instructions
+ */
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options] FILE\n", progname);
+    fprintf(stderr, "       %s -N COUNT [options] DIR\n", progname);
+    fprintf(stderr, "Write synthetic .part.met files for testing and benchmarking\n");
+    fprintf(stderr, "\nFile layout:\n");
+    fprintf(stderr, "  -v, --met-version=V  14.0 or 14.1 (default 14.1)\n");
+    fprintf(stderr, "  -s, --size=BYTES     File size, K, M and G suffixes allowed (default 700M,\n");
+    fprintf(stderr, "                       at most 4G - 1)\n");
+    fprintf(stderr, "  -b, --blocks=N       Part hashes of a 14.0 file (default from the size)\n");
+    fprintf(stderr, "  -g, --gaps=N         Number of gaps (default 20)\n");
+    fprintf(stderr, "  -p, --pattern=NAME   Gap placement: even, random, clustered or\n");
+    fprintf(stderr, "                       fragmented (default even)\n");
+    fprintf(stderr, "\nTags:\n");
+    fprintf(stderr, "  -n, --name-length=N  Filename length (default 24)\n");
+    fprintf(stderr, "  -m, --media          Add Artist, Album, Title, length, bitrate and codec\n");
+    fprintf(stderr, "  -u, --unknown=N      Number of unknown tags (default 0)\n");
+    fprintf(stderr, "  -l, --string-length=N\n");
+    fprintf(stderr, "                       Length of unknown string values (default 32)\n");
+    fprintf(stderr, "  -d, --duplicate      Write stale copies of the filename, file size,\n");
+    fprintf(stderr, "                       downloaded bytes and first gap tags before the\n");
+    fprintf(stderr, "                       real ones\n");
+    fprintf(stderr, "\nDamage:\n");
+    fprintf(stderr, "  -c, --corrupt=MODE   truncate, flip, tagtype, tagcount, blocks or string\n");
+    fprintf(stderr, "\nTree mode:\n");
+    fprintf(stderr, "  -N, --files=COUNT    Write COUNT files under DIR, %d per subdirectory,\n", FILES_PER_DIR);
+    fprintf(stderr, "                       with random sizes, versions and patterns; -g, -u\n");
+    fprintf(stderr, "                       and -n become upper bounds\n");
+    fprintf(stderr, "  -C, --damaged=PCT    Percentage of damaged files (default 0)\n");
+    fprintf(stderr, "\nOther options:\n");
+    fprintf(stderr, "  -r, --seed=N         Random seed (default 1)\n");
+    fprintf(stderr, "  -h, --help           Show this help message\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    unsigned int numFiles = 0;
+    unsigned int damagedPercent = 0;
+    unsigned long long seed = 1;
+    FixedOptions fixed = { 0 };
+    
+    // Default options
+    FileOptions options = {
+        .version = 1,
+        .size = 700U << 20,
+        .blocks = -1,
+        .gaps = 20,
+        .pattern = PATTERN_EVEN,
+        .nameLength = 24,
+        .media = 0,
+        .unknown = 0,
+        .stringLength = 32,
+        .duplicate = 0,
+        .corruption = CORRUPT_NONE
+    };
+    
+    static struct option longopts[] = {
+        { "met-version",   required_argument, NULL, 'v' },
+        { "size",          required_argument, NULL, 's' },
+        { "blocks",        required_argument, NULL, 'b' },
+        { "gaps",          required_argument, NULL, 'g' },
+        { "pattern",       required_argument, NULL, 'p' },
+        { "name-length",   required_argument, NULL, 'n' },
+        { "media",         no_argument,       NULL, 'm' },
+        { "unknown",       required_argument, NULL, 'u' },
+        { "string-length", required_argument, NULL, 'l' },
+        { "duplicate",     no_argument,       NULL, 'd' },
+        { "corrupt",       required_argument, NULL, 'c' },
+        { "files",         required_argument, NULL, 'N' },
+        { "damaged",       required_argument, NULL, 'C' },
+        { "seed",          required_argument, NULL, 'r' },
+        { "help",          no_argument,       NULL, 'h' },
+        { NULL,            0,                 NULL,  0  }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "v:s:b:g:p:n:mu:l:dc:N:C:r:h", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'v':
+                if (strcmp(optarg, "14.0") == 0) {
+                    options.version = 0;
+                } else if (strcmp(optarg, "14.1") == 0) {
+                    options.version = 1;
+                } else {
+                    errx(EXIT_FAILURE, "Unknown version: %s", optarg);
+                }
+                fixed.version = 1;
+                break;
+            case 's':
+                options.size = parseSize(optarg);
+                fixed.size = 1;
+                break;
+            case 'b':
+                options.blocks = (int)parseCount(optarg, MAX_BLOCKS);
+                break;
+            case 'g':
+                options.gaps = parseCount(optarg, 0x7FFFFFFF);
+                break;
+            case 'p':
+                options.pattern = (GapPattern)parseName(optarg, patternNames, PATTERN_COUNT, "gap pattern");
+                fixed.pattern = 1;
+                break;
+            case 'n':
+                options.nameLength = (int)parseCount(optarg, 65535 - 4);
+                break;
+            case 'm':
+                options.media = 1;
+                fixed.media = 1;
+                break;
+            case 'u':
+                options.unknown = parseCount(optarg, 0x7FFFFFFF);
+                break;
+            case 'l':
+                options.stringLength = (int)parseCount(optarg, 65535);
+                break;
+            case 'd':
+                options.duplicate = 1;
+                break;
+            case 'c':
+                options.corruption = (Corruption)parseName(optarg, corruptionNames, CORRUPT_COUNT, "corruption");
+                fixed.corruption = 1;
+                break;
+            case 'N':
+                numFiles = parseCount(optarg, 0x7FFFFFFF);
+                break;
+            case 'C':
+                damagedPercent = parseCount(optarg, 100);
+                break;
+            case 'r':
+                seed = parseCount(optarg, 0xFFFFFFFF);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    seedRandom(seed);
+    
+    if (numFiles > 0) {
+        generateTree(argv[optind], numFiles, &options, &fixed, damagedPercent);
+    } else {
+        Writer writer = { 0 };
+        checkOptions(&options);
+        buildFile(&writer, &options);
+        corruptFile(&writer, options.corruption);
+        writeFile(argv[optind], &writer);
+        free(writer.data);
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -1,9 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,27 +17,140 @@
 #include <strings.h>
 #include <time.h>
 
+#include "libmetinfo.h"
+#include "metprobes.h"
+#include "perfcounters.h"
+
+/**
+ * Summary of a file used by the multi-file reports
+ */
+typedef struct {
+    MetHeader header;
+    unsigned int fileSize;        // File size in bytes (special tag 2)
+    unsigned int downloadedBytes; // Bytes downloaded so far (special tag 8)
+    unsigned int lastSeen;        // Last seen complete (special tag 5)
+    int status;                   // Download status (special tag 20), -1 if missing
+    int priority;                 // Download priority (special tag 24), -1 if missing
+    int ulPriority;               // Upload priority (special tag 25), -1 if missing
+    int numGaps;                  // Number of gaps
+    GapInfo *gaps;                // Gap list, if requested
+    char *name;                   // Filename (special tag 1), if requested
+    int matched;                  // MET_FILTER_FALSE if rejected by --where
+} FileSummary;
+
+/**
+ * Optional parts of a FileSummary (see loadFileSummary)
+ */
+#define SUMMARY_KEEP_GAPS   1
+#define SUMMARY_KEEP_NAME   2
+
+/**
+ * Keys for ordering files (--sort)
+ */
+typedef enum {
+    SORT_NONE,
+    SORT_REMAINING,       // Bytes still to download
+    SORT_PROGRESS,        // Download percentage
+    SORT_SIZE,            // File size
+    SORT_LASTSEEN,        // Last seen complete date
+    SORT_GAPS             // Number of gaps
+} SortKey;
+
+/**
+ * Codes of long options without a short form
+ */
+enum {
+    OPT_SORT = 256,
+    OPT_TOP,
+    OPT_SUMMARY,
+    OPT_DUPES,
+    OPT_UTC,
+    OPT_LIMIT,
+    OPT_SALVAGE,
+    OPT_STATS,
+    OPT_TRACE,
+    OPT_TRACE_THRESHOLD,
+    OPT_PROMETHEUS,
+    OPT_SET,
+    OPT_JOBS,
+    OPT_COMPACT,
+    OPT_PERF_COUNTERS
+};
+
+/**
+ * Phases of processing a file, timed with --stats
+ */
+typedef enum {
+    PHASE_OPEN,           // Opening the file
+    PHASE_HEADER,         // Version, hash and tag count
+    PHASE_FILTER,         // Evaluating --where
+    PHASE_TAGS,           // Decoding the meta tags
+    PHASE_GAPS,           // Pairing gap tags (collectGaps)
+    PHASE_FORMAT,         // Printing the output
+    PHASE_COUNT
+} Phase;
+
+static const char *phaseNames[PHASE_COUNT] = {
+    "open", "header", "filter", "tags", "gaps", "format"
+};
+
+/**
+ * Names of the phases as spans in a --trace file
+ */
+static const char *phaseSpans[PHASE_COUNT] = {
+    "open", "header", "filter", "tag loop", "collectGaps", "output"
+};
+
+#define DEFAULT_TRACE_THRESHOLD 4096    // Smallest tag traced on its own
+#define DEFAULT_JOBS            8       // Files changed at once by --set
+
+/**
+ * A span recorded for --trace
+ */
+typedef struct {
+    const char *name;     // Static string
+    double start;         // CLOCK_MONOTONIC seconds
+    double end;
+    int file;             // Index in Trace.paths, -1 outside any file
+    int thread;           // Worker that recorded it, 0 for the main thread
+    long long offset;     // File offset of a tag span, -1 for phases
+    long long size;       // Tag size in bytes
+} TraceEvent;
+
+/**
+ * Spans of a run, kept in memory and written at exit so that tracing
+ * adds no I/O while files are read
+ */
+typedef struct {
+    TraceEvent *events;
+    size_t numEvents;
+    size_t capacity;
+    char **paths;         // Files in the order they were started
+    int numPaths;
+    int pathCapacity;
+    int thread;           // Worker whose spans go here
+} Trace;
+
 /**
- * Structure to store a meta tag
+ * Phase timings and library counters of a file or a whole run (--stats)
  */
 typedef struct {
-    int type;             // 2=String, 3=Integer
-    int nameLength;       // Length of the name
-    char *name;           // Tag name
-    int valueLength;      // Length of the value (strings only)
-    union {
-        char *stringValue;  // String value
-        int intValue;       // Integer value
-    } value;
-} MetaTag;
+    double seconds[PHASE_COUNT];
+    MetStats counters;
+    int files;
+    unsigned long long tags;  // Meta tags decoded
+    Trace *trace;             // Spans for --trace, NULL when disabled
+    PerfCounters *perf;       // Counters for --perf-counters, NULL when disabled
+    unsigned long long counts[PHASE_COUNT][PERF_MAX_COUNTERS];
+} RunStats;
 
 /**
- * Structure to store gap information
+ * Clock and performance counters at the start of a phase
  */
 typedef struct {
-    unsigned int start;   // Gap start position (bytes)
-    unsigned int end;     // Gap end position (bytes)
-} GapInfo;
+    double seconds;
+    unsigned long long counts[PERF_MAX_COUNTERS];
+} PhaseStart;
 
 /**
  * Structure to store program options
@@ -44,6 +163,7 @@ typedef struct {
     int verbose;          // Verbose output
     int visualize_gaps;   // Visualize gaps
     int json_output;      // Output in JSON format
+    int time_format;      // MET_TIME_LOCAL or MET_TIME_UTC
     
     // Specific field options
     int show_filename;    // Show filename
@@ -55,25 +175,32 @@ typedef struct {
     int show_tagcount;    // Show number of tags only
     
     char *filename;       // Input filename
+    char *where;          // Filter expression (--where)
+    int batch;            // More than one input file
+    
+    // Multi-file reports
+    SortKey sort_key;     // Order files by this key (--sort)
+    int sort_descending;  // Largest values first
+    int top;              // Only list the first N files, 0 = all
+    int summary;          // Print aggregates instead of per-file output
+    int dupes;            // Report hashes found in more than one file
+    char *prometheus;     // Textfile for node_exporter (--prometheus-textfile)
+    int jobs;             // Files patched at once (--set)
+    int compact;          // Merge the gaps and rewrite the files (--compact)
+    int salvage;          // Keep the tags of damaged files, try .bak copies
+    RunStats *stats;      // Timings for --stats and --trace, NULL when disabled
+    int show_stats;       // Print the timings (--stats)
+    MetContext met;       // Library limits, and its counters and spans for stats
 } ProgramOptions;
 
-/**
- * Convert a string to uppercase
- * 
- * @param in_str Input string to convert
- * @param out_str Buffer to hold the converted string
- * @return Pointer to out_str
- */
-char *strtoupper(char *in_str, char *out_str);
-
 /**
  * Show program usage instructions
  */
 void usage(const char *progname) {
-    fprintf(stderr, "Usage: %s -f <file> [options]\n", progname);
+    fprintf(stderr, "Usage: %s -f <file> [options] [file...]\n", progname);
     fprintf(stderr, "Extract ED2K hash and meta tags from .part.met files\n");
     fprintf(stderr, "\nDisplay options:\n");
-    fprintf(stderr, "  -f, --file=FILE      Specify the .part.met file to analyze\n");
+    fprintf(stderr, "  -f, --file=FILE      Specify the .part.met file to analyze (repeatable)\n");
     fprintf(stderr, "  -a, --all            Show all tags (default)\n");
     fprintf(stderr, "  -s, --special        Show only special tags\n");
     fprintf(stderr, "  -g, --gap            Show only gap tags\n");
@@ -87,10 +214,43 @@ void usage(const char *progname) {
     fprintf(stderr, "  -e, --hash           Show ED2K hash only\n");
     fprintf(stderr, "  -m, --metversion     Show .part.met version only (14.0 or 14.1)\n");
     fprintf(stderr, "  -c, --tagcount       Show number of meta tags only\n");
+    fprintf(stderr, "\nFiltering:\n");
+    fprintf(stderr, "  -w, --where=EXPR     Only output the file if EXPR matches (exit status 1 if not)\n");
+    fprintf(stderr, "                       e.g. 'progress < 50 && size > 1G && status == paused'\n");
+    fprintf(stderr, "\nMulti-file reports (FILE may be a directory):\n");
+    fprintf(stderr, "      --sort=KEY       List files ordered by remaining, progress, size,\n");
+    fprintf(stderr, "                       lastseen or gaps\n");
+    fprintf(stderr, "      --top=N          Only list the first N files\n");
+    fprintf(stderr, "  -r, --reverse        Reverse the sort order\n");
+    fprintf(stderr, "      --summary        Print totals and distributions over all files\n");
+    fprintf(stderr, "      --dupes          List ED2K hashes found in more than one file\n");
+    fprintf(stderr, "      --prometheus-textfile=PATH\n");
+    fprintf(stderr, "                       Write per-download and total gauges to PATH for the\n");
+    fprintf(stderr, "                       node_exporter textfile collector\n");
+    fprintf(stderr, "\nEditing (FILE may be a directory):\n");
+    fprintf(stderr, "      --set=LIST       Change tags in place, e.g. prio=high,status=paused;\n");
+    fprintf(stderr, "                       keys are status, prio and ulprio\n");
+    fprintf(stderr, "      --jobs=N         Files changed at once (default %d)\n", DEFAULT_JOBS);
+    fprintf(stderr, "      --compact        Merge overlapping and adjacent gaps and rewrite\n");
+    fprintf(stderr, "                       the files that shrink\n");
+    fprintf(stderr, "\nInput limits:\n");
+    fprintf(stderr, "      --limit=LIST     Reject files over these counts, e.g. tags=10000,\n");
+    fprintf(stderr, "                       blocks=4096,string=1024\n");
+    fprintf(stderr, "      --salvage        Show the tags decoded before any damage, using the\n");
+    fprintf(stderr, "                       .part.met.bak copy if it is more complete\n");
     fprintf(stderr, "\nOutput format:\n");
     fprintf(stderr, "  -j, --json           Output in JSON format\n");
+    fprintf(stderr, "      --utc            Show dates as ISO-8601 UTC\n");
     fprintf(stderr, "\nOther options:\n");
     fprintf(stderr, "  -v, --verbose        Show detailed information\n");
+    fprintf(stderr, "      --stats          Print phase timings, read calls, allocations and\n");
+    fprintf(stderr, "                       peak memory to standard error\n");
+    fprintf(stderr, "      --perf-counters  Print CPU cycles, instructions, branch and cache\n");
+    fprintf(stderr, "                       misses of each phase to standard error\n");
+    fprintf(stderr, "      --trace=FILE     Write the phases of the run as Chrome trace events\n");
+    fprintf(stderr, "      --trace-threshold=BYTES\n");
+    fprintf(stderr, "                       Trace tags of at least this size on their own\n");
+    fprintf(stderr, "                       (default %d)\n", DEFAULT_TRACE_THRESHOLD);
     fprintf(stderr, "  -V, --version        Show program version\n");
     fprintf(stderr, "  -z, --visualize      Visualize file download status\n");
     fprintf(stderr, "  -h, --help           Show this help message\n");
@@ -98,786 +258,3040 @@ void usage(const char *progname) {
 }
 
 /**
- * Read a byte from the file
+ * Parse a --limit list of KEY=N pairs into the parser limits.
+ * Returns 0, or -1 if the list is invalid.
  */
-unsigned char readByte(int fd) {
-    unsigned char byte;
-    if (read(fd, &byte, 1) != 1) {
-        err(EXIT_FAILURE, "Error reading file");
+int parseLimits(const char *list, MetLimits *limits) {
+    const struct {
+        const char *name;
+        unsigned int *value;
+    } limitNames[] = {
+        { "tags",   &limits->maxTags },
+        { "blocks", &limits->maxBlocks },
+        { "string", &limits->maxStringLength },
+        { NULL,     NULL }
+    };
+    const char *p = list;
+    
+    while (*p != '\0') {
+        size_t length = strcspn(p, "=");
+        int i;
+        
+        for (i = 0; limitNames[i].name; i++) {
+            if (strlen(limitNames[i].name) == length && strncasecmp(p, limitNames[i].name, length) == 0) {
+                break;
+            }
+        }
+        if (limitNames[i].name == NULL || p[length] != '=') {
+            return -1;
+        }
+        
+        char *end;
+        p += length + 1;
+        unsigned long value = strtoul(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0') || value == 0 || value > 0xFFFFFFFFul) {
+            return -1;
+        }
+        *limitNames[i].value = (unsigned int)value;
+        
+        p = *end == ',' ? end + 1 : end;
     }
-    return byte;
+    
+    return 0;
 }
 
 /**
- * Read a word (2 bytes) from the file
+ * Print a warning for a file that could not be parsed
  */
-unsigned short readWord(int fd) {
-    unsigned char bytes[2];
-    if (read(fd, bytes, 2) != 2) {
-        err(EXIT_FAILURE, "Error reading file");
+void reportMetError(const char *path, int error) {
+    if (error == MET_ERR_IO) {
+        warn("%s: %s", path, metErrorString(error));
+    } else {
+        warnx("%s: %s", path, metErrorString(error));
     }
-    return (bytes[0] | (bytes[1] << 8));
 }
 
 /**
- * Read a dword (4 bytes) from the file
+ * Check whether a single script-friendly field was requested
  */
-unsigned int readDWord(int fd) {
-    unsigned char bytes[4];
-    if (read(fd, bytes, 4) != 4) {
-        err(EXIT_FAILURE, "Error reading file");
-    }
-    return (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24));
+int isSingleFieldOutput(const ProgramOptions *options) {
+    return options->show_hash || options->show_metversion || options->show_tagcount ||
+           options->show_filename || options->show_filesize || options->show_date ||
+           options->show_progress;
 }
 
 /**
- * Read a string of length len from the file
+ * Start the output record of a file when several files are processed
  */
-char *readString(int fd, int len) {
-    char *str = (char *)malloc(len + 1);
-    if (str == NULL) {
-        err(EXIT_FAILURE, "Memory allocation error");
+void beginRecord(const char *path, const ProgramOptions *options) {
+    if (!options->batch) {
+        return;
     }
-    if (read(fd, str, len) != len) {
-        free(str);
-        err(EXIT_FAILURE, "Error reading file");
-    }
-    str[len] = '\0';
-    return str;
-}
-
-/**
- * Return a description for known special tags
- */
-const char *getSpecialTagDescription(int nameValue, int intValue) {
-    switch (nameValue) {
-        case 1:
-            return "Filename";
-        case 2:
-            return "File size in bytes";
-        case 3:
-            return "File type";
-        case 4:
-            return "File format";
-        case 5:
-            return "Last time file was seen complete on network";
-        case 8:
-            return "Number of bytes downloaded so far";
-        case 18:
-            return "Temporary (.part) filename";
-        case 19:
-            return "Download priority (eDonkey/Overnet <0.49)";
-        case 20:
-            switch (intValue) {
-                case 0: return "Download status: Ready";
-                case 1: return "Download status: Empty";
-                case 2: return "Download status: Waiting for hash";
-                case 3: return "Download status: Hashing";
-                case 4: return "Download status: Error";
-                case 6: return "Download status: Unknown";
-                case 7: return "Download status: Paused";
-                case 8: return "Download status: Completing";
-                case 9: return "Download status: Completed";
-                default: return "Download status: Unknown";
-            }
-        case 24:
-            switch (intValue) {
-                case 0: return "Download priority: Low";
-                case 1: return "Download priority: Normal";
-                case 2: return "Download priority: High";
-                case 3: return "Download priority: Very high (eMule) / Highest/Horde (eDonkey/Overnet)";
-                case 4: return "Download priority: Very low (eMule)";
-                case 5: return "Download priority: Auto (eMule)";
-                default: return "Download priority: Unknown";
-            }
-        case 25:
-            switch (intValue) {
-                case 0: return "Upload priority: Low";
-                case 1: return "Upload priority: Normal";
-                case 2: return "Upload priority: High";
-                case 3: return "Upload priority: Very high";
-                case 4: return "Upload priority: Very low";
-                case 5: return "Upload priority: Auto";
-                default: return "Upload priority: Unknown";
-            }
-        default:
-            return NULL;
+    
+    if (options->json_output) {
+        // One JSON object per line
+        char *escapedPath = jsonEscapeString(path);
+        printf("{\"file\":\"%s\",\"result\":", escapedPath ? escapedPath : "");
+        free(escapedPath);
+    } else if (isSingleFieldOutput(options)) {
+        printf("%s: ", path);
+    } else {
+        printf("==> %s <==\n", path);
     }
 }
 
 /**
- * Return a description for a gap tag
+ * Terminate the output record of a file when several files are processed
  */
-const char *getGapTagDescription(unsigned char firstChar) {
-    switch (firstChar) {
-        case 9:
-            return "Start of gap (undownloaded area)";
-        case 10:
-            return "End of gap (undownloaded area)";
-        default:
-            return NULL;
+void endRecord(const ProgramOptions *options) {
+    if (!options->batch) {
+        return;
+    }
+    
+    if (options->json_output) {
+        printf("}\n");
+    } else {
+        printf("\n");
     }
 }
 
 /**
- * Return a description for known standard tags
+ * Read the clock for phase timing. Returns 0 without reading the clock
+ * when stats is NULL, so timing costs nothing unless --stats is given.
  */
-const char *getStandardTagDescription(const char *tagName) {
-    if (strcasecmp(tagName, "Artist") == 0) {
-        return "Media file artist";
-    } else if (strcasecmp(tagName, "Album") == 0) {
-        return "Media file album";
-    } else if (strcasecmp(tagName, "Title") == 0) {
-        return "Media file title";
-    } else if (strcasecmp(tagName, "length") == 0) {
-        return "Media file duration";
-    } else if (strcasecmp(tagName, "bitrate") == 0) {
-        return "Media file bitrate";
-    } else if (strcasecmp(tagName, "codec") == 0) {
-        return "Media file codec";
+double phaseClock(const RunStats *stats) {
+    struct timespec ts;
+    
+    if (stats == NULL) {
+        return 0.0;
     }
-    return NULL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 /**
- * Read and parse a meta tag from the file
+ * Start timing a phase, and counting it with --perf-counters
  */
-MetaTag *readMetaTag(int fd) {
-    MetaTag *tag = (MetaTag *)malloc(sizeof(MetaTag));
-    if (tag == NULL) {
-        err(EXIT_FAILURE, "Memory allocation error");
-    }
+PhaseStart startPhase(const RunStats *stats) {
+    PhaseStart start;
     
-    // Read tag type
-    tag->type = readByte(fd);
-    
-    // Read name length
-    tag->nameLength = readWord(fd);
-    
-    // Read name
-    tag->name = readString(fd, tag->nameLength);
-    
-    // Read value based on type
-    if (tag->type == 2) { // String
-        tag->valueLength = readWord(fd);
-        tag->value.stringValue = readString(fd, tag->valueLength);
-    } else if (tag->type == 3) { // Integer
-        tag->value.intValue = readDWord(fd);
-    } else {
-        fprintf(stderr, "Error: Unrecognized tag type: %d\n", tag->type);
-        free(tag->name);
-        free(tag);
-        return NULL;
+    start.seconds = phaseClock(stats);
+    if (stats != NULL && stats->perf != NULL && readPerfCounters(stats->perf, start.counts) == -1) {
+        memset(start.counts, 0, sizeof(start.counts));
     }
-    
-    return tag;
+    return start;
 }
 
 /**
- * Free memory used by a meta tag
+ * Record a span for --trace
  */
-void freeMetaTag(MetaTag *tag) {
-    if (tag != NULL) {
-        free(tag->name);
-        if (tag->type == 2) { // String
-            free(tag->value.stringValue);
+void addTraceEvent(Trace *trace, const char *name, double start, double end, long long offset, long long size) {
+    if (trace->numEvents == trace->capacity) {
+        size_t capacity = trace->capacity ? trace->capacity * 2 : 1024;
+        TraceEvent *events = (TraceEvent *)realloc(trace->events, capacity * sizeof(TraceEvent));
+        if (events == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
         }
-        free(tag);
+        trace->events = events;
+        trace->capacity = capacity;
     }
+    
+    TraceEvent *event = &trace->events[trace->numEvents++];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->file = trace->numPaths - 1;
+    event->thread = trace->thread;
+    event->offset = offset;
+    event->size = size;
+}
+
+/**
+ * Span callback of the library: version probe, hash read and large tags
+ */
+void traceLibrarySpan(void *context, const char *name, double start, double end, off_t offset, size_t size) {
+    addTraceEvent((Trace *)context, name, start, end, offset, size);
 }
 
 /**
- * Determine tag type for filtering
- * Returns: 1=special, 2=gap, 3=standard, 4=unknown
+ * Record a span that ends now
  */
-int determineTagType(MetaTag *tag) {
-    // Special tag (1-byte name)
-    if (tag->nameLength == 1) {
-        return 1;
+void traceSpan(RunStats *stats, const char *name, PhaseStart start) {
+    if (stats != NULL && stats->trace != NULL) {
+        addTraceEvent(stats->trace, name, start.seconds, phaseClock(stats), -1, 0);
     }
-    // Gap tag (name starts with 9 or 10)
-    else if (tag->nameLength >= 2 && (tag->name[0] == 9 || tag->name[0] == 10)) {
-        return 2;
+}
+
+/**
+ * Start a file: the spans recorded until the next file belong to path
+ */
+void traceFile(RunStats *stats, const char *path) {
+    Trace *trace = stats != NULL ? stats->trace : NULL;
+    
+    if (trace == NULL) {
+        return;
     }
-    // Standard tag or unknown
-    else {
-        // Convert name to C string
-        char tagName[tag->nameLength + 1];
-        memcpy(tagName, tag->name, tag->nameLength);
-        tagName[tag->nameLength] = '\0';
-        
-        // Check if it's a known standard tag
-        if (getStandardTagDescription(tagName) != NULL) {
-            return 3;
+    if (trace->numPaths == trace->pathCapacity) {
+        int capacity = trace->pathCapacity ? trace->pathCapacity * 2 : 64;
+        char **paths = (char **)realloc(trace->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
         }
-        // Unknown tag
-        return 4;
+        trace->paths = paths;
+        trace->pathCapacity = capacity;
+    }
+    if ((trace->paths[trace->numPaths] = strdup(path)) == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
     }
+    trace->numPaths++;
 }
 
 /**
- * Format a timestamp into a readable date string
+ * Add the time since start to a phase
  */
-char *formatTimestamp(unsigned int timestamp) {
-    time_t t = (time_t)timestamp;
-    struct tm *tm_info = localtime(&t);
+void endPhase(RunStats *stats, Phase phase, PhaseStart start) {
+    unsigned long long counts[PERF_MAX_COUNTERS];
     
-    static char buffer[100];
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
+    if (stats == NULL) {
+        return;
+    }
+    if (stats->perf != NULL && readPerfCounters(stats->perf, counts) == 0) {
+        for (int i = 0; i < stats->perf->numCounters; i++) {
+            stats->counts[phase][i] += counts[i] - start.counts[i];
+        }
+    }
     
-    return buffer;
+    double end = phaseClock(stats);
+    stats->seconds[phase] += end - start.seconds;
+    if (stats->trace != NULL) {
+        addTraceEvent(stats->trace, phaseSpans[phase], start.seconds, end, -1, 0);
+    }
+}
+
+/**
+ * Timings and counters of one file: the run totals after it minus the
+ * totals before it
+ */
+void diffRunStats(RunStats *result, const RunStats *after, const RunStats *before) {
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        result->seconds[i] = after->seconds[i] - before->seconds[i];
+    }
+    result->counters.readCalls = after->counters.readCalls - before->counters.readCalls;
+    result->counters.bytesRead = after->counters.bytesRead - before->counters.bytesRead;
+    result->counters.seekCalls = after->counters.seekCalls - before->counters.seekCalls;
+    result->counters.allocations = after->counters.allocations - before->counters.allocations;
+    result->counters.allocatedBytes = after->counters.allocatedBytes - before->counters.allocatedBytes;
+    result->files = after->files - before->files;
+    result->tags = after->tags - before->tags;
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        for (int j = 0; j < PERF_MAX_COUNTERS; j++) {
+            result->counts[i][j] = after->counts[i][j] - before->counts[i][j];
+        }
+    }
+}
+
+/**
+ * Peak resident set size of the process in kilobytes
+ */
+long peakRss(void) {
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
 }
 
 /**
- * JSON escape a string
+ * Print timings and counters. The JSON form is an object for the "stats"
+ * member of a record; the text form is one line for a file, or a block
+ * for the totals of a run (path NULL, wall is the elapsed run time).
  */
-char *jsonEscapeString(const char *str) {
-    if (str == NULL) return NULL;
+void printRunStats(FILE *out, const char *path, const RunStats *stats, double wall, int json_output) {
+    const MetStats *c = &stats->counters;
     
-    size_t len = strlen(str);
-    // Each character could expand up to "\\u00XX" (6 characters)
-    // so allocate enough space for the worst case
-    size_t escaped_len = len * 6 + 1;
+    if (json_output) {
+        fprintf(out, "{");
+        if (path == NULL) {
+            fprintf(out, "\"files\":%d,\"total_ms\":%.3f,", stats->files, wall * 1e3);
+        }
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            fprintf(out, "\"%s_ms\":%.3f,", phaseNames[i], stats->seconds[i] * 1e3);
+        }
+        fprintf(out, "\"read_calls\":%llu,\"bytes_read\":%llu,\"seek_calls\":%llu,"
+                "\"allocations\":%llu,\"allocated_bytes\":%llu,\"peak_rss_kb\":%ld}",
+                c->readCalls, c->bytesRead, c->seekCalls, c->allocations, c->allocatedBytes, peakRss());
+    } else if (path != NULL) {
+        fprintf(out, "%s:", path);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            fprintf(out, " %s %.3f ms,", phaseNames[i], stats->seconds[i] * 1e3);
+        }
+        fprintf(out, " %llu reads, %llu bytes, %llu allocations, %llu bytes allocated\n",
+                c->readCalls, c->bytesRead, c->allocations, c->allocatedBytes);
+    } else {
+        fprintf(out, "\n=== STATS ===\n");
+        fprintf(out, "Files: %d\n", stats->files);
+        fprintf(out, "Time: %.3f ms total", wall * 1e3);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            fprintf(out, ", %s %.3f", phaseNames[i], stats->seconds[i] * 1e3);
+        }
+        fprintf(out, " ms\n");
+        fprintf(out, "Read calls: %llu (%llu bytes), seeks: %llu\n", c->readCalls, c->bytesRead, c->seekCalls);
+        fprintf(out, "Allocations: %llu (%llu bytes)\n", c->allocations, c->allocatedBytes);
+        fprintf(out, "Peak RSS: %ld KB\n", peakRss());
+    }
+}
+
+/**
+ * Print one row of counter values, divided by divisor unless it is 0
+ */
+void printPerfRow(FILE *out, const PerfCounters *perf, const char *label,
+                  const unsigned long long *counts, unsigned long long divisor, int json_output) {
+    for (int i = 0; i < perf->numCounters; i++) {
+        if (json_output) {
+            fprintf(out, "%s\"%s\":", i > 0 ? "," : "", perf->names[i]);
+        } else if (i == 0) {
+            fprintf(out, "%-12s", label);
+        }
+        if (divisor > 0) {
+            fprintf(out, json_output ? "%.3f" : " %15.1f", (double)counts[i] / divisor);
+        } else {
+            fprintf(out, json_output ? "%llu" : " %15llu", counts[i]);
+        }
+    }
+    if (!json_output) {
+        fprintf(out, "\n");
+    }
+}
+
+/**
+ * Print the performance counters of each phase (--perf-counters), their
+ * totals, and the totals per file and per decoded tag
+ */
+void printPerfCounters(FILE *out, const RunStats *stats, int json_output) {
+    const PerfCounters *perf = stats->perf;
+    unsigned long long total[PERF_MAX_COUNTERS];
     
-    char *escaped = (char *)malloc(escaped_len);
-    if (escaped == NULL) {
-        return NULL;
+    memset(total, 0, sizeof(total));
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        for (int i = 0; i < perf->numCounters; i++) {
+            total[i] += stats->counts[phase][i];
+        }
     }
     
-    size_t j = 0;
-    for (size_t i = 0; i < len; i++) {
-        switch (str[i]) {
-            case '\\': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = '\\'; 
-                break;
-            case '"': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = '"'; 
-                break;
-            case '\b': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = 'b'; 
-                break;
-            case '\f': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = 'f'; 
-                break;
-            case '\n': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = 'n'; 
-                break;
-            case '\r': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = 'r'; 
-                break;
-            case '\t': 
-                escaped[j++] = '\\'; 
-                escaped[j++] = 't'; 
-                break;
-            default:
-                if ((unsigned char)str[i] < 32) {
-                    // Non-printable control characters
-                    sprintf(escaped + j, "\\u%04x", (unsigned char)str[i]);
-                    j += 6;
-                } else {
-                    escaped[j++] = str[i];
-                }
-                break;
+    if (json_output) {
+        fprintf(out, "{\"perf_counters\":{\"source\":\"%s\",\"files\":%d,\"tags\":%llu,\"phases\":{",
+                perf->hardware ? "hardware" : "software", stats->files, stats->tags);
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            fprintf(out, "%s\"%s\":{", phase > 0 ? "," : "", phaseNames[phase]);
+            printPerfRow(out, perf, NULL, stats->counts[phase], 0, 1);
+            fprintf(out, "}");
         }
+        fprintf(out, "},\"total\":{");
+        printPerfRow(out, perf, NULL, total, 0, 1);
+        fprintf(out, "},\"per_file\":{");
+        if (stats->files > 0) {
+            printPerfRow(out, perf, NULL, total, stats->files, 1);
+        }
+        fprintf(out, "},\"per_tag\":{");
+        if (stats->tags > 0) {
+            printPerfRow(out, perf, NULL, total, stats->tags, 1);
+        }
+        fprintf(out, "}}}\n");
+        return;
     }
-    escaped[j] = '\0';
     
-    return escaped;
+    fprintf(out, "\n=== PERF COUNTERS (%s) ===\n", perf->hardware ? "hardware, user space" : "software fallback");
+    fprintf(out, "%-12s", "phase");
+    for (int i = 0; i < perf->numCounters; i++) {
+        fprintf(out, " %15s", perf->names[i]);
+    }
+    fprintf(out, "\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        printPerfRow(out, perf, phaseNames[phase], stats->counts[phase], 0, 0);
+    }
+    printPerfRow(out, perf, "total", total, 0, 0);
+    if (stats->files > 0) {
+        printPerfRow(out, perf, "per file", total, stats->files, 0);
+    }
+    if (stats->tags > 0) {
+        printPerfRow(out, perf, "per tag", total, stats->tags, 0);
+    }
 }
 
 /**
- * Print meta tag information with optional verbosity
+ * Write the spans of a run as Chrome trace-event JSON, which Perfetto
+ * and chrome://tracing load. Times are microseconds since origin.
  */
-void printMetaTag(MetaTag *tag, int verbose, int json_output) {
-    int tagType = determineTagType(tag);
+int writeTrace(const char *path, const Trace *trace, double origin) {
+    FILE *out = fopen(path, "w");
     
-    if (json_output) {
-        printf("{\"type\":");
-        
-        // Tag type
-        switch (tagType) {
-            case 1: printf("\"special\""); break;
-            case 2: printf("\"gap\""); break;
-            case 3: printf("\"standard\""); break;
-            case 4: printf("\"unknown\""); break;
+    if (out == NULL) {
+        return -1;
+    }
+    
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+            "\"args\":{\"name\":\"metinfo\"}}");
+    for (size_t i = 0; i < trace->numEvents; i++) {
+        const TraceEvent *event = &trace->events[i];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":1,\"tid\":%d,\"args\":{", event->name,
+                strcmp(event->name, "tag") == 0 ? "tag" : event->offset >= 0 ? "read" : "phase",
+                (event->start - origin) * 1e6, (event->end - event->start) * 1e6, event->thread + 1);
+        if (event->file >= 0) {
+            char *escaped = jsonEscapeString(trace->paths[event->file]);
+            fprintf(out, "\"file\":\"%s\"", escaped ? escaped : "");
+            free(escaped);
         }
-        
-        // Tag ID for special tags
-        if (tagType == 1) {
-            printf(",\"id\":%d", (unsigned char)tag->name[0]);
+        if (event->offset >= 0) {
+            fprintf(out, "%s\"offset\":%lld,\"size\":%lld", event->file >= 0 ? "," : "",
+                    event->offset, event->size);
         }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    
+    if (fclose(out) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Move the spans and paths of a worker's trace to the end of total
+ */
+void mergeTrace(Trace *total, Trace *trace) {
+    for (size_t i = 0; i < trace->numEvents; i++) {
+        const TraceEvent *event = &trace->events[i];
         
-        // Tag name for non-special tags
-        if (tagType != 1) {
-            if (tagType == 2) {
-                // Gap tag
-                unsigned char firstChar = tag->name[0];
-                printf(",\"gap_type\":");
-                if (firstChar == 9) {
-                    printf("\"start\"");
-                } else if (firstChar == 10) {
-                    printf("\"end\"");
-                } else {
-                    printf("\"unknown\"");
-                }
-                
-                // Extract reference number
-                if (tag->nameLength > 1) {
-                    char refNum[tag->nameLength];
-                    memcpy(refNum, tag->name + 1, tag->nameLength - 1);
-                    refNum[tag->nameLength - 1] = '\0';
-                    printf(",\"reference\":\"%s\"", refNum);
-                }
-            } else {
-                // Standard or unknown tag
-                char tagName[tag->nameLength + 1];
-                memcpy(tagName, tag->name, tag->nameLength);
-                tagName[tag->nameLength] = '\0';
-                
-                char *escapedName = jsonEscapeString(tagName);
-                printf(",\"name\":\"%s\"", escapedName ? escapedName : "");
-                free(escapedName);
-            }
+        addTraceEvent(total, event->name, event->start, event->end, event->offset, event->size);
+        total->events[total->numEvents - 1].file = event->file >= 0 ? total->numPaths + event->file : -1;
+        total->events[total->numEvents - 1].thread = event->thread;
+    }
+    if (trace->numPaths > 0) {
+        char **paths = (char **)realloc(total->paths, (total->numPaths + trace->numPaths) * sizeof(char *));
+        if (paths == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
         }
-        
-        // Description for known tags
-        if (tagType == 1) {
-            const char *desc = getSpecialTagDescription((unsigned char)tag->name[0], 
-                                                       tag->type == 3 ? tag->value.intValue : 0);
-            if (desc) {
-                char *escapedDesc = jsonEscapeString(desc);
-                printf(",\"description\":\"%s\"", escapedDesc ? escapedDesc : "");
-                free(escapedDesc);
-            }
+        memcpy(paths + total->numPaths, trace->paths, trace->numPaths * sizeof(char *));
+        total->paths = paths;
+        total->numPaths += trace->numPaths;
+        total->pathCapacity = total->numPaths;
+    }
+    free(trace->paths);
+    free(trace->events);
+    memset(trace, 0, sizeof(*trace));
+}
+
+/**
+ * Free the spans and paths of a trace
+ */
+void freeTrace(Trace *trace) {
+    for (int i = 0; i < trace->numPaths; i++) {
+        free(trace->paths[i]);
+    }
+    free(trace->paths);
+    free(trace->events);
+}
+
+/**
+ * Check whether a filename has the .part.met extension
+ */
+int hasPartMetSuffix(const char *name) {
+    size_t len = strlen(name);
+    return len >= 9 && strcmp(name + len - 9, ".part.met") == 0;
+}
+
+/**
+ * Recursively call a function for every .part.met file in a directory
+ */
+void walkDirectory(const char *dirPath, void (*callback)(const char *, void *), void *ctx) {
+    DIR *dir = opendir(dirPath);
+    if (dir == NULL) {
+        warn("Unable to open directory %s", dirPath);
+        return;
+    }
+    
+    size_t dirLength = strlen(dirPath);
+    const char *separator = (dirLength > 0 && dirPath[dirLength - 1] == '/') ? "" : "/";
+    struct dirent *entry;
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
         }
         
-        // Value
-        if (tag->type == 3) { // Integer
-            printf(",\"value\":%d", tag->value.intValue);
-            
-            // Add additional info for certain special tags
-            if (tagType == 1) {
-                unsigned char nameValue = tag->name[0];
-                if (nameValue == 2 || nameValue == 8) { // File size or downloaded bytes
-                    printf(",\"value_mb\":%.2f", tag->value.intValue / 1048576.0);
-                } else if (nameValue == 5) { // Last seen date
-                    printf(",\"value_date\":\"%s\"", formatTimestamp(tag->value.intValue));
-                }
-            }
-        } else { // String
-            char *escapedValue = jsonEscapeString(tag->value.stringValue);
-            printf(",\"value\":\"%s\"", escapedValue ? escapedValue : "");
-            free(escapedValue);
+        size_t length = dirLength + strlen(entry->d_name) + 2;
+        char *child = (char *)malloc(length);
+        if (child == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
         }
+        snprintf(child, length, "%s%s%s", dirPath, separator, entry->d_name);
         
-        printf("}");
-    } else {
-        // Special tag (1-byte name)
-        if (tagType == 1) {
-            unsigned char nameValue = tag->name[0];
-            printf("Tag: (Special, %d) ", nameValue);
-            
-            const char *desc = NULL;
-            if (tag->type == 3) { // Integer
-                desc = getSpecialTagDescription(nameValue, tag->value.intValue);
-                if (desc) {
-                    printf("%s = %d", desc, tag->value.intValue);
-                    
-                    // Extra details for certain special tags in verbose mode
-                    if (verbose) {
-                        if (nameValue == 2) { // File size
-                            printf(" (%.2f MB)", tag->value.intValue / 1048576.0);
-                        } else if (nameValue == 8) { // Downloaded bytes
-                            printf(" (%.2f MB)", tag->value.intValue / 1048576.0);
-                        } else if (nameValue == 5) { // Last seen date
-                            printf(" (%s)", formatTimestamp(tag->value.intValue));
-                        } else if (nameValue == 20) { // Status
-                            switch(tag->value.intValue) {
-                                case 0: printf(" - File is ready for download"); break;
-                                case 7: printf(" - Download is manually paused"); break;
-                                case 9: printf(" - Download is fully completed"); break;
-                            }
-                        }
-                    }
-                } else {
-                    printf("Name: %d, Value: %d", nameValue, tag->value.intValue);
-                }
-            } else { // String
-                desc = getSpecialTagDescription(nameValue, 0);
-                if (desc) {
-                    printf("%s = \"%s\"", desc, tag->value.stringValue);
-                } else {
-                    printf("Name: %d, Value: \"%s\"", nameValue, tag->value.stringValue);
-                }
-            }
-        }
-        // Gap tag
-        else if (tagType == 2) {
-            const char *desc = getGapTagDescription(tag->name[0]);
-            if (desc) {
-                // Extract reference number
-                char refNum[tag->nameLength];
-                memcpy(refNum, tag->name + 1, tag->nameLength - 1);
-                refNum[tag->nameLength - 1] = '\0';
-                
-                printf("Tag: (Gap) %s, Reference: %s", desc, refNum);
-                
-                if (tag->type == 3) { // Integer
-                    printf(", Value: %d", tag->value.intValue);
-                    if (verbose) {
-                        printf(" (%.2f MB)", tag->value.intValue / 1048576.0);
-                    }
-                } else { // String
-                    printf(", Value: \"%s\"", tag->value.stringValue);
-                }
-            } else {
-                printf("Tag: Unrecognized gap tag");
-            }
-        }
-        // Standard or unknown tag
-        else {
-            // Convert name to C string
-            char tagName[tag->nameLength + 1];
-            memcpy(tagName, tag->name, tag->nameLength);
-            tagName[tag->nameLength] = '\0';
-            
-            const char *desc = getStandardTagDescription(tagName);
-            if (desc) {
-                printf("Tag: (Standard) %s = ", tagName);
-                if (tag->type == 3) { // Integer
-                    printf("%d", tag->value.intValue);
-                } else { // String
-                    printf("\"%s\"", tag->value.stringValue);
-                }
-                if (verbose) {
-                    printf(" - %s", desc);
-                }
-            } else {
-                printf("Tag: (Unknown) Name: \"%s\", ", tagName);
-                if (tag->type == 3) { // Integer
-                    printf("Value: %d", tag->value.intValue);
-                } else { // String
-                    printf("Value: \"%s\"", tag->value.stringValue);
-                }
+        // Symbolic links to directories are not followed
+        struct stat st;
+        if (lstat(child, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                walkDirectory(child, callback, ctx);
+            } else if (hasPartMetSuffix(entry->d_name)) {
+                callback(child, ctx);
             }
         }
-        
-        printf("\n");
+        free(child);
     }
+    
+    closedir(dir);
 }
 
 /**
- * Display specific field information
+ * Call a function for every .part.met file named by a path. Files given
+ * directly are always used, directories are searched recursively.
  */
-void displaySpecificField(MetaTag **tags, int numTags, int fieldType, int verbose, int json_output) {
-    // Look for the specific field
-    for (int i = 0; i < numTags; i++) {
-        if (tags[i]->nameLength == 1 && tags[i]->name[0] == fieldType) {
-            switch (fieldType) {
-                case 1: // Filename
-                    if (tags[i]->type == 2) {
-                        if (json_output) {
-                            char *escapedValue = jsonEscapeString(tags[i]->value.stringValue);
-                            printf("{\"filename\":\"%s\"}", escapedValue ? escapedValue : "");
-                            free(escapedValue);
-                        } else {
-                            printf("%s", tags[i]->value.stringValue);
-                        }
-                    }
-                    break;
-                    
-                case 2: // File size
-                    if (tags[i]->type == 3) {
-                        if (json_output) {
-                            printf("{\"filesize\":%u", tags[i]->value.intValue);
-                            if (verbose) {
-                                printf(",\"filesize_mb\":%.2f", tags[i]->value.intValue / 1048576.0);
-                            }
-                            printf("}");
-                        } else {
-                            printf("%u", tags[i]->value.intValue);
-                        }
-                    }
-                    break;
-                    
-                case 5: // Last seen date
-                    if (tags[i]->type == 3) {
-                        if (json_output) {
-                            printf("{\"last_seen\":%u", tags[i]->value.intValue);
-                            if (verbose) {
-                                printf(",\"last_seen_date\":\"%s\"", formatTimestamp(tags[i]->value.intValue));
-                            }
-                            printf("}");
-                        } else {
-                            if (verbose) {
-                                printf("%s", formatTimestamp(tags[i]->value.intValue));
-                            } else {
-                                printf("%u", tags[i]->value.intValue);
-                            }
-                        }
-                    }
-                    break;
-            }
-            // Each specific field should only be found once
-            return;
-        }
+void forEachPartMet(const char *path, void (*callback)(const char *, void *), void *ctx) {
+    struct stat st;
+    
+    if (stat(path, &st) == -1) {
+        warn("Unable to open file %s", path);
+        return;
     }
     
-    // Field not found
-    if (json_output) {
-        switch (fieldType) {
-            case 1:
-                printf("{\"filename\":null}");
-                break;
-            case 2:
-                printf("{\"filesize\":null}");
-                break;
-            case 5:
-                printf("{\"last_seen\":null}");
-                break;
-        }
+    if (S_ISDIR(st.st_mode)) {
+        walkDirectory(path, callback, ctx);
     } else {
-        // For script usage, output nothing if field not found
+        callback(path, ctx);
     }
 }
 
 /**
- * Display download progress information
+ * Check whether a path names a directory
+ */
+int isDirectory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * State of the visitor that fills a FileSummary
+ */
+typedef struct {
+    FileSummary *summary;
+    MetaTag **gapTags;            // Copies of the gap tags, paired at the end
+    int numGapTags;
+    int gapCapacity;
+    int keepName;                 // Copy the filename into the summary
+    const MetContext *met;
+} SummaryVisit;
+
+/**
+ * Visitor callback picking the summary fields out of each tag. Only gap
+ * tags are kept, so memory does not grow with the number of other tags.
  */
-void displayProgress(unsigned int fileSize, unsigned int downloadedBytes, int json_output) {
-    double percentage = 0.0;
-    if (fileSize > 0) {
-        percentage = (downloadedBytes * 100.0) / fileSize;
+int visitSummaryTag(void *context, const MetaTag *tag, off_t offset) {
+    SummaryVisit *visit = (SummaryVisit *)context;
+    FileSummary *summary = visit->summary;
+    (void)offset;
+    
+    // A later filename tag overrides an earlier one, as in the -n output
+    if (tag->type == 2 && visit->keepName && tag->specialId == 1) {
+        char *name = strdup(tag->value.stringValue);
+        if (name == NULL) {
+            return MET_ERR_NOMEM;
+        }
+        free(summary->name);
+        summary->name = name;
+    }
+    if (tag->type != 3) {
+        return MET_OK;
     }
     
-    if (json_output) {
-        printf("{\"total_bytes\":%u,\"downloaded_bytes\":%u,\"total_mb\":%.2f,\"downloaded_mb\":%.2f,\"percentage\":%.1f}",
-               fileSize, downloadedBytes,
-               fileSize / 1048576.0, downloadedBytes / 1048576.0,
-               percentage);
-    } else {
-        // For script usage, just output the percentage
-        printf("%.1f", percentage);
+    if (tag->tagClass == 1) { // Special
+        switch (tag->specialId) {
+            case 2:  summary->fileSize = tag->value.intValue; break;
+            case 5:  summary->lastSeen = tag->value.intValue; break;
+            case 8:  summary->downloadedBytes = tag->value.intValue; break;
+            case 20: summary->status = tag->value.intValue; break;
+            case 24: summary->priority = tag->value.intValue; break;
+            case 25: summary->ulPriority = tag->value.intValue; break;
+        }
+    } else if (tag->tagClass == 2) { // Gap
+        if (visit->numGapTags == visit->gapCapacity) {
+            int capacity = visit->gapCapacity ? visit->gapCapacity * 2 : 16;
+            MetaTag **gapTags = (MetaTag **)realloc(visit->gapTags, capacity * sizeof(MetaTag *));
+            if (gapTags == NULL) {
+                return MET_ERR_NOMEM;
+            }
+            visit->gapTags = gapTags;
+            visit->gapCapacity = capacity;
+        }
+        if ((visit->gapTags[visit->numGapTags] = copyMetaTag(tag, visit->met)) == NULL) {
+            return MET_ERR_NOMEM;
+        }
+        visit->numGapTags++;
     }
+    
+    return MET_OK;
 }
 
 /**
- * Collect gap information from all gap tags into an array
+ * Read the header and tags of a file into a summary for the multi-file
+ * reports. The gap list and the filename are only kept when asked for
+ * with SUMMARY_KEEP_GAPS and SUMMARY_KEEP_NAME in keep.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE when the file could not be opened
+ * or was rejected by the filter; summary->matched tells them apart.
  */
-GapInfo* collectGaps(MetaTag **tags, int numTags, int *numGaps) {
-    GapInfo *gaps = NULL;
-    int gapCount = 0;
+int loadFileSummary(const char *path, const MetFilter *filter, int keep, FileSummary *summary, RunStats *stats,
+                    const MetContext *met) {
+    static const MetVisitor visitor = { NULL, visitSummaryTag, NULL };
+    SummaryVisit visit = { summary, NULL, 0, 0, (keep & SUMMARY_KEEP_NAME) != 0, met };
+    int fd;
+    int rc;
+    int matched = MET_FILTER_TRUE;
+    
+    memset(summary, 0, sizeof(FileSummary));
+    summary->status = -1;
+    summary->priority = -1;
+    summary->ulPriority = -1;
+    summary->matched = MET_FILTER_TRUE;
+    
+    traceFile(stats, path);
+    PhaseStart start = startPhase(stats);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        warn("Unable to open file %s", path);
+        return EXIT_FAILURE;
+    }
+    endPhase(stats, PHASE_OPEN, start);
+    MET_PROBE2(file__open, path, fd);
+    if (stats != NULL) {
+        stats->files++;
+    }
+    
+    start = startPhase(stats);
+    rc = readMetHeader(fd, &summary->header, met);
+    endPhase(stats, PHASE_HEADER, start);
     
-    // First, count the number of gap pairs
-    for (int i = 0; i < numTags; i++) {
-        if (tags[i]->nameLength >= 2 && tags[i]->name[0] == 9) { // Start of gap
-            gapCount++;
+    // --where is decided in the same pass, which ends as soon as the
+    // file is rejected
+    if (rc == MET_OK) {
+        start = startPhase(stats);
+        rc = visitMatchingTags(fd, &summary->header, filter, &visitor, &visit, &matched, met);
+        endPhase(stats, PHASE_TAGS, start);
+        if (rc == MET_OK && matched == MET_FILTER_TRUE && stats != NULL) {
+            stats->tags += summary->header.numTags;
         }
     }
+    if (rc == MET_OK && matched == MET_FILTER_TRUE) {
+        start = startPhase(stats);
+        rc = collectGaps(visit.gapTags, visit.numGapTags, &summary->gaps, &summary->numGaps, met);
+        endPhase(stats, PHASE_GAPS, start);
+    }
     
-    // Allocate memory for gaps
-    gaps = (GapInfo *)malloc(gapCount * sizeof(GapInfo));
-    if (gaps == NULL && gapCount > 0) {
-        err(EXIT_FAILURE, "Memory allocation error");
+    for (int i = 0; i < visit.numGapTags; i++) {
+        freeMetaTag(visit.gapTags[i]);
     }
+    free(visit.gapTags);
     
-    // Match start and end gaps
-    int gapIndex = 0;
-    for (int i = 0; i < numTags; i++) {
-        // Find start gap tag
-        if (tags[i]->nameLength >= 2 && tags[i]->name[0] == 9 && tags[i]->type == 3) {
-            char refNum[tags[i]->nameLength];
-            memcpy(refNum, tags[i]->name + 1, tags[i]->nameLength - 1);
-            refNum[tags[i]->nameLength - 1] = '\0';
-            
-            unsigned int startPos = tags[i]->value.intValue;
-            unsigned int endPos = 0;
-            
-            // Find matching end gap
-            for (int j = 0; j < numTags; j++) {
-                if (tags[j]->nameLength >= 2 && tags[j]->name[0] == 10 && tags[j]->type == 3) {
-                    char endRefNum[tags[j]->nameLength];
-                    memcpy(endRefNum, tags[j]->name + 1, tags[j]->nameLength - 1);
-                    endRefNum[tags[j]->nameLength - 1] = '\0';
-                    
-                    if (strcmp(refNum, endRefNum) == 0) {
-                        endPos = tags[j]->value.intValue;
-                        break;
-                    }
-                }
-            }
-            
-            if (endPos > 0 && gapIndex < gapCount) {
-                gaps[gapIndex].start = startPos;
-                gaps[gapIndex].end = endPos;
-                gapIndex++;
-            }
+    if (rc != MET_OK) {
+        reportMetError(path, rc);
+    } else {
+        summary->matched = matched;
+    }
+    close(fd);
+    if (rc != MET_OK || matched != MET_FILTER_TRUE) {
+        free(summary->gaps);
+        free(summary->name);
+        summary->gaps = NULL;
+        summary->name = NULL;
+        return EXIT_FAILURE;
+    }
+    
+    if (!(keep & SUMMARY_KEEP_GAPS)) {
+        free(summary->gaps);
+        summary->gaps = NULL;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Keys accepted by --sort, with the order that puts the most interesting
+ * files first
+ */
+static const struct {
+    const char *name;
+    SortKey key;
+    int descending;
+} sortKeyNames[] = {
+    { "remaining", SORT_REMAINING, 0 },
+    { "progress",  SORT_PROGRESS,  1 },
+    { "size",      SORT_SIZE,      1 },
+    { "lastseen",  SORT_LASTSEEN,  1 },
+    { "gaps",      SORT_GAPS,      0 },
+    { NULL,        SORT_NONE,      0 }
+};
+
+/**
+ * Entry of a sort report
+ */
+typedef struct {
+    double rank;          // Sort value, negated for descending keys
+    double value;         // Key value as printed
+    char *path;           // File path
+} SortEntry;
+
+/**
+ * State of a sort report while files are read
+ */
+typedef struct {
+    const ProgramOptions *options;
+    const MetFilter *filter;
+    SortEntry *entries;   // All entries, or a heap of the best entries with --top
+    size_t count;
+    size_t capacity;
+} SortReport;
+
+/**
+ * Check whether entry a should be listed before entry b
+ */
+int sortEntryBefore(const SortEntry *a, const SortEntry *b) {
+    if (a->rank != b->rank) {
+        return a->rank < b->rank;
+    }
+    return strcmp(a->path, b->path) < 0;
+}
+
+/**
+ * qsort comparison function for sort entries
+ */
+int compareSortEntries(const void *a, const void *b) {
+    if (sortEntryBefore((const SortEntry *)a, (const SortEntry *)b)) {
+        return -1;
+    }
+    return sortEntryBefore((const SortEntry *)b, (const SortEntry *)a) ? 1 : 0;
+}
+
+/**
+ * Restore the heap order below a node. The root of the heap is the entry
+ * that would be listed last, so it is the one replaced by better entries.
+ */
+void siftDownSortHeap(SortEntry *heap, size_t count, size_t index) {
+    for (;;) {
+        size_t largest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        
+        if (left < count && sortEntryBefore(&heap[largest], &heap[left])) {
+            largest = left;
+        }
+        if (right < count && sortEntryBefore(&heap[largest], &heap[right])) {
+            largest = right;
+        }
+        if (largest == index) {
+            return;
+        }
+        
+        SortEntry tmp = heap[index];
+        heap[index] = heap[largest];
+        heap[largest] = tmp;
+        index = largest;
+    }
+}
+
+/**
+ * Add an entry to the report, keeping only the best --top entries
+ */
+void addSortEntry(SortReport *report, double value, const char *path) {
+    SortEntry entry;
+    entry.value = value;
+    entry.rank = report->options->sort_descending ? -value : value;
+    entry.path = (char *)path;
+    
+    size_t top = (size_t)report->options->top;
+    if (top > 0 && report->count == top) {
+        // Heap is full: replace the worst entry if the new one ranks better
+        if (!sortEntryBefore(&entry, &report->entries[0])) {
+            return;
+        }
+        free(report->entries[0].path);
+        report->entries[0] = entry;
+        report->entries[0].path = strdup(path);
+        if (report->entries[0].path == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        siftDownSortHeap(report->entries, report->count, 0);
+        return;
+    }
+    
+    if (report->count == report->capacity) {
+        report->capacity = report->capacity ? report->capacity * 2 : 64;
+        if (top > 0 && report->capacity > top) {
+            report->capacity = top;
+        }
+        report->entries = (SortEntry *)realloc(report->entries, report->capacity * sizeof(SortEntry));
+        if (report->entries == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+    }
+    
+    entry.path = strdup(path);
+    if (entry.path == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    
+    // Sift the new entry up to keep the heap order
+    size_t index = report->count++;
+    report->entries[index] = entry;
+    while (top > 0 && index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (!sortEntryBefore(&report->entries[parent], &report->entries[index])) {
+            break;
+        }
+        SortEntry tmp = report->entries[index];
+        report->entries[index] = report->entries[parent];
+        report->entries[parent] = tmp;
+        index = parent;
+    }
+}
+
+/**
+ * Read the sort key of one file into the report
+ */
+void collectSortEntry(const char *path, void *ctx) {
+    SortReport *report = (SortReport *)ctx;
+    SortKey key = report->options->sort_key;
+    FileSummary summary;
+    double value = 0.0;
+    
+    if (loadFileSummary(path, report->filter, 0, &summary, report->options->stats, &report->options->met) != EXIT_SUCCESS) {
+        return;
+    }
+    
+    switch (key) {
+        case SORT_REMAINING:
+            value = (double)summary.fileSize - (double)summary.downloadedBytes;
+            break;
+        case SORT_PROGRESS:
+            if (summary.fileSize > 0) {
+                value = (summary.downloadedBytes * 100.0) / summary.fileSize;
+            }
+            break;
+        case SORT_SIZE:
+            value = summary.fileSize;
+            break;
+        case SORT_LASTSEEN:
+            value = summary.lastSeen;
+            break;
+        case SORT_GAPS:
+            value = summary.numGaps;
+            break;
+        case SORT_NONE:
+            break;
+    }
+    
+    addSortEntry(report, value, path);
+}
+
+/**
+ * Print files ordered by a key (--sort), optionally only the first --top
+ */
+int runSortReport(const char **files, int numFiles, const ProgramOptions *options, const MetFilter *filter) {
+    SortReport report;
+    const char *keyName = NULL;
+    
+    memset(&report, 0, sizeof(report));
+    report.options = options;
+    report.filter = filter;
+    
+    for (int i = 0; sortKeyNames[i].name; i++) {
+        if (sortKeyNames[i].key == options->sort_key) {
+            keyName = sortKeyNames[i].name;
+        }
+    }
+    
+    for (int i = 0; i < numFiles; i++) {
+        forEachPartMet(files[i], collectSortEntry, &report);
+    }
+    
+    qsort(report.entries, report.count, sizeof(SortEntry), compareSortEntries);
+    
+    if (options->json_output) {
+        printf("{\"sort\":\"%s\",\"files\":[", keyName);
+    }
+    
+    for (size_t i = 0; i < report.count; i++) {
+        const char *format = options->sort_key == SORT_PROGRESS ? "%.1f" : "%.0f";
+        
+        if (options->json_output) {
+            char *escapedPath = jsonEscapeString(report.entries[i].path);
+            printf("%s{\"file\":\"%s\",\"%s\":", i > 0 ? "," : "",
+                   escapedPath ? escapedPath : "", keyName);
+            printf(format, report.entries[i].value);
+            printf("}");
+            free(escapedPath);
+        } else {
+            printf(format, report.entries[i].value);
+            printf("\t%s\n", report.entries[i].path);
+        }
+        free(report.entries[i].path);
+    }
+    
+    if (options->json_output) {
+        printf("]}\n");
+    }
+    
+    free(report.entries);
+    
+    return report.count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#define SUMMARY_STATUS_VALUES   10  // Download status values 0-9
+#define SUMMARY_PRIORITY_VALUES 6   // Priority values 0-5
+#define SUMMARY_PROGRESS_BUCKETS 11 // 10% steps, plus complete files
+#define SUMMARY_LOG2_BUCKETS    33  // 0, then one bucket per power of two
+
+/**
+ * Running aggregates of a summary report (--summary)
+ */
+typedef struct {
+    const MetFilter *filter;
+    RunStats *stats;      // Timings and counters for --stats, or NULL
+    const MetContext *met;
+    unsigned long long files;
+    unsigned long long totalBytes;
+    unsigned long long downloadedBytes;
+    unsigned long long remainingBytes;
+    unsigned long long totalGaps;
+    unsigned long long totalGapBytes;
+    // Last element counts missing tags and unknown values
+    unsigned long long status[SUMMARY_STATUS_VALUES + 1];
+    unsigned long long priority[SUMMARY_PRIORITY_VALUES + 1];
+    unsigned long long ulPriority[SUMMARY_PRIORITY_VALUES + 1];
+    unsigned long long progress[SUMMARY_PROGRESS_BUCKETS];
+    unsigned long long gapCounts[SUMMARY_LOG2_BUCKETS];
+    unsigned long long gapSizes[SUMMARY_LOG2_BUCKETS];
+} SummaryReport;
+
+/**
+ * Return the power-of-two bucket of a value: 0 for 0, n+1 for [2^n, 2^(n+1))
+ */
+int log2Bucket(unsigned int value) {
+    int bucket = 0;
+    while (value != 0) {
+        bucket++;
+        value >>= 1;
+    }
+    return bucket;
+}
+
+/**
+ * Fold one file into the summary aggregates
+ */
+void collectSummary(const char *path, void *ctx) {
+    SummaryReport *report = (SummaryReport *)ctx;
+    FileSummary summary;
+    
+    if (loadFileSummary(path, report->filter, SUMMARY_KEEP_GAPS, &summary, report->stats, report->met) != EXIT_SUCCESS) {
+        return;
+    }
+    
+    report->files++;
+    report->totalBytes += summary.fileSize;
+    report->downloadedBytes += summary.downloadedBytes;
+    if (summary.fileSize > summary.downloadedBytes) {
+        report->remainingBytes += summary.fileSize - summary.downloadedBytes;
+    }
+    
+    // Missing tags and unnamed values go to the last counter
+    int status = summary.status;
+    if (status < 0 || status >= SUMMARY_STATUS_VALUES || filterValueName(MET_FIELD_STATUS, status) == NULL) {
+        status = SUMMARY_STATUS_VALUES;
+    }
+    report->status[status]++;
+    
+    int priority = summary.priority;
+    if (priority < 0 || priority >= SUMMARY_PRIORITY_VALUES) {
+        priority = SUMMARY_PRIORITY_VALUES;
+    }
+    report->priority[priority]++;
+    
+    int ulPriority = summary.ulPriority;
+    if (ulPriority < 0 || ulPriority >= SUMMARY_PRIORITY_VALUES) {
+        ulPriority = SUMMARY_PRIORITY_VALUES;
+    }
+    report->ulPriority[ulPriority]++;
+    
+    int bucket = 0;
+    if (summary.fileSize > 0) {
+        if (summary.downloadedBytes >= summary.fileSize) {
+            bucket = SUMMARY_PROGRESS_BUCKETS - 1;
+        } else {
+            bucket = (int)((summary.downloadedBytes * 10.0) / summary.fileSize);
+        }
+    }
+    report->progress[bucket]++;
+    
+    report->totalGaps += summary.numGaps;
+    report->gapCounts[log2Bucket(summary.numGaps)]++;
+    for (int i = 0; i < summary.numGaps; i++) {
+        unsigned int size = summary.gaps[i].end - summary.gaps[i].start;
+        report->totalGapBytes += size;
+        report->gapSizes[log2Bucket(size)]++;
+    }
+    
+    free(summary.gaps);
+}
+
+/**
+ * Print the value counts of a status or priority aggregate
+ */
+void printSummaryCounts(const char *title, const unsigned long long *counts, int numValues,
+                        MetFilterField field, int json_output) {
+    int first = 1;
+    
+    if (json_output) {
+        printf(",\"%s\":{", title);
+    } else {
+        printf("\n%s:\n", title);
+    }
+    
+    for (int i = 0; i <= numValues; i++) {
+        const char *name = i < numValues ? filterValueName(field, i) : "other";
+        if (counts[i] == 0 || name == NULL) {
+            continue;
+        }
+        if (json_output) {
+            printf("%s\"%s\":%llu", first ? "" : ",", name, counts[i]);
+        } else {
+            printf("  %-12s %llu\n", name, counts[i]);
+        }
+        first = 0;
+    }
+    
+    if (json_output) {
+        printf("}");
+    }
+}
+
+/**
+ * Print a power-of-two histogram, skipping empty buckets
+ */
+void printSummaryHistogram(const char *title, const unsigned long long *buckets, int json_output) {
+    int first = 1;
+    
+    if (json_output) {
+        printf(",\"%s\":[", title);
+    } else {
+        printf("\n%s:\n", title);
+    }
+    
+    for (int i = 0; i < SUMMARY_LOG2_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        unsigned long long min = i == 0 ? 0 : 1ULL << (i - 1);
+        unsigned long long max = i == 0 ? 0 : (1ULL << i) - 1;
+        if (json_output) {
+            printf("%s{\"min\":%llu,\"max\":%llu,\"count\":%llu}", first ? "" : ",", min, max, buckets[i]);
+        } else if (min == max) {
+            printf("  %llu: %llu\n", min, buckets[i]);
+        } else {
+            printf("  %llu-%llu: %llu\n", min, max, buckets[i]);
+        }
+        first = 0;
+    }
+    
+    if (json_output) {
+        printf("]");
+    }
+}
+
+/**
+ * Print aggregates over all files instead of per-file output (--summary)
+ */
+int runSummaryReport(const char **files, int numFiles, const ProgramOptions *options, const MetFilter *filter) {
+    SummaryReport report;
+    int json_output = options->json_output;
+    
+    memset(&report, 0, sizeof(report));
+    report.filter = filter;
+    report.stats = options->stats;
+    report.met = &options->met;
+    
+    for (int i = 0; i < numFiles; i++) {
+        forEachPartMet(files[i], collectSummary, &report);
+    }
+    
+    if (json_output) {
+        printf("{\"summary\":{\"files\":%llu,\"total_bytes\":%llu,\"downloaded_bytes\":%llu,"
+               "\"remaining_bytes\":%llu,\"gaps\":%llu,\"gap_bytes\":%llu",
+               report.files, report.totalBytes, report.downloadedBytes,
+               report.remainingBytes, report.totalGaps, report.totalGapBytes);
+    } else {
+        printf("=== SUMMARY ===\n");
+        printf("Files: %llu\n", report.files);
+        printf("Total size: %llu bytes (%.2f MB)\n", report.totalBytes, report.totalBytes / 1048576.0);
+        printf("Downloaded: %llu bytes (%.2f MB)\n", report.downloadedBytes, report.downloadedBytes / 1048576.0);
+        printf("Remaining: %llu bytes (%.2f MB)\n", report.remainingBytes, report.remainingBytes / 1048576.0);
+        printf("Gaps: %llu (%.2f MB)\n", report.totalGaps, report.totalGapBytes / 1048576.0);
+    }
+    
+    printSummaryCounts("status", report.status, SUMMARY_STATUS_VALUES, MET_FIELD_STATUS, json_output);
+    printSummaryCounts("priority", report.priority, SUMMARY_PRIORITY_VALUES, MET_FIELD_PRIORITY, json_output);
+    printSummaryCounts("upload_priority", report.ulPriority, SUMMARY_PRIORITY_VALUES, MET_FIELD_ULPRIORITY, json_output);
+    
+    // Progress histogram in 10% steps
+    if (json_output) {
+        printf(",\"progress\":[");
+    } else {
+        printf("\nprogress:\n");
+    }
+    for (int i = 0; i < SUMMARY_PROGRESS_BUCKETS; i++) {
+        if (json_output) {
+            printf("%s%llu", i > 0 ? "," : "", report.progress[i]);
+        } else if (i == SUMMARY_PROGRESS_BUCKETS - 1) {
+            printf("  %-12s %llu\n", "100%", report.progress[i]);
+        } else {
+            char label[16];
+            snprintf(label, sizeof(label), "%d-%d%%", i * 10, i * 10 + 10);
+            printf("  %-12s %llu\n", label, report.progress[i]);
+        }
+    }
+    if (json_output) {
+        printf("]");
+    }
+    
+    printSummaryHistogram("gaps_per_file", report.gapCounts, json_output);
+    printSummaryHistogram("gap_size_bytes", report.gapSizes, json_output);
+    
+    if (json_output) {
+        printf("}}\n");
+    }
+    
+    return report.files > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Read only the ED2K hash from the header of a file
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE if the file is not a .part.met file
+ */
+int readHeaderHash(const char *path, unsigned char *hash, RunStats *stats) {
+    unsigned char header[22];
+    int fd;
+    
+    traceFile(stats, path);
+    PhaseStart start = startPhase(stats);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        warn("Unable to open file %s", path);
+        return EXIT_FAILURE;
+    }
+    endPhase(stats, PHASE_OPEN, start);
+    MET_PROBE2(file__open, path, fd);
+    
+    // Version byte and hash fit in one read for both versions
+    start = startPhase(stats);
+    ssize_t length = read(fd, header, sizeof(header));
+    close(fd);
+    endPhase(stats, PHASE_HEADER, start);
+    if (stats != NULL) {
+        stats->files++;
+        stats->counters.readCalls++;
+        stats->counters.bytesRead += length > 0 ? length : 0;
+    }
+    
+    if (length >= 21 && header[0] == 224) {         // Version 14.0
+        memcpy(hash, header + 5, 16);
+    } else if (length >= 22 && header[0] == 225) {  // Version 14.1
+        memcpy(hash, header + 6, 16);
+    } else {
+        warnx("Unrecognized or invalid file format: %s", path);
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Slot of the duplicate detection hash table
+ */
+typedef struct {
+    unsigned char hash[16];
+    int first;            // First path with this hash, -1 if the slot is free
+    int last;             // Last path with this hash
+    int count;            // Number of paths with this hash
+} HashSlot;
+
+/**
+ * Path in the list of files sharing a hash
+ */
+typedef struct {
+    char *path;
+    int next;             // Next path with the same hash, -1 at the end
+} HashPath;
+
+/**
+ * Open-addressing hash table of ED2K hashes (--dupes)
+ */
+typedef struct {
+    HashSlot *slots;
+    size_t capacity;      // Always a power of two
+    size_t used;
+    HashPath *paths;
+    int numPaths;
+    int pathCapacity;
+    RunStats *stats;      // Timings and counters for --stats, or NULL
+} DupesReport;
+
+/**
+ * Find the slot of a hash, or the free slot where it belongs.
+ * ED2K hashes are uniformly distributed, so their first bytes are used
+ * directly as the table index.
+ */
+HashSlot *findHashSlot(HashSlot *slots, size_t capacity, const unsigned char *hash) {
+    size_t index = ((size_t)hash[0] | (size_t)hash[1] << 8 |
+                    (size_t)hash[2] << 16 | (size_t)hash[3] << 24) & (capacity - 1);
+    
+    // Linear probing
+    while (slots[index].first != -1 && memcmp(slots[index].hash, hash, 16) != 0) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &slots[index];
+}
+
+/**
+ * Resize the hash table to a new power-of-two capacity
+ */
+void growHashTable(DupesReport *report, size_t capacity) {
+    HashSlot *slots = (HashSlot *)malloc(capacity * sizeof(HashSlot));
+    if (slots == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        slots[i].first = -1;
+    }
+    
+    for (size_t i = 0; i < report->capacity; i++) {
+        if (report->slots[i].first != -1) {
+            *findHashSlot(slots, capacity, report->slots[i].hash) = report->slots[i];
+        }
+    }
+    
+    free(report->slots);
+    report->slots = slots;
+    report->capacity = capacity;
+}
+
+/**
+ * Add the header hash of one file to the table
+ */
+void collectHash(const char *path, void *ctx) {
+    DupesReport *report = (DupesReport *)ctx;
+    unsigned char hash[16];
+    
+    if (readHeaderHash(path, hash, report->stats) != EXIT_SUCCESS) {
+        return;
+    }
+    
+    // Keep the load factor at or below one half
+    if ((report->used + 1) * 2 > report->capacity) {
+        growHashTable(report, report->capacity ? report->capacity * 2 : 1024);
+    }
+    
+    if (report->numPaths == report->pathCapacity) {
+        report->pathCapacity = report->pathCapacity ? report->pathCapacity * 2 : 1024;
+        report->paths = (HashPath *)realloc(report->paths, report->pathCapacity * sizeof(HashPath));
+        if (report->paths == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+    }
+    
+    int index = report->numPaths++;
+    report->paths[index].path = strdup(path);
+    report->paths[index].next = -1;
+    if (report->paths[index].path == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    
+    HashSlot *slot = findHashSlot(report->slots, report->capacity, hash);
+    if (slot->first == -1) {
+        memcpy(slot->hash, hash, 16);
+        slot->first = index;
+        slot->count = 0;
+        report->used++;
+    } else {
+        report->paths[slot->last].next = index;
+    }
+    slot->last = index;
+    slot->count++;
+}
+
+/**
+ * File of a duplicate group, with its progress
+ */
+typedef struct {
+    const char *path;
+    FileSummary summary;
+    int loaded;
+} DupeFile;
+
+/**
+ * qsort comparison function ordering hash slots by hash
+ */
+int compareHashSlots(const void *a, const void *b) {
+    return memcmp(((const HashSlot *)a)->hash, ((const HashSlot *)b)->hash, 16);
+}
+
+/**
+ * qsort comparison function putting the most complete copy first
+ */
+int compareDupeFiles(const void *a, const void *b) {
+    const DupeFile *fa = (const DupeFile *)a;
+    const DupeFile *fb = (const DupeFile *)b;
+    
+    if (fa->loaded != fb->loaded) {
+        return fb->loaded - fa->loaded;
+    }
+    if (fa->summary.downloadedBytes != fb->summary.downloadedBytes) {
+        return fa->summary.downloadedBytes > fb->summary.downloadedBytes ? -1 : 1;
+    }
+    return strcmp(fa->path, fb->path);
+}
+
+/**
+ * Report ED2K hashes present in more than one file (--dupes). Only the
+ * header hash of every file is read; duplicates are then fully parsed to
+ * show their progress, most complete copy first.
+ */
+int runDupesReport(const char **files, int numFiles, const ProgramOptions *options) {
+    DupesReport report;
+    size_t numDupes = 0;
+    
+    memset(&report, 0, sizeof(report));
+    report.stats = options->stats;
+    
+    for (int i = 0; i < numFiles; i++) {
+        forEachPartMet(files[i], collectHash, &report);
+    }
+    
+    // Move the duplicated hashes to the front of the table, in hash order
+    for (size_t i = 0; i < report.capacity; i++) {
+        if (report.slots[i].first != -1 && report.slots[i].count > 1) {
+            report.slots[numDupes++] = report.slots[i];
+        }
+    }
+    qsort(report.slots, numDupes, sizeof(HashSlot), compareHashSlots);
+    
+    if (options->json_output) {
+        printf("{\"duplicates\":[");
+    }
+    
+    for (size_t i = 0; i < numDupes; i++) {
+        HashSlot *slot = &report.slots[i];
+        char hexHash[33];
+        
+        formatHash(slot->hash, hexHash);
+        
+        DupeFile *dupes = (DupeFile *)calloc(slot->count, sizeof(DupeFile));
+        if (dupes == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        
+        int count = 0;
+        for (int p = slot->first; p != -1; p = report.paths[p].next) {
+            dupes[count].path = report.paths[p].path;
+            dupes[count].loaded = loadFileSummary(dupes[count].path, NULL, 0, &dupes[count].summary, options->stats,
+                                             &options->met) == EXIT_SUCCESS;
+            count++;
+        }
+        qsort(dupes, count, sizeof(DupeFile), compareDupeFiles);
+        
+        if (options->json_output) {
+            printf("%s{\"ed2k_hash\":\"%s\",\"files\":[", i > 0 ? "," : "", hexHash);
+        } else {
+            printf("%s: %d copies\n", hexHash, count);
+        }
+        
+        for (int j = 0; j < count; j++) {
+            const FileSummary *summary = &dupes[j].summary;
+            double percentage = 0.0;
+            if (summary->fileSize > 0) {
+                percentage = (summary->downloadedBytes * 100.0) / summary->fileSize;
+            }
+            
+            if (options->json_output) {
+                char *escapedPath = jsonEscapeString(dupes[j].path);
+                printf("%s{\"file\":\"%s\"", j > 0 ? "," : "", escapedPath ? escapedPath : "");
+                if (dupes[j].loaded) {
+                    printf(",\"total_bytes\":%u,\"downloaded_bytes\":%u,\"percentage\":%.1f}",
+                           summary->fileSize, summary->downloadedBytes, percentage);
+                } else {
+                    printf(",\"percentage\":null}");
+                }
+                free(escapedPath);
+            } else if (dupes[j].loaded) {
+                printf("  %5.1f%%  %s\n", percentage, dupes[j].path);
+            } else {
+                printf("  %6s  %s\n", "?", dupes[j].path);
+            }
+        }
+        
+        if (options->json_output) {
+            printf("]}");
+        }
+        free(dupes);
+    }
+    
+    if (options->json_output) {
+        printf("]}\n");
+    }
+    
+    for (int i = 0; i < report.numPaths; i++) {
+        free(report.paths[i].path);
+    }
+    free(report.paths);
+    free(report.slots);
+    
+    return numDupes > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Open a temporary file next to path, to be moved over it with
+ * commitTempFile. Returns NULL with errno set on failure.
+ */
+FILE *createTempFile(const char *path, char **tempPath) {
+    size_t size = strlen(path) + 32;
+    
+    if ((*tempPath = (char *)malloc(size)) == NULL) {
+        return NULL;
+    }
+    snprintf(*tempPath, size, "%s.%ld.tmp", path, (long)getpid());
+    
+    FILE *out = fopen(*tempPath, "w");
+    if (out == NULL) {
+        free(*tempPath);
+        *tempPath = NULL;
+    }
+    return out;
+}
+
+/**
+ * Sync the directory holding path, so a rename in it survives a crash.
+ * Returns 0, or -1 with errno set.
+ */
+int syncDirectory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    
+    if (slash == NULL) {
+        dir = strdup(".");
+    } else {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        if ((dir = (char *)malloc(len + 1)) != NULL) {
+            memcpy(dir, path, len);
+            dir[len] = '\0';
+        }
+    }
+    if (dir == NULL) {
+        return -1;
+    }
+    
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd == -1) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
+
+/**
+ * Check that path is still the file described by st: same inode, size
+ * and modification time
+ */
+int isSameFile(const char *path, const struct stat *st) {
+    struct stat now;
+    
+    return stat(path, &now) == 0 && now.st_dev == st->st_dev && now.st_ino == st->st_ino &&
+           now.st_size == st->st_size && now.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+           now.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Flush and sync a file from createTempFile, rename it over path and sync
+ * the directory, so readers see either the old or the new contents even
+ * after a crash. If expected is not NULL, path is only replaced while it
+ * is still that file; otherwise errno is ECANCELED. The temporary file is
+ * removed on failure. Returns 0, or -1 with errno set.
+ */
+int commitTempFile(FILE *out, char *tempPath, const char *path, const struct stat *expected) {
+    int rc = 0;
+    
+    if (fflush(out) != 0 || fsync(fileno(out)) == -1) {
+        rc = -1;
+    }
+    if (fclose(out) != 0) {
+        rc = -1;
+    }
+    // Checked after the slow sync, as close to the rename as possible
+    if (rc == 0 && expected != NULL && !isSameFile(path, expected)) {
+        errno = ECANCELED;
+        rc = -1;
+    }
+    if (rc == 0 && rename(tempPath, path) == -1) {
+        rc = -1;
+    }
+    if (rc == -1) {
+        int saved = errno;
+        unlink(tempPath);
+        errno = saved;
+    } else {
+        rc = syncDirectory(path);
+    }
+    free(tempPath);
+    return rc;
+}
+
+/**
+ * Close and remove a file from createTempFile, leaving path as it was
+ */
+void abortTempFile(FILE *out, char *tempPath) {
+    int saved = errno;
+    
+    fclose(out);
+    unlink(tempPath);
+    free(tempPath);
+    errno = saved;
+}
+
+/**
+ * Values exported for one download (--prometheus-textfile). The size and
+ * modification time of the .part.met decide whether the values of the
+ * previous export can be reused without parsing it again.
+ */
+typedef struct {
+    char *path;
+    long long size;               // Size of the .part.met file
+    long long mtimeSec;           // Modification time of the .part.met file
+    long mtimeNsec;
+    int matched;                  // 0 if rejected by --where
+    char hash[33];
+    char *name;                   // Filename (special tag 1), never NULL
+    unsigned int fileSize;
+    unsigned int downloadedBytes;
+    unsigned int lastSeen;        // 0 if never seen complete
+    int status;                   // -1 if missing
+    int numGaps;
+} ExportEntry;
+
+/**
+ * State of a Prometheus textfile export
+ */
+typedef struct {
+    const MetFilter *filter;
+    RunStats *stats;              // Timings and counters for --stats, or NULL
+    const MetContext *met;
+    ExportEntry *previous;        // Entries of the last export, sorted by path
+    size_t numPrevious;
+    ExportEntry *entries;         // Entries of this export
+    size_t numEntries;
+    size_t capacity;
+    unsigned long long reused;    // Entries taken from the last export
+    unsigned long long failed;    // Files that could not be read
+} ExportReport;
+
+/**
+ * Order export entries by path
+ */
+int compareExportEntries(const void *a, const void *b) {
+    return strcmp(((const ExportEntry *)a)->path, ((const ExportEntry *)b)->path);
+}
+
+/**
+ * Free the strings of export entries and the array itself
+ */
+void freeExportEntries(ExportEntry *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].path);
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/**
+ * Write a field of the export cache, escaping tabs, newlines and
+ * backslashes
+ */
+void writeCacheField(FILE *out, const char *str) {
+    for (; *str; str++) {
+        switch (*str) {
+            case '\\': fputs("\\\\", out); break;
+            case '\t': fputs("\\t", out); break;
+            case '\n': fputs("\\n", out); break;
+            default:   fputc(*str, out); break;
+        }
+    }
+}
+
+/**
+ * Split the next tab-separated field off a cache line and unescape it in
+ * place. Returns NULL when the line has no more fields.
+ */
+char *nextCacheField(char **cursor) {
+    char *in = *cursor;
+    char *out = *cursor;
+    char *field = *cursor;
+    
+    if (in == NULL) {
+        return NULL;
+    }
+    while (*in != '\0' && *in != '\t' && *in != '\n') {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            *out++ = *in == 't' ? '\t' : *in == 'n' ? '\n' : *in;
+            in++;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *cursor = *in == '\t' ? in + 1 : NULL;
+    *out = '\0';
+    return field;
+}
+
+/**
+ * Parse a whole cache field as an integer. Returns 0, or -1 if invalid.
+ */
+int parseCacheNumber(const char *field, long long *value) {
+    char *end;
+    
+    if (field == NULL || *field == '\0') {
+        return -1;
+    }
+    errno = 0;
+    *value = strtoll(field, &end, 10);
+    return *end == '\0' && errno == 0 ? 0 : -1;
+}
+
+/**
+ * Decode one line of the export cache. Returns 0, or -1 if it is damaged.
+ */
+int parseCacheLine(char *line, ExportEntry *entry) {
+    char *cursor = line;
+    char *path = nextCacheField(&cursor);
+    long long numbers[10];
+    char *hash = NULL;
+    
+    for (int i = 0; i < 10; i++) {
+        char *field = nextCacheField(&cursor);
+        if (i == 4) {
+            hash = field;
+            numbers[i] = 0;
+        } else if (parseCacheNumber(field, &numbers[i]) == -1) {
+            return -1;
+        }
+    }
+    char *name = nextCacheField(&cursor);
+    if (path == NULL || name == NULL || cursor != NULL || hash == NULL || strlen(hash) != 32) {
+        return -1;
+    }
+    
+    memset(entry, 0, sizeof(ExportEntry));
+    entry->size = numbers[0];
+    entry->mtimeSec = numbers[1];
+    entry->mtimeNsec = (long)numbers[2];
+    entry->matched = numbers[3] != 0;
+    memcpy(entry->hash, hash, 33);
+    entry->fileSize = (unsigned int)numbers[5];
+    entry->downloadedBytes = (unsigned int)numbers[6];
+    entry->lastSeen = (unsigned int)numbers[7];
+    entry->status = (int)numbers[8];
+    entry->numGaps = (int)numbers[9];
+    if ((entry->path = strdup(path)) == NULL || (entry->name = strdup(name)) == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    return 0;
+}
+
+#define EXPORT_CACHE_MAGIC "metinfo-export-cache 1"
+
+/**
+ * Load the entries of the previous export. The cache is ignored if it is
+ * missing, damaged or was written with a different --where expression.
+ */
+void loadExportCache(const char *path, const char *where, ExportReport *report) {
+    FILE *in = fopen(path, "r");
+    char *line = NULL;
+    size_t lineSize = 0;
+    size_t capacity = 0;
+    int damaged = 0;
+    
+    if (in == NULL) {
+        return;
+    }
+    
+    // The first line holds the format and the --where expression
+    if (getline(&line, &lineSize, in) == -1) {
+        damaged = 1;
+    } else {
+        char *cursor = line;
+        char *magic = nextCacheField(&cursor);
+        char *expr = nextCacheField(&cursor);
+        if (strcmp(magic, EXPORT_CACHE_MAGIC) != 0 || expr == NULL) {
+            damaged = 1;
+        } else if (strcmp(expr, where != NULL ? where : "") != 0) {
+            fclose(in);
+            free(line);
+            return;
+        }
+    }
+    
+    while (!damaged && getline(&line, &lineSize, in) != -1) {
+        if (report->numPrevious == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            ExportEntry *entries = (ExportEntry *)realloc(report->previous, capacity * sizeof(ExportEntry));
+            if (entries == NULL) {
+                err(EXIT_FAILURE, "Memory allocation error");
+            }
+            report->previous = entries;
+        }
+        if (parseCacheLine(line, &report->previous[report->numPrevious]) == -1) {
+            damaged = 1;
+        } else {
+            report->numPrevious++;
+        }
+    }
+    fclose(in);
+    free(line);
+    
+    if (damaged) {
+        warnx("%s: damaged export cache, every file is read again", path);
+        freeExportEntries(report->previous, report->numPrevious);
+        report->previous = NULL;
+        report->numPrevious = 0;
+        return;
+    }
+    qsort(report->previous, report->numPrevious, sizeof(ExportEntry), compareExportEntries);
+}
+
+/**
+ * Save the entries of this export for the next one. Returns 0, or -1
+ * with errno set.
+ */
+int writeExportCache(const char *path, const char *where, const ExportReport *report) {
+    char *tempPath;
+    FILE *out = createTempFile(path, &tempPath);
+    
+    if (out == NULL) {
+        return -1;
+    }
+    
+    fprintf(out, "%s\t", EXPORT_CACHE_MAGIC);
+    writeCacheField(out, where != NULL ? where : "");
+    fprintf(out, "\n");
+    for (size_t i = 0; i < report->numEntries; i++) {
+        const ExportEntry *entry = &report->entries[i];
+        writeCacheField(out, entry->path);
+        fprintf(out, "\t%lld\t%lld\t%ld\t%d\t%s\t%u\t%u\t%u\t%d\t%d\t",
+                entry->size, entry->mtimeSec, entry->mtimeNsec, entry->matched, entry->hash,
+                entry->fileSize, entry->downloadedBytes, entry->lastSeen, entry->status, entry->numGaps);
+        writeCacheField(out, entry->name);
+        fprintf(out, "\n");
+    }
+    
+    return commitTempFile(out, tempPath, path, NULL);
+}
+
+/**
+ * Add the values of one file to the export, reusing those of the last
+ * export when the file has not changed since
+ */
+void collectExportEntry(const char *path, void *ctx) {
+    ExportReport *report = (ExportReport *)ctx;
+    struct stat st;
+    
+    if (stat(path, &st) == -1) {
+        warn("Unable to open file %s", path);
+        report->failed++;
+        return;
+    }
+    
+    if (report->numEntries == report->capacity) {
+        size_t capacity = report->capacity ? report->capacity * 2 : 256;
+        ExportEntry *entries = (ExportEntry *)realloc(report->entries, capacity * sizeof(ExportEntry));
+        if (entries == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        report->entries = entries;
+        report->capacity = capacity;
+    }
+    ExportEntry *entry = &report->entries[report->numEntries];
+    
+    // Unchanged files keep their values, the strings move to the new entry
+    ExportEntry key;
+    key.path = (char *)path;
+    ExportEntry *old = (ExportEntry *)bsearch(&key, report->previous, report->numPrevious,
+                                              sizeof(ExportEntry), compareExportEntries);
+    if (old != NULL && old->name != NULL && old->size == (long long)st.st_size &&
+        old->mtimeSec == (long long)st.st_mtim.tv_sec && old->mtimeNsec == st.st_mtim.tv_nsec) {
+        *entry = *old;
+        old->name = NULL;
+        if ((entry->path = strdup(path)) == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        report->numEntries++;
+        report->reused++;
+        return;
+    }
+    
+    FileSummary summary;
+    if (loadFileSummary(path, report->filter, SUMMARY_KEEP_NAME, &summary, report->stats, report->met) != EXIT_SUCCESS &&
+        summary.matched == MET_FILTER_TRUE) {
+        report->failed++;
+        return;
+    }
+    
+    memset(entry, 0, sizeof(ExportEntry));
+    entry->path = strdup(path);
+    entry->name = strdup(summary.name != NULL ? summary.name : "");
+    if (entry->path == NULL || entry->name == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    entry->size = st.st_size;
+    entry->mtimeSec = st.st_mtim.tv_sec;
+    entry->mtimeNsec = st.st_mtim.tv_nsec;
+    entry->matched = summary.matched == MET_FILTER_TRUE;
+    memcpy(entry->hash, summary.header.hash, 33);
+    entry->fileSize = summary.fileSize;
+    entry->downloadedBytes = summary.downloadedBytes;
+    entry->lastSeen = summary.lastSeen;
+    entry->status = summary.status;
+    entry->numGaps = summary.numGaps;
+    free(summary.name);
+    report->numEntries++;
+}
+
+/**
+ * Write a label value with the escapes of the Prometheus text format
+ */
+void printLabelValue(FILE *out, const char *str) {
+    for (; *str; str++) {
+        switch (*str) {
+            case '\\': fputs("\\\\", out); break;
+            case '"':  fputs("\\\"", out); break;
+            case '\n': fputs("\\n", out); break;
+            default:   fputc(*str, out); break;
+        }
+    }
+}
+
+/**
+ * Gauges exported for each download
+ */
+typedef enum {
+    METRIC_SIZE,
+    METRIC_DOWNLOADED,
+    METRIC_PROGRESS,
+    METRIC_GAPS,
+    METRIC_STATUS,
+    METRIC_LASTSEEN,
+    METRIC_COUNT
+} ExportMetric;
+
+static const struct {
+    const char *name;
+    const char *help;
+} exportMetrics[METRIC_COUNT] = {
+    { "metinfo_download_size_bytes", "File size of the download" },
+    { "metinfo_download_downloaded_bytes", "Bytes downloaded so far" },
+    { "metinfo_download_progress_ratio", "Downloaded bytes over file size" },
+    { "metinfo_download_gaps", "Number of gaps still to download" },
+    { "metinfo_download_status", "Download status code (special tag 20), 7 = paused, 9 = completed" },
+    { "metinfo_download_last_seen_complete_timestamp_seconds", "When a complete source was last seen" }
+};
+
+/**
+ * Value of a gauge for a download. Returns 0 if the download has none.
+ */
+int exportValue(const ExportEntry *entry, ExportMetric metric, double *value) {
+    switch (metric) {
+        case METRIC_SIZE:       *value = entry->fileSize; return 1;
+        case METRIC_DOWNLOADED: *value = entry->downloadedBytes; return 1;
+        case METRIC_PROGRESS:
+            *value = entry->fileSize > 0 ? (double)entry->downloadedBytes / entry->fileSize : 0.0;
+            return 1;
+        case METRIC_GAPS:       *value = entry->numGaps; return 1;
+        case METRIC_STATUS:     *value = entry->status; return entry->status >= 0;
+        case METRIC_LASTSEEN:   *value = entry->lastSeen; return entry->lastSeen > 0;
+        default:                return 0;
+    }
+}
+
+/**
+ * Write one fleet-level gauge
+ */
+void printExportTotal(FILE *out, const char *name, const char *help, double value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", name, help, name, name, value);
+}
+
+/**
+ * Write the gauges of all downloads in the Prometheus text format, each
+ * metric family in one group as the format requires
+ */
+void printExport(FILE *out, const ExportReport *report, double seconds) {
+    unsigned long long downloads = 0;
+    unsigned long long totalBytes = 0;
+    unsigned long long downloadedBytes = 0;
+    unsigned long long gaps = 0;
+    
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        fprintf(out, "# HELP %s %s\n", exportMetrics[metric].name, exportMetrics[metric].help);
+        fprintf(out, "# TYPE %s gauge\n", exportMetrics[metric].name);
+        for (size_t i = 0; i < report->numEntries; i++) {
+            const ExportEntry *entry = &report->entries[i];
+            double value;
+            if (!entry->matched || !exportValue(entry, (ExportMetric)metric, &value)) {
+                continue;
+            }
+            fprintf(out, "%s{ed2k_hash=\"%s\",filename=\"", exportMetrics[metric].name, entry->hash);
+            printLabelValue(out, entry->name);
+            fprintf(out, "\",path=\"");
+            printLabelValue(out, entry->path);
+            fprintf(out, "\"} %.17g\n", value);
+        }
+    }
+    
+    for (size_t i = 0; i < report->numEntries; i++) {
+        const ExportEntry *entry = &report->entries[i];
+        if (entry->matched) {
+            downloads++;
+            totalBytes += entry->fileSize;
+            downloadedBytes += entry->downloadedBytes;
+            gaps += entry->numGaps;
+        }
+    }
+    printExportTotal(out, "metinfo_downloads", "Number of exported downloads", downloads);
+    printExportTotal(out, "metinfo_downloads_size_bytes", "Total size of the exported downloads", totalBytes);
+    printExportTotal(out, "metinfo_downloads_downloaded_bytes", "Total bytes downloaded", downloadedBytes);
+    printExportTotal(out, "metinfo_downloads_gaps", "Total number of gaps", gaps);
+    printExportTotal(out, "metinfo_export_failed_files", "Files that could not be read", report->failed);
+    printExportTotal(out, "metinfo_export_reused_files", "Files unchanged since the last export, not read again", report->reused);
+    printExportTotal(out, "metinfo_export_duration_seconds", "Time spent reading the files", seconds);
+    printExportTotal(out, "metinfo_export_timestamp_seconds", "When the export was written", (double)time(NULL));
+}
+
+/**
+ * Write per-download and fleet gauges for the node_exporter textfile
+ * collector (--prometheus-textfile PATH). Values of files whose size and
+ * modification time did not change are taken from PATH.cache, written by
+ * the previous export, so only new and changed files are parsed.
+ */
+int runPrometheusExport(const char **files, int numFiles, const ProgramOptions *options, const MetFilter *filter) {
+    const char *path = options->prometheus;
+    ExportReport report;
+    struct timespec start, end;
+    size_t size = strlen(path) + sizeof(".cache");
+    char *cachePath = (char *)malloc(size);
+    int status = EXIT_SUCCESS;
+    
+    if (cachePath == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    snprintf(cachePath, size, "%s.cache", path);
+    
+    memset(&report, 0, sizeof(report));
+    report.filter = filter;
+    report.stats = options->stats;
+    report.met = &options->met;
+    loadExportCache(cachePath, options->where, &report);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < numFiles; i++) {
+        forEachPartMet(files[i], collectExportEntry, &report);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    qsort(report.entries, report.numEntries, sizeof(ExportEntry), compareExportEntries);
+    
+    char *tempPath;
+    FILE *out = createTempFile(path, &tempPath);
+    if (out == NULL) {
+        warn("Unable to write %s", path);
+        status = EXIT_FAILURE;
+    } else {
+        printExport(out, &report, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        if (commitTempFile(out, tempPath, path, NULL) == -1) {
+            warn("Unable to write %s", path);
+            status = EXIT_FAILURE;
+        } else if (writeExportCache(cachePath, options->where, &report) == -1) {
+            warn("Unable to write %s", cachePath);
+        }
+    }
+    
+    freeExportEntries(report.previous, report.numPrevious);
+    freeExportEntries(report.entries, report.numEntries);
+    free(cachePath);
+    return status;
+}
+
+#define SET_MAX_EDITS   3   // One per settable tag
+
+/**
+ * Special integer tags that --set changes in place, named as in --where
+ */
+static const struct {
+    const char *key;
+    MetFilterField field;
+    int specialId;
+} settableTags[] = {
+    { "status", MET_FIELD_STATUS,     20 },
+    { "prio",   MET_FIELD_PRIORITY,   24 },
+    { "ulprio", MET_FIELD_ULPRIORITY, 25 },
+    { NULL,     MET_FIELD_COUNT,      0 }
+};
+
+/**
+ * New values of a --set list, at most one per settable tag
+ */
+typedef struct {
+    int tags[SET_MAX_EDITS];              // Index into settableTags
+    unsigned int values[SET_MAX_EDITS];
+    int numEdits;
+} TagEdits;
+
+/**
+ * Parse a --set list of KEY=VALUE pairs. Values are the names used by
+ * --where or plain numbers. Returns 0, or -1 if the list is invalid.
+ */
+int parseTagEdits(const char *list, TagEdits *edits) {
+    const char *p = list;
+    
+    memset(edits, 0, sizeof(TagEdits));
+    while (*p != '\0') {
+        size_t length = strcspn(p, "=");
+        int i;
+        
+        for (i = 0; settableTags[i].key; i++) {
+            if (strlen(settableTags[i].key) == length && strncasecmp(p, settableTags[i].key, length) == 0) {
+                break;
+            }
+        }
+        if (settableTags[i].key == NULL || p[length] != '=') {
+            return -1;
+        }
+        
+        char word[32];
+        p += length + 1;
+        length = strcspn(p, ",");
+        if (length == 0 || length >= sizeof(word)) {
+            return -1;
+        }
+        memcpy(word, p, length);
+        word[length] = '\0';
+        
+        // A repeated key replaces the earlier value
+        int named = filterValueNumber(settableTags[i].field, word);
+        unsigned long value = (unsigned long)named;
+        if (named == -1) {
+            char *end;
+            value = strtoul(word, &end, 10);
+            if (!isdigit((unsigned char)word[0]) || *end != '\0' || value > 0xFFFFFFFFul) {
+                return -1;
+            }
+        }
+        int edit;
+        for (edit = 0; edit < edits->numEdits && edits->tags[edit] != i; edit++) {
+        }
+        edits->tags[edit] = i;
+        edits->values[edit] = (unsigned int)value;
+        if (edit == edits->numEdits) {
+            edits->numEdits++;
+        }
+        
+        p += length;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    
+    return edits->numEdits > 0 ? 0 : -1;
+}
+
+/**
+ * Outcome of --set for one file
+ */
+typedef enum {
+    SET_CHANGED,          // At least one value was written
+    SET_UNCHANGED,        // Every value was already set
+    SET_SKIPPED,          // Rejected by --where
+    SET_FAILED,           // Unreadable, damaged, a tag missing or a write failed
+    SET_RESULTS
+} SetResult;
+
+/**
+ * Value offsets of the edited tags, found while the tags are decoded
+ */
+typedef struct {
+    const TagEdits *edits;
+    off_t offsets[SET_MAX_EDITS];         // -1 while the tag has not been seen
+    unsigned int values[SET_MAX_EDITS];   // Current values
+} SetVisit;
+
+/**
+ * Visitor callback recording where the value of each edited tag is. When
+ * a tag appears twice the last one is kept, as clients read it that way.
+ */
+int visitSetTag(void *context, const MetaTag *tag, off_t offset) {
+    SetVisit *visit = (SetVisit *)context;
+    
+    if (tag->type != 3 || tag->tagClass != 1) {
+        return MET_OK;
+    }
+    for (int i = 0; i < visit->edits->numEdits; i++) {
+        if (tag->specialId == settableTags[visit->edits->tags[i]].specialId) {
+            // Type, name length and name come before the value
+            visit->offsets[i] = offset + 3 + tag->nameLength;
+            visit->values[i] = tag->value.intValue;
+        }
+    }
+    return MET_OK;
+}
+
+/**
+ * Change the values of the edited tags of one file in place. The whole
+ * file is decoded first, and nothing is written unless every edited tag
+ * was found. oldValues receives the values found.
+ */
+SetResult setFileTags(const char *path, const TagEdits *edits, const MetFilter *filter, unsigned int *oldValues,
+                      RunStats *stats, const MetContext *met) {
+    MetVisitor visitor = { NULL, visitSetTag, NULL };
+    MetHeader header;
+    SetVisit visit;
+    int matched = MET_FILTER_TRUE;
+    int fd;
+    int rc;
+    
+    traceFile(stats, path);
+    PhaseStart start = startPhase(stats);
+    if ((fd = open(path, O_RDWR)) == -1) {
+        warn("Unable to open file %s", path);
+        return SET_FAILED;
+    }
+    endPhase(stats, PHASE_OPEN, start);
+    MET_PROBE2(file__open, path, fd);
+    if (stats != NULL) {
+        stats->files++;
+    }
+    
+    memset(&visit, 0, sizeof(visit));
+    visit.edits = edits;
+    for (int i = 0; i < edits->numEdits; i++) {
+        visit.offsets[i] = -1;
+    }
+    
+    start = startPhase(stats);
+    rc = readMetHeader(fd, &header, met);
+    endPhase(stats, PHASE_HEADER, start);
+    if (rc == MET_OK) {
+        start = startPhase(stats);
+        rc = visitMatchingTags(fd, &header, filter, &visitor, &visit, &matched, met);
+        endPhase(stats, PHASE_TAGS, start);
+    }
+    if (rc != MET_OK) {
+        reportMetError(path, rc);
+        close(fd);
+        return SET_FAILED;
+    }
+    if (matched != MET_FILTER_TRUE) {
+        close(fd);
+        return SET_SKIPPED;
+    }
+    
+    for (int i = 0; i < edits->numEdits; i++) {
+        if (visit.offsets[i] == -1) {
+            warnx("%s: no %s tag, not changed", path, settableTags[edits->tags[i]].key);
+            close(fd);
+            return SET_FAILED;
+        }
+        oldValues[i] = visit.values[i];
+    }
+    
+    // Each value is a little-endian uint32 of its own, so a write
+    // never changes the size or layout of the file
+    SetResult result = SET_UNCHANGED;
+    for (int i = 0; i < edits->numEdits; i++) {
+        unsigned int value = edits->values[i];
+        unsigned char bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+        if (visit.values[i] == value) {
+            continue;
+        }
+        if (pwrite(fd, bytes, sizeof(bytes), visit.offsets[i]) != (ssize_t)sizeof(bytes)) {
+            warn("Unable to write %s", path);
+            close(fd);
+            return SET_FAILED;
+        }
+        result = SET_CHANGED;
+    }
+    
+    if (close(fd) == -1) {
+        warn("Unable to write %s", path);
+        return SET_FAILED;
+    }
+    return result;
+}
+
+/**
+ * Files of a --set run, shared by the worker threads
+ */
+typedef struct {
+    const TagEdits *edits;
+    const MetFilter *filter;
+    int verbose;
+    char **paths;
+    size_t numPaths;
+    size_t capacity;
+    size_t next;                          // Next file to patch
+    unsigned long long counts[SET_RESULTS];
+    pthread_mutex_t lock;                 // Guards next, counts and stdout
+} SetRun;
+
+/**
+ * Queue one file of a --set run
+ */
+void collectSetPath(const char *path, void *ctx) {
+    SetRun *run = (SetRun *)ctx;
+    
+    if (run->numPaths == run->capacity) {
+        size_t capacity = run->capacity ? run->capacity * 2 : 256;
+        char **paths = (char **)realloc(run->paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            err(EXIT_FAILURE, "Memory allocation error");
+        }
+        run->paths = paths;
+        run->capacity = capacity;
+    }
+    if ((run->paths[run->numPaths] = strdup(path)) == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    run->numPaths++;
+}
+
+/**
+ * Print the old and new values of a changed file (-v)
+ */
+void printSetChange(const char *path, const TagEdits *edits, const unsigned int *oldValues) {
+    printf("%s:", path);
+    for (int i = 0; i < edits->numEdits; i++) {
+        MetFilterField field = settableTags[edits->tags[i]].field;
+        const char *before = filterValueName(field, (int)oldValues[i]);
+        const char *after = filterValueName(field, (int)edits->values[i]);
+        
+        printf("%s %s ", i > 0 ? "," : "", settableTags[edits->tags[i]].key);
+        if (before != NULL) {
+            printf("%s -> ", before);
+        } else {
+            printf("%u -> ", oldValues[i]);
+        }
+        if (after != NULL) {
+            printf("%s", after);
+        } else {
+            printf("%u", edits->values[i]);
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * One worker of a --set run, with counters and spans of its own for
+ * --stats and --trace
+ */
+typedef struct {
+    SetRun *run;
+    RunStats *stats;                      // Timings and counters for --stats, or NULL
+    RunStats ownStats;                    // What stats points to, but in the main thread
+    Trace trace;                          // Spans of ownStats when tracing
+    MetContext met;
+} SetWorker;
+
+/**
+ * Give a worker its own copy of the --stats counters and --trace spans,
+ * and a library context that records into them
+ */
+void initSetWorker(SetWorker *worker, SetRun *run, const ProgramOptions *options, int thread) {
+    memset(worker, 0, sizeof(*worker));
+    worker->run = run;
+    worker->met = options->met;
+    if (options->stats != NULL) {
+        worker->stats = &worker->ownStats;
+        worker->met.stats = &worker->ownStats.counters;
+        if (options->stats->trace != NULL) {
+            worker->trace.thread = thread;
+            worker->ownStats.trace = &worker->trace;
+            worker->met.tracerContext = &worker->trace;
+        }
+    }
+}
+
+/**
+ * Add the timings and counters of a worker to the run totals
+ */
+void mergeRunStats(RunStats *total, const RunStats *stats) {
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        total->seconds[i] += stats->seconds[i];
+    }
+    total->counters.readCalls += stats->counters.readCalls;
+    total->counters.bytesRead += stats->counters.bytesRead;
+    total->counters.seekCalls += stats->counters.seekCalls;
+    total->counters.allocations += stats->counters.allocations;
+    total->counters.allocatedBytes += stats->counters.allocatedBytes;
+    total->files += stats->files;
+    total->tags += stats->tags;
+}
+
+/**
+ * Worker thread of a --set run: take the next file until none are left
+ */
+void *setWorker(void *ctx) {
+    SetWorker *worker = (SetWorker *)ctx;
+    SetRun *run = worker->run;
+    
+    for (;;) {
+        unsigned int oldValues[SET_MAX_EDITS];
+        
+        pthread_mutex_lock(&run->lock);
+        size_t index = run->next < run->numPaths ? run->next++ : run->numPaths;
+        pthread_mutex_unlock(&run->lock);
+        if (index == run->numPaths) {
+            return NULL;
+        }
+        
+        const char *path = run->paths[index];
+        SetResult result = setFileTags(path, run->edits, run->filter, oldValues, worker->stats, &worker->met);
+        
+        pthread_mutex_lock(&run->lock);
+        run->counts[result]++;
+        if (result == SET_CHANGED && run->verbose) {
+            printSetChange(path, run->edits, oldValues);
+        }
+        pthread_mutex_unlock(&run->lock);
+    }
+}
+
+/**
+ * Change status and priority tags of many files in place (--set), with
+ * --jobs files patched at once. Succeeds if every file that matched --where
+ * was set and at least one did.
+ */
+int runSetTags(const char **files, int numFiles, const TagEdits *edits, const ProgramOptions *options, const MetFilter *filter) {
+    SetRun run;
+    int jobs = options->jobs;
+    
+    memset(&run, 0, sizeof(run));
+    run.edits = edits;
+    run.filter = filter;
+    run.verbose = options->verbose;
+    pthread_mutex_init(&run.lock, NULL);
+    
+    for (int i = 0; i < numFiles; i++) {
+        forEachPartMet(files[i], collectSetPath, &run);
+    }
+    
+    // Performance counters only count the thread that opened them
+    if (options->stats != NULL && options->stats->perf != NULL) {
+        jobs = 1;
+    }
+    if ((size_t)jobs > run.numPaths) {
+        jobs = run.numPaths > 0 ? (int)run.numPaths : 1;
+    }
+    
+    // The main thread is the first worker and counts straight into the
+    // run totals; if a thread cannot be started the others take over
+    // its share
+    pthread_t *threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+    SetWorker *workers = (SetWorker *)calloc(jobs, sizeof(SetWorker));
+    int numThreads = 0;
+    if (threads == NULL || workers == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    initSetWorker(&workers[0], &run, options, 0);
+    workers[0].stats = options->stats;
+    workers[0].met = options->met;
+    while (numThreads < jobs - 1) {
+        SetWorker *worker = &workers[numThreads + 1];
+        initSetWorker(worker, &run, options, numThreads + 1);
+        if (pthread_create(&threads[numThreads], NULL, setWorker, worker) != 0) {
+            break;
+        }
+        numThreads++;
+    }
+    setWorker(&workers[0]);
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+        if (options->stats != NULL) {
+            mergeRunStats(options->stats, &workers[i + 1].ownStats);
+        }
+        if (workers[i + 1].ownStats.trace != NULL) {
+            mergeTrace(options->stats->trace, &workers[i + 1].trace);
+        }
+    }
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&run.lock);
+    
+    if (options->json_output) {
+        printf("{\"set\":{\"files\":%zu,\"changed\":%llu,\"unchanged\":%llu,\"skipped\":%llu,\"failed\":%llu}}\n",
+               run.numPaths, run.counts[SET_CHANGED], run.counts[SET_UNCHANGED],
+               run.counts[SET_SKIPPED], run.counts[SET_FAILED]);
+    } else {
+        printf("Files: %zu, changed: %llu, already set: %llu, skipped: %llu, failed: %llu\n",
+               run.numPaths, run.counts[SET_CHANGED], run.counts[SET_UNCHANGED],
+               run.counts[SET_SKIPPED], run.counts[SET_FAILED]);
+    }
+    
+    for (size_t i = 0; i < run.numPaths; i++) {
+        free(run.paths[i]);
+    }
+    free(run.paths);
+    
+    if (run.counts[SET_FAILED] > 0 || run.counts[SET_CHANGED] + run.counts[SET_UNCHANGED] == 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Totals of a --compact run
+ */
+typedef struct {
+    const ProgramOptions *options;
+    const MetFilter *filter;
+    unsigned long long files;     // Files read, rewritten or not
+    unsigned long long compacted; // Files rewritten
+    unsigned long long failed;
+} CompactReport;
+
+/**
+ * Read size bytes from the start of a file into a new buffer. Returns
+ * NULL with errno set on failure.
+ */
+unsigned char *readWholeFile(int fd, size_t size) {
+    unsigned char *data = (unsigned char *)malloc(size > 0 ? size : 1);
+    size_t done = 0;
+    
+    while (data != NULL && done < size) {
+        ssize_t count = pread(fd, data + done, size - done, (off_t)done);
+        if (count <= 0) {
+            // The file shrank while it was read
+            if (count == 0) {
+                errno = EIO;
+            }
+            free(data);
+            return NULL;
+        }
+        done += (size_t)count;
+    }
+    return data;
+}
+
+/**
+ * Write the compacted copy of a file next to it and move it over the
+ * file, keeping its owner, group and permissions. The owner is set before
+ * the mode because changing it clears the set-user-ID bit; a user who
+ * may not give the file away keeps it with a warning. The file is left
+ * alone if it changed since st was taken. Returns 0, or -1 with errno set.
+ */
+int replaceFile(const char *path, const unsigned char *data, size_t len, const struct stat *st) {
+    char *tempPath;
+    FILE *out = createTempFile(path, &tempPath);
+    
+    if (out == NULL) {
+        return -1;
+    }
+    if (fwrite(data, 1, len, out) != len) {
+        abortTempFile(out, tempPath);
+        return -1;
+    }
+    if (fchown(fileno(out), st->st_uid, st->st_gid) == -1) {
+        if (errno != EPERM) {
+            abortTempFile(out, tempPath);
+            return -1;
+        }
+        warnx("%s: owner and group not kept, the file now belongs to the current user", path);
+    }
+    if (fchmod(fileno(out), st->st_mode & 07777) == -1) {
+        abortTempFile(out, tempPath);
+        return -1;
+    }
+    return commitTempFile(out, tempPath, path, st);
+}
+
+/**
+ * Print the sizes and gap counts of a file before and after --compact
+ */
+void printCompaction(const char *path, const MetCompaction *info, size_t before, size_t after, int rewritten, int json_output) {
+    if (json_output) {
+        char *escapedPath = jsonEscapeString(path);
+        printf("{\"file\":\"%s\",\"compacted\":%s,\"size_before\":%zu,\"size_after\":%zu,"
+               "\"gaps_before\":%u,\"gaps_after\":%u,\"dropped_tags\":%u}\n",
+               escapedPath ? escapedPath : "", rewritten ? "true" : "false",
+               before, after, info->gapsBefore, info->gapsAfter, info->droppedTags);
+        free(escapedPath);
+    } else if (!rewritten) {
+        printf("%s: already compact, %u gaps\n", path, info->gapsBefore);
+    } else {
+        printf("%s: %zu -> %zu bytes, %u -> %u gaps", path, before, after, info->gapsBefore, info->gapsAfter);
+        if (info->droppedTags > 0) {
+            printf(", %u stale or unpaired gap tags dropped", info->droppedTags);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * Merge the gaps of one file and rewrite it if that saves any tags
+ */
+void compactFile(const char *path, void *ctx) {
+    CompactReport *report = (CompactReport *)ctx;
+    RunStats *stats = report->options->stats;
+    const MetContext *met = &report->options->met;
+    MetCompaction info;
+    MetHeader header;
+    struct stat st;
+    int matched = MET_FILTER_TRUE;
+    int fd;
+    int rc;
+    
+    traceFile(stats, path);
+    PhaseStart start = startPhase(stats);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        warn("Unable to open file %s", path);
+        report->failed++;
+        return;
+    }
+    endPhase(stats, PHASE_OPEN, start);
+    MET_PROBE2(file__open, path, fd);
+    if (stats != NULL) {
+        stats->files++;
+    }
+    
+    // --where is decided before the file is read as a whole
+    if (report->filter != NULL) {
+        start = startPhase(stats);
+        rc = readMetHeader(fd, &header, met);
+        if (rc == MET_OK) {
+            rc = visitMatchingTags(fd, &header, report->filter, NULL, NULL, &matched, met);
+        }
+        endPhase(stats, PHASE_FILTER, start);
+        if (rc != MET_OK || matched != MET_FILTER_TRUE) {
+            if (rc != MET_OK) {
+                reportMetError(path, rc);
+                report->failed++;
+            }
+            close(fd);
+            return;
+        }
+    }
+    
+    start = startPhase(stats);
+    unsigned char *data = NULL;
+    if (fstat(fd, &st) == -1 || (data = readWholeFile(fd, (size_t)st.st_size)) == NULL) {
+        warn("Unable to read %s", path);
+        close(fd);
+        report->failed++;
+        return;
+    }
+    close(fd);
+    
+    unsigned char *compacted;
+    size_t before = (size_t)st.st_size;
+    size_t after = before;
+    rc = compactMetBuffer(data, before, &compacted, &after, &info, met);
+    endPhase(stats, PHASE_TAGS, start);
+    free(data);
+    if (rc != MET_OK) {
+        reportMetError(path, rc);
+        report->failed++;
+        return;
+    }
+    
+    int rewritten = compacted != NULL;
+    report->files++;
+    if (!rewritten) {
+        after = before;
+    } else {
+        start = startPhase(stats);
+        rc = replaceFile(path, compacted, after, &st);
+        endPhase(stats, PHASE_FORMAT, start);
+        free(compacted);
+        if (rc == -1 && errno == ECANCELED) {
+            warnx("%s: changed while it was compacted, left as it is", path);
+            report->failed++;
+            return;
+        }
+        if (rc == -1) {
+            warn("Unable to write %s", path);
+            report->failed++;
+            return;
+        }
+        report->compacted++;
+    }
+    printCompaction(path, &info, before, after, rewritten, report->options->json_output);
+}
+
+/**
+ * Merge the gaps of every file and rewrite the ones that shrink
+ * (--compact). Succeeds if no file failed.
+ */
+int runCompact(const char **files, int numFiles, const ProgramOptions *options, const MetFilter *filter) {
+    CompactReport report;
+    
+    memset(&report, 0, sizeof(report));
+    report.options = options;
+    report.filter = filter;
+    
+    for (int i = 0; i < numFiles; i++) {
+        forEachPartMet(files[i], compactFile, &report);
+    }
+    
+    if (options->batch && options->json_output) {
+        printf("{\"compact\":{\"files\":%llu,\"compacted\":%llu,\"failed\":%llu}}\n",
+               report.files, report.compacted, report.failed);
+    } else if (options->batch) {
+        printf("Files: %llu, compacted: %llu, failed: %llu\n", report.files, report.compacted, report.failed);
+    }
+    
+    return report.failed == 0 && report.files > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Print where a salvaged file came from and how much of it was decoded
+ */
+void printSalvageInfo(const char *path, const MetFile *file, int fromBackup, int json_output) {
+    if (json_output) {
+        if (file->partial) {
+            printf("\"partial\":true,\"tags_salvaged\":%u,\"damage\":\"%s\",\"damage_offset\":%lld,",
+                   file->numTags, metErrorString(file->damage), (long long)file->damageOffset);
+        }
+        if (fromBackup) {
+            char *escapedPath = jsonEscapeString(path);
+            printf("\"source\":\"%s.bak\",", escapedPath ? escapedPath : "");
+            free(escapedPath);
+        }
+    } else {
+        if (file->partial) {
+            printf("Salvaged: %u of %u meta tags (%s at offset %lld)\n", file->numTags,
+                   file->header.numTags, metErrorString(file->damage), (long long)file->damageOffset);
+        }
+        if (fromBackup) {
+            printf("Source: %s.bak\n", path);
+        }
+    }
+}
+
+/**
+ * Return the format version of a file for printing
+ */
+const char *versionName(const MetFile *file) {
+    return file->header.versionStr != NULL ? file->header.versionStr : "unknown";
+}
+
+/**
+ * Check whether the output of a file needs more than its header
+ */
+int needsTags(const ProgramOptions *options) {
+    return !(options->show_metversion || options->show_hash || options->show_tagcount);
+}
+
+/**
+ * Check whether the output of a file includes the gap visualization
+ */
+int needsGaps(const ProgramOptions *options) {
+    return options->visualize_gaps && needsTags(options) &&
+           !(options->show_filename || options->show_filesize || options->show_date ||
+             options->show_progress);
+}
+
+/**
+ * Print the requested information about a file. The tags and gaps have
+ * been decoded already, so nothing can fail once output has started.
+ */
+void printFile(const char *path, const ProgramOptions *options, MetFile *file, GapInfo *gaps, int numGaps, int fromBackup) {
+    // Handle -m/--metversion option specially
+    if (options->show_metversion) {
+        // Output only the version number when specifically requested
+        if (options->json_output) {
+            printf("{\"format_version\":\"%s\"}", versionName(file));
+        } else {
+            printf("%s", versionName(file));
+        }
+        return;
+    }
+    
+    // JSON output start
+    if (options->json_output && 
+        !(options->show_hash || options->show_metversion || options->show_tagcount || 
+          options->show_filename || options->show_filesize || options->show_date || 
+          options->show_progress)) {
+        printf("{");
+    }
+    
+    if (options->json_output && 
+        !(options->show_hash || options->show_tagcount || 
+          options->show_filename || options->show_filesize || 
+          options->show_date || options->show_progress)) {
+        printf("\"format_version\":\"%s\",", versionName(file));
+    } else if (!options->json_output && 
+              !(options->show_hash || options->show_tagcount || 
+                options->show_filename || options->show_filesize || 
+                options->show_date || options->show_progress)) {
+        printf(".part.met file version: %s\n", versionName(file));
+    }
+    
+    // Handle -e/--hash option specially
+    if (options->show_hash) {
+        if (options->json_output) {
+            printf("{\"ed2k_hash\":\"%s\"}", file->header.hash);
+        } else {
+            printf("%s", file->header.hash);
+        }
+        
+        return;
+    }
+    
+    // Print hash in normal mode
+    if (options->json_output && 
+        !(options->show_tagcount || options->show_filename || 
+          options->show_filesize || options->show_date || options->show_progress)) {
+        printf("\"ed2k_hash\":\"%s\",", file->header.hash);
+    } else if (!options->json_output && 
+              !(options->show_tagcount || options->show_filename || 
+                options->show_filesize || options->show_date || options->show_progress)) {
+        printf("ED2K Hash: %s\n", file->header.hash);
+    }
+    
+    // Handle -c/--tagcount option specially
+    if (options->show_tagcount) {
+        if (options->json_output) {
+            printf("{\"num_tags\":%u}", file->header.numTags);
+        } else {
+            printf("%u", file->header.numTags);
+        }
+        return;
+    }
+    
+    if (options->json_output && 
+        !(options->show_filename || options->show_filesize || 
+          options->show_date || options->show_progress)) {
+        printf("\"num_tags\":%u,", file->header.numTags);
+        printSalvageInfo(path, file, fromBackup, 1);
+    } else if (!options->json_output && 
+              !(options->show_filename || options->show_filesize || 
+                options->show_date || options->show_progress)) {
+        printf("Number of meta tags: %u\n", file->header.numTags);
+        printSalvageInfo(path, file, fromBackup, 0);
+    }
+    
+    // Output structure for specific fields
+    if (options->show_filename || options->show_filesize || 
+        options->show_date || options->show_progress) {
+        
+        // In JSON mode, we need a separate "fields" object
+        if (options->json_output) {
+            printf("{\"fields\":{");
+        }
+        
+        int fieldsOutput = 0;
+        
+        if (options->show_filename) {
+            displaySpecificField(stdout, file, 1, options->verbose, options->json_output, options->time_format);
+            fieldsOutput++;
+            // We want to exit immediately for script usage mode
+            if (!options->json_output) {
+                return;
+            }
+        }
+        
+        if (options->show_filesize) {
+            // Add comma if needed in JSON mode
+            if (options->json_output && fieldsOutput > 0) {
+                printf(",");
+            }
+            displaySpecificField(stdout, file, 2, options->verbose, options->json_output, options->time_format);
+            fieldsOutput++;
+            // We want to exit immediately for script usage mode
+            if (!options->json_output) {
+                return;
+            }
+        }
+        
+        if (options->show_date) {
+            // Add comma if needed in JSON mode
+            if (options->json_output && fieldsOutput > 0) {
+                printf(",");
+            }
+            displaySpecificField(stdout, file, 5, options->verbose, options->json_output, options->time_format);
+            fieldsOutput++;
+            // We want to exit immediately for script usage mode
+            if (!options->json_output) {
+                return;
+            }
+        }
+        
+        if (options->show_progress) {
+            // Add comma if needed in JSON mode
+            if (options->json_output && fieldsOutput > 0) {
+                printf(",");
+            }
+            
+            if (options->json_output) {
+                printf("\"progress\":");
+            }
+            
+            displayProgress(stdout, file->fileSize, file->downloadedBytes, options->json_output);
+            fieldsOutput++;
+            // We want to exit immediately for script usage mode
+            if (!options->json_output) {
+                return;
+            }
+        }
+        
+        // Close the "fields" object in JSON mode
+        if (options->json_output) {
+            printf("}}");
+            // Exit - we're done with specific fields in JSON mode
+            return;
+        }
+    }
+    
+    // Display tags based on filter options
+    if (options->show_special || options->show_gap || 
+        options->show_standard || options->show_unknown) {
+        
+        // Start the tags array in JSON mode
+        if (options->json_output) {
+            printf("\"tags\":[");
+        } else {
+            printf("\n=== META TAGS ===\n");
+        }
+        
+        int tagsOutput = 0;
+        
+        for (unsigned int i = 0; i < file->numTags; i++) {
+            int tagType = determineTagType(file->tags[i]);
+            
+            // Apply filters
+            if ((tagType == 1 && options->show_special) ||
+                (tagType == 2 && options->show_gap) ||
+                (tagType == 3 && options->show_standard) ||
+                (tagType == 4 && options->show_unknown)) {
+                
+                // Add comma if needed in JSON mode
+                if (options->json_output && tagsOutput > 0) {
+                    printf(",");
+                }
+                
+                printMetaTag(stdout, file->tags[i], options->verbose, options->json_output, options->time_format);
+                tagsOutput++;
+            }
+        }
+        
+        // Close the tags array in JSON mode
+        if (options->json_output) {
+            printf("]");
+        }
+    }
+    
+    // Visualize file status if requested
+    if (options->visualize_gaps) {
+        // Add comma if needed in JSON mode
+        if (options->json_output && (options->show_special || options->show_gap || 
+            options->show_standard || options->show_unknown)) {
+            printf(",");
         }
+        
+        PhaseStart start = startPhase(options->stats);
+        visualizeFileStatus(stdout, gaps, numGaps, file->fileSize, file->downloadedBytes, options->json_output);
+        traceSpan(options->stats, "visualizeFileStatus", start);
     }
     
-    *numGaps = gapIndex;
-    return gaps;
+    // Close the JSON output
+    if (options->json_output && 
+        !(options->show_hash || options->show_metversion || options->show_tagcount || 
+          options->show_filename || options->show_filesize || options->show_date || 
+          options->show_progress)) {
+        printf(options->batch ? "}" : "}\n");
+    }
 }
 
 /**
- * Visualize file download status with gaps
+ * Analyze one .part.met file and print the requested information.
+ * Returns EXIT_SUCCESS when output was produced, EXIT_FAILURE when the
+ * file was rejected by the filter or could not be opened.
  */
-void visualizeFileStatus(GapInfo *gaps, int numGaps, unsigned int fileSize, unsigned int downloadedBytes, int json_output) {
-    const int barWidth = 70; // Width of visualization bar
+int processFile(const char *path, const ProgramOptions *options, const MetFilter *filter) {
+    int fd = -1;
+    int rc;
+    int matched = MET_FILTER_TRUE;
+    int fromBackup = 0;
+    MetFile file;
+    RunStats *stats = options->stats;
+    PhaseStart start;
     
-    if (json_output) {
-        printf("{\"visualization\":{");
-        printf("\"total_size\":%u,\"total_size_mb\":%.2f,", fileSize, fileSize / 1048576.0);
-        printf("\"downloaded\":%u,\"downloaded_mb\":%.2f,", downloadedBytes, downloadedBytes / 1048576.0);
-        double perc = 0.0;
-        if (fileSize > 0) {
-            perc = (downloadedBytes * 100.0) / fileSize;
-        }
-        printf("\"percentage\":%.1f,", perc);
-        
-        // Gap statistics
-        printf("\"gaps\":{\"count\":%d,", numGaps);
-        
-        if (numGaps > 0) {
-            unsigned int totalGapSize = 0;
-            for (int i = 0; i < numGaps; i++) {
-                totalGapSize += (gaps[i].end - gaps[i].start);
-            }
-            
-            double gapPerc = 0.0;
-            if (fileSize > 0) {
-                gapPerc = (totalGapSize * 100.0) / fileSize;
-            }
-            printf("\"total_size\":%u,\"total_size_mb\":%.2f,\"percentage\":%.1f,",
-                   totalGapSize, totalGapSize / 1048576.0, gapPerc);
-            
-            // Add gap details
-            printf("\"details\":[");
-            for (int i = 0; i < numGaps; i++) {
-                printf("{\"start\":%u,\"end\":%u,\"size\":%u,\"size_mb\":%.2f}",
-                       gaps[i].start, gaps[i].end,
-                       gaps[i].end - gaps[i].start,
-                       (gaps[i].end - gaps[i].start) / 1048576.0);
-                
-                if (i < numGaps - 1) {
-                    printf(",");
-                }
-            }
-            printf("]");
-        } else {
-            printf("\"total_size\":0,\"total_size_mb\":0.0,\"percentage\":0.0,\"details\":[]");
+    traceFile(stats, path);
+    if (stats != NULL) {
+        stats->files++;
+    }
+    
+    if (options->salvage) {
+        // Decode what can be decoded up front, the filter then runs on the
+        // salvaged tags. Opening and the header count as tag decoding.
+        start = startPhase(stats);
+        rc = loadSalvagedMetFile(path, &file, &fromBackup, &options->met);
+        endPhase(stats, PHASE_TAGS, start);
+        if (rc != MET_OK) {
+            reportMetError(path, rc);
+            return EXIT_FAILURE;
         }
-        
-        printf("}");  // Close gaps object
-        
-        // Visual representation as array
-        printf(",\"bar\":[");
-        for (int i = 0; i < barWidth; i++) {
-            // Calculate file position this bar position represents
-            unsigned int posStart = (unsigned int)((i / (double)barWidth) * fileSize);
-            unsigned int posEnd = (unsigned int)(((i + 1) / (double)barWidth) * fileSize);
-            
-            // Check if this position is in a gap
-            int inGap = 0;
-            for (int j = 0; j < numGaps; j++) {
-                // If there's any overlap between this bar position and a gap
-                if (!(posEnd <= gaps[j].start || posStart >= gaps[j].end)) {
-                    inGap = 1;
-                    break;
-                }
-            }
-            
-            printf("%d", inGap ? 0 : 1);
-            if (i < barWidth - 1) {
-                printf(",");
+        if (file.partial) {
+            warnx("%s: partial, %u of %u tags%s (%s at offset %lld)", path, file.numTags,
+                  file.header.numTags, fromBackup ? " from backup" : "",
+                  metErrorString(file.damage), (long long)file.damageOffset);
+        } else if (fromBackup) {
+            warnx("%s: damaged, read from %s.bak", path, path);
+        }
+        if (filter != NULL) {
+            start = startPhase(stats);
+            rc = matchFilterTags(filter, &file, &matched, &options->met);
+            endPhase(stats, PHASE_FILTER, start);
+            if (rc != MET_OK) {
+                reportMetError(path, rc);
+                freeMetFile(&file);
+                return EXIT_FAILURE;
             }
         }
-        printf("]");
-        
-        printf("}}");  // Close visualization and outer objects
     } else {
-        printf("\n=== FILE DOWNLOAD VISUALIZATION ===\n");
+        start = startPhase(stats);
+        if ((fd = open(path, O_RDONLY)) == -1) {
+            warn("Unable to open file %s", path);
+            return EXIT_FAILURE;
+        }
+        endPhase(stats, PHASE_OPEN, start);
+        MET_PROBE2(file__open, path, fd);
         
-        // Show basic info
-        printf("Total size: %u bytes (%.2f MB)\n", fileSize, fileSize / 1048576.0);
-        double perc = 0.0;
-        if (fileSize > 0) {
-            perc = (downloadedBytes * 100.0) / fileSize;
-        }
-        printf("Downloaded: %u bytes (%.2f MB, %.1f%%)\n",
-               downloadedBytes,
-               downloadedBytes / 1048576.0,
-               perc);
+        memset(&file, 0, sizeof(file));
         
-        // Draw progress bar
-        printf("[");
+        start = startPhase(stats);
+        rc = readMetHeader(fd, &file.header, &options->met);
+        endPhase(stats, PHASE_HEADER, start);
         
-        // For each position in the progress bar
-        for (int i = 0; i < barWidth; i++) {
-            // Calculate file position this bar position represents
-            unsigned int posStart = (unsigned int)((i / (double)barWidth) * fileSize);
-            unsigned int posEnd = (unsigned int)(((i + 1) / (double)barWidth) * fileSize);
-            
-            // Check if this position is in a gap
-            int inGap = 0;
-            for (int j = 0; j < numGaps; j++) {
-                // If there's any overlap between this bar position and a gap
-                if (!(posEnd <= gaps[j].start || posStart >= gaps[j].end)) {
-                    inGap = 1;
-                    break;
-                }
-            }
-            
-            // Print character based on gap status
-            if (inGap) {
-                printf(" "); // Gap/missing part
-            } else {
-                printf("#"); // Downloaded part
-            }
+        // Decode the tags before anything is printed, so a file that fails
+        // halfway through prints nothing. The --where filter is decided in
+        // the same pass, which ends as soon as the file is rejected.
+        if (rc == MET_OK && needsTags(options)) {
+            start = startPhase(stats);
+            rc = readMatchingTags(fd, &file, filter, &matched, &options->met);
+            endPhase(stats, PHASE_TAGS, start);
+        } else if (rc == MET_OK && filter != NULL) {
+            start = startPhase(stats);
+            rc = visitMatchingTags(fd, &file.header, filter, NULL, NULL, &matched, &options->met);
+            endPhase(stats, PHASE_FILTER, start);
+        }
+        if (rc != MET_OK) {
+            reportMetError(path, rc);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    int status = EXIT_FAILURE;
+    if (matched == MET_FILTER_TRUE) {
+        GapInfo *gaps = NULL;
+        int numGaps = 0;
+        
+        if (stats != NULL && needsTags(options)) {
+            stats->tags += file.numTags;
         }
         
-        printf("]\n\n");
+        // The gaps are collected before the record is started as well
+        if (needsGaps(options)) {
+            start = startPhase(stats);
+            rc = collectGaps(file.tags, file.numTags, &gaps, &numGaps, &options->met);
+            endPhase(stats, PHASE_GAPS, start);
+        }
         
-        // Show gap statistics
-        if (numGaps > 0) {
-            printf("Gaps: %d\n", numGaps);
-            
-            // Calculate total gap size
-            unsigned int totalGapSize = 0;
-            for (int i = 0; i < numGaps; i++) {
-                totalGapSize += (gaps[i].end - gaps[i].start);
-            }
-            
-            double gapPerc = 0.0;
-            if (fileSize > 0) {
-                gapPerc = (totalGapSize * 100.0) / fileSize;
-            }
-            printf("Total gap size: %.2f MB (%.1f%% of file)\n\n",
-                   totalGapSize / 1048576.0,
-                   gapPerc);
+        if (rc != MET_OK) {
+            reportMetError(path, rc);
+        } else {
+            start = startPhase(stats);
+            beginRecord(path, options);
+            printFile(path, options, &file, gaps, numGaps, fromBackup);
+            endPhase(stats, PHASE_FORMAT, start);
+            status = EXIT_SUCCESS;
+        }
+        MET_PROBE2(output__emitted, path, status);
+        free(gaps);
+    }
+    
+    freeMetFile(&file);
+    if (fd != -1) {
+        close(fd);
+    }
+    return status;
+}
+
+/**
+ * Settings shared by the files processed in one run
+ */
+typedef struct {
+    const ProgramOptions *options;
+    const MetFilter *filter;
+    int status;           // EXIT_SUCCESS once a file produced output
+} FileJob;
+
+/**
+ * Process one file of a run
+ */
+void processFileJob(const char *path, void *ctx) {
+    FileJob *job = (FileJob *)ctx;
+    const ProgramOptions *options = job->options;
+    RunStats before;
+    PhaseStart start = startPhase(options->stats);
+    
+    if (options->stats != NULL) {
+        before = *options->stats;
+    }
+    
+    if (processFile(path, options, job->filter) == EXIT_SUCCESS) {
+        // Per-file stats go into the JSON record, or after it on stderr
+        RunStats stats;
+        int showStats = options->show_stats && options->batch;
+        if (showStats) {
+            diffRunStats(&stats, options->stats, &before);
+        }
+        if (showStats && options->json_output) {
+            printf(",\"stats\":");
+            printRunStats(stdout, path, &stats, 0.0, 1);
         }
+        endRecord(options);
+        if (showStats && !options->json_output) {
+            fflush(stdout);
+            printRunStats(stderr, path, &stats, 0.0, 0);
+        }
+        job->status = EXIT_SUCCESS;
     }
+    traceSpan(options->stats, "file", start);
 }
 
 int main(int argc, char **argv) {
     extern char *optarg;
     extern int optind;
     
-    int ch, fd = -1;
-    char *buffer;
-    char *ed2khash;
-    char *uped2khash;
-    int starthash = 5;
+    int ch;
     int show_version = 0;
-    int metVersion = 0;
-    unsigned int fileSize = 0;
-    unsigned int downloadedBytes = 0;
+    int status = EXIT_FAILURE;
+    
+    // Input files given with -f or as operands
+    const char **files = (const char **)calloc(argc, sizeof(char *));
+    int numFiles = 0;
+    if (files == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
     
     // Default options
     ProgramOptions options = {
@@ -888,6 +3302,7 @@ int main(int argc, char **argv) {
         .verbose = 0,
         .visualize_gaps = 0,
         .json_output = 0,
+        .time_format = MET_TIME_LOCAL,
         .show_filename = 0,
         .show_filesize = 0,
         .show_date = 0,
@@ -895,8 +3310,32 @@ int main(int argc, char **argv) {
         .show_hash = 0,
         .show_metversion = 0,
         .show_tagcount = 0,
-        .filename = NULL
+        .filename = NULL,
+        .where = NULL,
+        .batch = 0,
+        .sort_key = SORT_NONE,
+        .sort_descending = 0,
+        .top = 0,
+        .summary = 0,
+        .dupes = 0,
+        .prometheus = NULL,
+        .jobs = DEFAULT_JOBS,
+        .compact = 0,
+        .salvage = 0,
+        .stats = NULL,
+        .show_stats = 0
     };
+    int reverse = 0;
+    char *end;
+    MetFilter *filter = NULL;
+    TagEdits edits = { { 0 }, { 0 }, 0 };
+    RunStats runStats;
+    double runStart = 0.0;
+    Trace trace;
+    const char *tracePath = NULL;
+    PerfCounters perf;
+    int perfCounters = 0;
+    long traceThreshold = DEFAULT_TRACE_THRESHOLD;
     
     static struct option longopts[] = {
         { "file",      required_argument, NULL, 'f' },
@@ -912,7 +3351,24 @@ int main(int argc, char **argv) {
         { "hash",      no_argument,       NULL, 'e' },
         { "metversion",no_argument,       NULL, 'm' },
         { "tagcount",  no_argument,       NULL, 'c' },
+        { "where",     required_argument, NULL, 'w' },
+        { "sort",      required_argument, NULL, OPT_SORT },
+        { "top",       required_argument, NULL, OPT_TOP },
+        { "reverse",   no_argument,       NULL, 'r' },
+        { "summary",   no_argument,       NULL, OPT_SUMMARY },
+        { "dupes",     no_argument,       NULL, OPT_DUPES },
+        { "prometheus-textfile", required_argument, NULL, OPT_PROMETHEUS },
+        { "set",       required_argument, NULL, OPT_SET },
+        { "jobs",      required_argument, NULL, OPT_JOBS },
+        { "compact",   no_argument,       NULL, OPT_COMPACT },
         { "json",      no_argument,       NULL, 'j' },
+        { "utc",       no_argument,       NULL, OPT_UTC },
+        { "limit",     required_argument, NULL, OPT_LIMIT },
+        { "salvage",   no_argument,       NULL, OPT_SALVAGE },
+        { "stats",     no_argument,       NULL, OPT_STATS },
+        { "perf-counters", no_argument,   NULL, OPT_PERF_COUNTERS },
+        { "trace",     required_argument, NULL, OPT_TRACE },
+        { "trace-threshold", required_argument, NULL, OPT_TRACE_THRESHOLD },
         { "verbose",   no_argument,       NULL, 'v' },
         { "version",   no_argument,       NULL, 'V' },
         { "visualize", no_argument,       NULL, 'z' },
@@ -925,13 +3381,14 @@ int main(int argc, char **argv) {
         usage(argv[0]);
     }
     
+    initMetContext(&options.met);
+    
     // Parse command line arguments
-    while ((ch = getopt_long(argc, argv, "f:asgtunSdpemcjvVzh", longopts, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "f:asgtunSdpemcw:rjvVzh", longopts, NULL)) != -1) {
         switch (ch) {
             case 'f':
                 options.filename = optarg;
-                if ((fd = open(optarg, O_RDONLY)) == -1)
-                    err(EXIT_FAILURE, "Unable to open file %s", optarg);
+                files[numFiles++] = optarg;
                 break;
             case 'a':
                 options.show_special = 1;
@@ -972,6 +3429,78 @@ int main(int argc, char **argv) {
             case 'c':
                 options.show_tagcount = 1;
                 break;
+            case 'w':
+                options.where = optarg;
+                break;
+            case OPT_SORT:
+                for (int i = 0; sortKeyNames[i].name; i++) {
+                    if (strcasecmp(optarg, sortKeyNames[i].name) == 0) {
+                        options.sort_key = sortKeyNames[i].key;
+                        options.sort_descending = sortKeyNames[i].descending;
+                    }
+                }
+                if (options.sort_key == SORT_NONE) {
+                    errx(EXIT_FAILURE, "Unknown sort key: %s", optarg);
+                }
+                break;
+            case OPT_TOP:
+                options.top = (int)strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || options.top <= 0) {
+                    errx(EXIT_FAILURE, "Invalid --top value: %s", optarg);
+                }
+                break;
+            case 'r':
+                reverse = 1;
+                break;
+            case OPT_SUMMARY:
+                options.summary = 1;
+                break;
+            case OPT_DUPES:
+                options.dupes = 1;
+                break;
+            case OPT_PROMETHEUS:
+                options.prometheus = optarg;
+                break;
+            case OPT_SET:
+                if (parseTagEdits(optarg, &edits) == -1) {
+                    errx(EXIT_FAILURE, "Invalid --set list: %s", optarg);
+                }
+                break;
+            case OPT_COMPACT:
+                options.compact = 1;
+                break;
+            case OPT_JOBS:
+                options.jobs = (int)strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || options.jobs <= 0) {
+                    errx(EXIT_FAILURE, "Invalid --jobs value: %s", optarg);
+                }
+                break;
+            case OPT_LIMIT:
+                if (parseLimits(optarg, &options.met.limits) == -1) {
+                    errx(EXIT_FAILURE, "Invalid --limit list: %s", optarg);
+                }
+                break;
+            case OPT_SALVAGE:
+                options.salvage = 1;
+                break;
+            case OPT_STATS:
+                options.show_stats = 1;
+                break;
+            case OPT_PERF_COUNTERS:
+                perfCounters = 1;
+                break;
+            case OPT_TRACE:
+                tracePath = optarg;
+                break;
+            case OPT_TRACE_THRESHOLD:
+                traceThreshold = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || traceThreshold < 0) {
+                    errx(EXIT_FAILURE, "Invalid --trace-threshold value: %s", optarg);
+                }
+                break;
+            case OPT_UTC:
+                options.time_format = MET_TIME_UTC;
+                break;
             case 'j':
                 options.json_output = 1;
                 break;
@@ -992,6 +3521,19 @@ int main(int argc, char **argv) {
         }
     }
     
+    // Remaining arguments are additional input files
+    while (optind < argc) {
+        files[numFiles++] = argv[optind++];
+    }
+    options.batch = numFiles > 1 || (numFiles == 1 && isDirectory(files[0]));
+    
+    if (options.top > 0 && options.sort_key == SORT_NONE) {
+        errx(EXIT_FAILURE, "--top requires --sort");
+    }
+    if (reverse) {
+        options.sort_descending = !options.sort_descending;
+    }
+    
     // If no tag filters or specific fields specified, show all by default
     if (!options.show_special && !options.show_gap && !options.show_standard && 
         !options.show_unknown && !options.show_filename && !options.show_filesize && 
@@ -1012,432 +3554,105 @@ int main(int argc, char **argv) {
         }
         
         // If no file was specified, exit
-        if (fd == -1) {
+        if (numFiles == 0) {
             exit(EXIT_SUCCESS);
         }
     }
     
-    if (fd == -1) {
+    if (numFiles == 0) {
         fprintf(stderr, "Error: You must specify a .part.met file\n");
         usage(argv[0]);
     }
     
-    // JSON output start
-    if (options.json_output && 
-        !(options.show_hash || options.show_metversion || options.show_tagcount || 
-          options.show_filename || options.show_filesize || options.show_date || 
-          options.show_progress)) {
-        printf("{");
-    }
-    
-    // Read first byte to determine file version
-    buffer = (char *)calloc(1, 2);
-    if (buffer == NULL) {
-        err(EXIT_FAILURE, "Memory allocation error");
-    }
-    
-    if (read(fd, buffer, 1) != 1) {
-        free(buffer);
-        close(fd);
-        err(EXIT_FAILURE, "Error reading file");
-    }
-    
-    buffer[1] = '\0';
-    
-    // Determine hash position based on file version
-    char *versionStr = NULL;
-    switch ((int)buffer[0] & 0xff) {
-        case 224:
-            starthash = 5;
-            metVersion = 0; // Version 14.0
-            versionStr = "14.0";
-            if (options.show_metversion) {
-                // Output only the version number when specifically requested
-                if (options.json_output) {
-                    printf("{\"format_version\":\"%s\"}", versionStr);
-                } else {
-                    printf("%s", versionStr);
-                }
-                free(buffer);
-                close(fd);
-                return EXIT_SUCCESS;
-            } else if (options.json_output && 
-                      !(options.show_hash || options.show_tagcount || 
-                        options.show_filename || options.show_filesize || 
-                        options.show_date || options.show_progress)) {
-                printf("\"format_version\":\"%s\",", versionStr);
-            } else if (!options.json_output && 
-                      !(options.show_hash || options.show_tagcount || 
-                        options.show_filename || options.show_filesize || 
-                        options.show_date || options.show_progress)) {
-                printf(".part.met file version: %s\n", versionStr);
-            }
-            break;
-        case 225:
-            starthash = 6;
-            metVersion = 1; // Version 14.1
-            versionStr = "14.1";
-            if (options.show_metversion) {
-                // Output only the version number when specifically requested
-                if (options.json_output) {
-                    printf("{\"format_version\":\"%s\"}", versionStr);
-                } else {
-                    printf("%s", versionStr);
-                }
-                free(buffer);
-                close(fd);
-                return EXIT_SUCCESS;
-            } else if (options.json_output && 
-                      !(options.show_hash || options.show_tagcount || 
-                        options.show_filename || options.show_filesize || 
-                        options.show_date || options.show_progress)) {
-                printf("\"format_version\":\"%s\",", versionStr);
-            } else if (!options.json_output && 
-                      !(options.show_hash || options.show_tagcount || 
-                        options.show_filename || options.show_filesize || 
-                        options.show_date || options.show_progress)) {
-                printf(".part.met file version: %s\n", versionStr);
-            }
-            break;
-        default:
-            free(buffer);
-            close(fd);
-            errx(EXIT_FAILURE, "Unrecognized or invalid file format");
-    }
-    
-    // Position file pointer at hash location
-    if (lseek(fd, starthash, SEEK_SET) == -1) {
-        free(buffer);
-        close(fd);
-        err(EXIT_FAILURE, "Error positioning within file");
+    // Compile the filter expression once, before any file data is read
+    if (options.where != NULL) {
+        const char *error;
+        int errorOffset;
+        
+        int rc = createMetFilter(options.where, &filter, &error, &errorOffset);
+        if (rc == MET_ERR_SYNTAX) {
+            errx(EXIT_FAILURE, "Invalid --where expression at offset %d: %s", errorOffset, error);
+        } else if (rc != MET_OK) {
+            errx(EXIT_FAILURE, "%s", metErrorString(rc));
+        }
     }
     
-    free(buffer);
+    FileJob job = { &options, filter, EXIT_FAILURE };
     
-    // Allocate memory for hash and its string representation
-    buffer = (char *)calloc(1, 17);
-    ed2khash = (char *)malloc(sizeof(char) * 33);
-    uped2khash = (char *)malloc(sizeof(char) * 33);
-    
-    if (buffer == NULL || ed2khash == NULL || uped2khash == NULL) {
-        free(buffer);
-        free(ed2khash);
-        free(uped2khash);
-        close(fd);
-        err(EXIT_FAILURE, "Memory allocation error");
+    // --trace and --perf-counters reuse the phase timing of --stats
+    if (options.show_stats || tracePath != NULL || perfCounters) {
+        memset(&runStats, 0, sizeof(runStats));
+        options.stats = &runStats;
+        options.met.stats = &runStats.counters;
     }
-    
-    // Read 16 bytes of the hash
-    if (read(fd, buffer, 16) != 16) {
-        free(buffer);
-        free(ed2khash);
-        free(uped2khash);
-        close(fd);
-        err(EXIT_FAILURE, "Error reading hash");
+    if (tracePath != NULL) {
+        memset(&trace, 0, sizeof(trace));
+        runStats.trace = &trace;
+        options.met.tracer = traceLibrarySpan;
+        options.met.tracerContext = &trace;
+        options.met.traceThreshold = (size_t)traceThreshold;
     }
-    
-    buffer[16] = '\0';
-    
-    // Format hash as hexadecimal string
-    sprintf(ed2khash, "%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x",
-            buffer[0] & 0xff, buffer[1] & 0xff, buffer[2] & 0xff, buffer[3] & 0xff,
-            buffer[4] & 0xff, buffer[5] & 0xff, buffer[6] & 0xff, buffer[7] & 0xff,
-            buffer[8] & 0xff, buffer[9] & 0xff, buffer[10] & 0xff, buffer[11] & 0xff,
-            buffer[12] & 0xff, buffer[13] & 0xff, buffer[14] & 0xff, buffer[15] & 0xff);
-    
-    // Convert hash to uppercase
-    strtoupper(ed2khash, uped2khash);
-    
-    // Handle -e/--hash option specially
-    if (options.show_hash) {
-        if (options.json_output) {
-            printf("{\"ed2k_hash\":\"%s\"}", uped2khash);
+    if (perfCounters) {
+        if (openPerfCounters(&perf) == -1) {
+            warnx("No performance counters available, --perf-counters ignored");
         } else {
-            printf("%s", uped2khash);
+            runStats.perf = &perf;
         }
-        
-        // Free hash memory
-        free(buffer);
-        free(ed2khash);
-        free(uped2khash);
-        close(fd);
-        return EXIT_SUCCESS;
     }
-    
-    // Print hash in normal mode
-    if (options.json_output && 
-        !(options.show_tagcount || options.show_filename || 
-          options.show_filesize || options.show_date || options.show_progress)) {
-        printf("\"ed2k_hash\":\"%s\",", uped2khash);
-    } else if (!options.json_output && 
-              !(options.show_tagcount || options.show_filename || 
-                options.show_filesize || options.show_date || options.show_progress)) {
-        printf("ED2K Hash: %s\n", uped2khash);
-    }
-    
-    // Free hash memory
-    free(buffer);
-    free(ed2khash);
-    free(uped2khash);
-    
-    // Position for reading meta tags
-    int numTagsPosition;
-    int numBlocks = 0;
-    
-    if (metVersion == 0) { // Version 14.0
-        // In version 14.0 we need to read the number of blocks first
-        lseek(fd, 21, SEEK_SET); // Position of 'Blocks' field
-        numBlocks = readWord(fd);
-        
-        // Calculate position of NumTags field
-        numTagsPosition = 23 + (16 * numBlocks);
-        lseek(fd, numTagsPosition, SEEK_SET);
-    } else { // Version 14.1
-        // In version 14.1, NumTags is right after the ED2K hash
-        numTagsPosition = 22;
-        lseek(fd, numTagsPosition, SEEK_SET);
+    if (options.stats != NULL) {
+        runStart = phaseClock(options.stats);
     }
     
-    // Read number of meta tags
-    unsigned int numTags = readDWord(fd);
-    
-    // Handle -c/--tagcount option specially
-    if (options.show_tagcount) {
-        if (options.json_output) {
-            printf("{\"num_tags\":%u}", numTags);
-        } else {
-            printf("%u", numTags);
+    if (edits.numEdits > 0) {
+        status = runSetTags(files, numFiles, &edits, &options, job.filter);
+    } else if (options.compact) {
+        status = runCompact(files, numFiles, &options, job.filter);
+    } else if (options.prometheus != NULL) {
+        status = runPrometheusExport(files, numFiles, &options, job.filter);
+    } else if (options.dupes) {
+        status = runDupesReport(files, numFiles, &options);
+    } else if (options.summary) {
+        status = runSummaryReport(files, numFiles, &options, job.filter);
+    } else if (options.sort_key != SORT_NONE) {
+        status = runSortReport(files, numFiles, &options, job.filter);
+    } else {
+        // Process every file; succeed if at least one produced output
+        for (int i = 0; i < numFiles; i++) {
+            forEachPartMet(files[i], processFileJob, &job);
         }
-        close(fd);
-        return EXIT_SUCCESS;
-    }
-    
-    if (options.json_output && 
-        !(options.show_filename || options.show_filesize || 
-          options.show_date || options.show_progress)) {
-        printf("\"num_tags\":%u,", numTags);
-    } else if (!options.json_output && 
-              !(options.show_filename || options.show_filesize || 
-                options.show_date || options.show_progress)) {
-        printf("Number of meta tags: %u\n", numTags);
-    }
-    
-    // Read all meta tags into memory
-    MetaTag **tags = (MetaTag **)malloc(numTags * sizeof(MetaTag *));
-    if (tags == NULL) {
-        close(fd);
-        err(EXIT_FAILURE, "Memory allocation error");
+        status = job.status;
     }
     
-    for (unsigned int i = 0; i < numTags; i++) {
-        tags[i] = readMetaTag(fd);
-        if (tags[i] == NULL) {
-            // Free previously allocated tags
-            for (unsigned int j = 0; j < i; j++) {
-                freeMetaTag(tags[j]);
-            }
-            free(tags);
-            close(fd);
-            err(EXIT_FAILURE, "Error reading meta tags");
-        }
-        
-        // Keep track of file size and downloaded bytes for visualization
-        if (tags[i]->nameLength == 1) {
-            if (tags[i]->name[0] == 2 && tags[i]->type == 3) { // File size
-                fileSize = tags[i]->value.intValue;
-            } else if (tags[i]->name[0] == 8 && tags[i]->type == 3) { // Downloaded bytes
-                downloadedBytes = tags[i]->value.intValue;
-            }
-        }
-    }
+    double wall = phaseClock(options.stats) - runStart;
     
-    // Output structure for specific fields
-    if (options.show_filename || options.show_filesize || 
-        options.show_date || options.show_progress) {
-        
-        // In JSON mode, we need a separate "fields" object
-        if (options.json_output) {
-            printf("{\"fields\":{");
-        }
-        
-        int fieldsOutput = 0;
-        
-        if (options.show_filename) {
-            displaySpecificField(tags, numTags, 1, options.verbose, options.json_output);
-            fieldsOutput++;
-            // We want to exit immediately for script usage mode
-            if (!options.json_output) {
-                // Free all tags
-                for (unsigned int i = 0; i < numTags; i++) {
-                    freeMetaTag(tags[i]);
-                }
-                free(tags);
-                close(fd);
-                return EXIT_SUCCESS;
-            }
-        }
-        
-        if (options.show_filesize) {
-            // Add comma if needed in JSON mode
-            if (options.json_output && fieldsOutput > 0) {
-                printf(",");
-            }
-            displaySpecificField(tags, numTags, 2, options.verbose, options.json_output);
-            fieldsOutput++;
-            // We want to exit immediately for script usage mode
-            if (!options.json_output) {
-                // Free all tags
-                for (unsigned int i = 0; i < numTags; i++) {
-                    freeMetaTag(tags[i]);
-                }
-                free(tags);
-                close(fd);
-                return EXIT_SUCCESS;
-            }
-        }
-        
-        if (options.show_date) {
-            // Add comma if needed in JSON mode
-            if (options.json_output && fieldsOutput > 0) {
-                printf(",");
-            }
-            displaySpecificField(tags, numTags, 5, options.verbose, options.json_output);
-            fieldsOutput++;
-            // We want to exit immediately for script usage mode
-            if (!options.json_output) {
-                // Free all tags
-                for (unsigned int i = 0; i < numTags; i++) {
-                    freeMetaTag(tags[i]);
-                }
-                free(tags);
-                close(fd);
-                return EXIT_SUCCESS;
-            }
-        }
-        
-        if (options.show_progress) {
-            // Add comma if needed in JSON mode
-            if (options.json_output && fieldsOutput > 0) {
-                printf(",");
-            }
-            
-            if (options.json_output) {
-                printf("\"progress\":");
-            }
-            
-            displayProgress(fileSize, downloadedBytes, options.json_output);
-            fieldsOutput++;
-            // We want to exit immediately for script usage mode
-            if (!options.json_output) {
-                // Free all tags
-                for (unsigned int i = 0; i < numTags; i++) {
-                    freeMetaTag(tags[i]);
-                }
-                free(tags);
-                close(fd);
-                return EXIT_SUCCESS;
-            }
-        }
-        
-        // Close the "fields" object in JSON mode
-        if (options.json_output) {
-            printf("}}");
-            // Exit - we're done with specific fields in JSON mode
-            // Free all tags
-            for (unsigned int i = 0; i < numTags; i++) {
-                freeMetaTag(tags[i]);
-            }
-            free(tags);
-            close(fd);
-            return EXIT_SUCCESS;
+    if (tracePath != NULL) {
+        if (writeTrace(tracePath, &trace, runStart) == -1) {
+            warn("Unable to write trace %s", tracePath);
+            status = EXIT_FAILURE;
         }
+        freeTrace(&trace);
     }
     
-    // Display tags based on filter options
-    if (options.show_special || options.show_gap || 
-        options.show_standard || options.show_unknown) {
-        
-        // Start the tags array in JSON mode
+    if (options.show_stats) {
+        fflush(stdout);
         if (options.json_output) {
-            printf("\"tags\":[");
+            fprintf(stderr, "{\"stats\":");
+            printRunStats(stderr, NULL, options.stats, wall, 1);
+            fprintf(stderr, "}\n");
         } else {
-            printf("\n=== META TAGS ===\n");
-        }
-        
-        int tagsOutput = 0;
-        
-        for (unsigned int i = 0; i < numTags; i++) {
-            int tagType = determineTagType(tags[i]);
-            
-            // Apply filters
-            if ((tagType == 1 && options.show_special) ||
-                (tagType == 2 && options.show_gap) ||
-                (tagType == 3 && options.show_standard) ||
-                (tagType == 4 && options.show_unknown)) {
-                
-                // Add comma if needed in JSON mode
-                if (options.json_output && tagsOutput > 0) {
-                    printf(",");
-                }
-                
-                printMetaTag(tags[i], options.verbose, options.json_output);
-                tagsOutput++;
-            }
-        }
-        
-        // Close the tags array in JSON mode
-        if (options.json_output) {
-            printf("]");
-        }
-    }
-    
-    // Visualize file status if requested
-    if (options.visualize_gaps) {
-        GapInfo *gaps;
-        int numGaps;
-        
-        gaps = collectGaps(tags, numTags, &numGaps);
-        
-        // Add comma if needed in JSON mode
-        if (options.json_output && (options.show_special || options.show_gap || 
-            options.show_standard || options.show_unknown)) {
-            printf(",");
+            printRunStats(stderr, NULL, options.stats, wall, 0);
         }
-        
-        visualizeFileStatus(gaps, numGaps, fileSize, downloadedBytes, options.json_output);
-        
-        free(gaps);
     }
     
-    // Close the JSON output
-    if (options.json_output && 
-        !(options.show_hash || options.show_metversion || options.show_tagcount || 
-          options.show_filename || options.show_filesize || options.show_date || 
-          options.show_progress)) {
-        printf("}\n");
+    if (options.stats != NULL && runStats.perf != NULL) {
+        fflush(stdout);
+        printPerfCounters(stderr, &runStats, options.json_output);
+        closePerfCounters(&perf);
     }
     
-    // Free all tags
-    for (unsigned int i = 0; i < numTags; i++) {
-        freeMetaTag(tags[i]);
-    }
-    free(tags);
+    freeMetFilter(filter);
+    free(files);
     
-    // Close file and exit
-    close(fd);
-    return EXIT_SUCCESS;
+    return status;
 }
 
-/**
- * Convert a string to uppercase
- */
-char *strtoupper(char *in_str, char *out_str) {
-    int index;
-    
-    for (index = 0; in_str[index]; index++)
-        out_str[index] = toupper(in_str[index]);
-    
-    out_str[index] = 0;
-    
-    return out_str;
-}
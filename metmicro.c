@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sched.h>
+#include <getopt.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmetinfo.h"
+
+/**
+ * Microbenchmarks of single library functions over in-memory inputs of
+ * increasing size, so that the cost per operation can be read as a slope.
+ */
+
+#define MAX_SIZES       8       // Input sizes per benchmark
+
+/**
+ * Input built once per benchmark and size
+ */
+typedef struct {
+    size_t size;              // Size parameter (gaps or string length)
+    unsigned char *data;      // Serialized .part.met file
+    size_t length;            // Length of data
+    MetFile file;             // Decoded file
+    GapInfo *gaps;            // Gap list
+    int numGaps;
+    char *text;               // Escaper input
+    FILE *out;                // Printer output, /dev/null
+    size_t bytes;             // Input bytes handled by one operation
+} Input;
+
+/**
+ * A benchmarked function
+ */
+typedef struct {
+    const char *name;
+    const char *unit;         // Meaning of the size parameter
+    size_t sizes[MAX_SIZES];  // Size parameters, 0 terminated
+    void (*setup)(Input *input);
+    void (*run)(Input *input);
+} Benchmark;
+
+/**
+ * Harness settings
+ */
+typedef struct {
+    int cpu;                  // CPU to pin to, -1 = current
+    double warmup;            // Seconds of warmup per case
+    double minTime;           // Minimum seconds per timed repetition
+    double maxOpTime;         // Skip sizes predicted to take longer per operation
+    int repetitions;          // Timed repetitions, the median is reported
+    size_t maxSize;           // Largest size parameter to run
+    const char *only;         // Comma separated benchmark names, NULL = all
+} MicroOptions;
+
+static volatile size_t sink;  // Keeps results alive
+static MetContext met;        // Default limits but the tag count
+
+/**
+ * Current time in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void putWord(unsigned char *p, unsigned int value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void putDWord(unsigned char *p, unsigned int value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+/**
+ * Serialize a 14.1 file with a filename, a size and the given number of
+ * evenly spaced gaps
+ */
+static void buildFile(Input *input) {
+    static const char filename[] = "benchmark input file.avi";
+    unsigned int fileSize = 0xFFFFFFFFU;
+    unsigned int slot = (unsigned int)(fileSize / (input->size + 1));
+    size_t capacity = 64 + sizeof(filename) + input->size * 2 * 16;
+    unsigned char *p;
+    
+    input->data = malloc(capacity);
+    if (input->data == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    p = input->data;
+    *p++ = 0xE1;
+    memset(p, 0, 5);
+    p += 5;
+    for (int i = 0; i < 16; i++) {
+        *p++ = (unsigned char)(i * 17);
+    }
+    putDWord(p, (unsigned int)(2 + 2 * input->size));
+    p += 4;
+    
+    *p++ = 2;
+    putWord(p, 1);
+    p += 2;
+    *p++ = 0x01;
+    putWord(p, sizeof(filename) - 1);
+    p += 2;
+    memcpy(p, filename, sizeof(filename) - 1);
+    p += sizeof(filename) - 1;
+    
+    *p++ = 3;
+    putWord(p, 1);
+    p += 2;
+    *p++ = 0x02;
+    putDWord(p, fileSize);
+    p += 4;
+    
+    for (size_t i = 0; i < input->size; i++) {
+        char name[16];
+        int length = snprintf(name + 1, sizeof(name) - 1, "%zu", i) + 1;
+        for (int end = 0; end < 2; end++) {
+            name[0] = end ? 0x0A : 0x09;
+            *p++ = 3;
+            putWord(p, (unsigned int)length);
+            p += 2;
+            memcpy(p, name, (size_t)length);
+            p += length;
+            putDWord(p, (unsigned int)(i * slot + slot / 4 + end * (slot / 2)));
+            p += 4;
+        }
+    }
+    input->length = (size_t)(p - input->data);
+}
+
+static void setupDecode(Input *input) {
+    buildFile(input);
+    input->bytes = input->length;
+}
+
+static void setupTags(Input *input) {
+    buildFile(input);
+    if (parseMetBuffer(input->data, input->length, &input->file, &met) != MET_OK) {
+        errx(EXIT_FAILURE, "Cannot decode the generated input");
+    }
+    input->bytes = input->length;
+}
+
+/**
+ * Gap list matching buildFile, made directly: collectGaps is too slow to
+ * prepare the largest inputs
+ */
+static void setupGaps(Input *input) {
+    unsigned int slot = (unsigned int)(0xFFFFFFFFU / (input->size + 1));
+    unsigned int missing = 0;
+    
+    input->gaps = malloc(input->size * sizeof(GapInfo));
+    if (input->gaps == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    for (size_t i = 0; i < input->size; i++) {
+        input->gaps[i].start = (unsigned int)(i * slot + slot / 4);
+        input->gaps[i].end = input->gaps[i].start + slot / 2;
+        missing += slot / 2;
+    }
+    input->numGaps = (int)input->size;
+    input->file.fileSize = 0xFFFFFFFFU;
+    input->file.downloadedBytes = input->file.fileSize - missing;
+    input->bytes = input->size * sizeof(GapInfo);
+    input->out = fopen("/dev/null", "w");
+    if (input->out == NULL) {
+        err(EXIT_FAILURE, "Cannot open /dev/null");
+    }
+}
+
+/**
+ * Filename-like text with one character in 32 needing an escape
+ */
+static void setupText(Input *input) {
+    static const char special[] = "\"\\\n\t\x01";
+    input->text = malloc(input->size + 1);
+    if (input->text == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    for (size_t i = 0; i < input->size; i++) {
+        if (i % 32 == 31) {
+            input->text[i] = special[(i / 32) % 5];
+        } else {
+            input->text[i] = (char)('a' + i % 26);
+        }
+    }
+    input->text[input->size] = '\0';
+    input->bytes = input->size;
+}
+
+static void setupHash(Input *input) {
+    input->data = malloc(16 + 33);
+    if (input->data == NULL) {
+        err(EXIT_FAILURE, "Memory allocation error");
+    }
+    for (int i = 0; i < 16; i++) {
+        input->data[i] = (unsigned char)(i * 17);
+    }
+    input->bytes = 16;
+}
+
+static int countTag(void *context, const MetaTag *tag, off_t offset) {
+    (void)offset;
+    *(size_t *)context += tag->nameLength;
+    return MET_OK;
+}
+
+static void runDecode(Input *input) {
+    static const MetVisitor visitor = { NULL, countTag, NULL };
+    size_t names = 0;
+    visitMetBuffer(input->data, input->length, &visitor, &names, &met);
+    sink = names;
+}
+
+static void runParse(Input *input) {
+    MetFile file;
+    parseMetBuffer(input->data, input->length, &file, &met);
+    sink = file.numTags;
+    freeMetFile(&file);
+}
+
+static void runCollectGaps(Input *input) {
+    GapInfo *gaps;
+    int numGaps;
+    collectGaps(input->file.tags, (int)input->file.numTags, &gaps, &numGaps, &met);
+    sink = (size_t)numGaps;
+    free(gaps);
+}
+
+static void runVisualize(Input *input) {
+    visualizeFileStatus(input->out, input->gaps, input->numGaps, input->file.fileSize, input->file.downloadedBytes, 0);
+}
+
+static void runVisualizeJson(Input *input) {
+    visualizeFileStatus(input->out, input->gaps, input->numGaps, input->file.fileSize, input->file.downloadedBytes, 1);
+}
+
+static void runEscape(Input *input) {
+    char *escaped = jsonEscapeString(input->text);
+    sink = (size_t)escaped[0];
+    free(escaped);
+}
+
+static void runHash(Input *input) {
+    formatHash(input->data, (char *)input->data + 16);
+    sink = input->data[16];
+}
+
+#define GAP_SIZES { 10, 100, 1000, 10000, 100000, 1000000, 0 }
+
+static const Benchmark benchmarks[] = {
+    { "decode",         "gaps",  GAP_SIZES, setupDecode, runDecode },
+    { "parse",          "gaps",  GAP_SIZES, setupDecode, runParse },
+    { "collectGaps",    "gaps",  GAP_SIZES, setupTags,   runCollectGaps },
+    { "visualize",      "gaps",  GAP_SIZES, setupGaps,   runVisualize },
+    { "visualize-json", "gaps",  GAP_SIZES, setupGaps,   runVisualizeJson },
+    { "jsonEscape",     "chars", { 16, 256, 4096, 65536, 1000000, 0 }, setupText, runEscape },
+    { "formatHash",     "bytes", { 16, 0 }, setupHash, runHash }
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void freeInput(Input *input) {
+    free(input->data);
+    free(input->gaps);
+    free(input->text);
+    if (input->file.tags != NULL) {
+        freeMetFile(&input->file);
+    }
+    if (input->out != NULL) {
+        fclose(input->out);
+    }
+}
+
+/**
+ * Run an operation a number of times and return the elapsed seconds
+ */
+static double timeRuns(const Benchmark *benchmark, Input *input, size_t runs) {
+    double start = now();
+    for (size_t i = 0; i < runs; i++) {
+        benchmark->run(input);
+    }
+    return now() - start;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Check whether a benchmark was selected with --only
+ */
+static int benchmarkSelected(const MicroOptions *options, const char *name) {
+    if (options->only == NULL) {
+        return 1;
+    }
+    size_t length = strlen(name);
+    for (const char *p = options->only; *p; ) {
+        const char *comma = strchr(p, ',');
+        size_t itemLength = comma ? (size_t)(comma - p) : strlen(p);
+        if (itemLength == length && strncmp(p, name, length) == 0) {
+            return 1;
+        }
+        p += itemLength + (comma != NULL);
+    }
+    return 0;
+}
+
+/**
+ * Pin the process to one CPU so that migrations do not add noise
+ */
+static int pinCpu(int cpu) {
+    cpu_set_t set;
+    
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (cpu < 0 || sched_setaffinity(0, sizeof(set), &set) == -1) {
+        warn("Cannot pin to CPU %d, results may be noisy", cpu);
+        return -1;
+    }
+    return cpu;
+}
+
+/**
+ * Show program usage instructions
+ */
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    fprintf(stderr, "Time library functions over inputs of increasing size\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -b, --only=LIST      Only run these benchmarks, e.g. decode,collectGaps\n");
+    fprintf(stderr, "  -m, --max-size=N     Largest size parameter (default 1000000)\n");
+    fprintf(stderr, "  -c, --cpu=N          CPU to pin to (default the current one)\n");
+    fprintf(stderr, "  -w, --warmup=SEC     Warmup per case (default 0.1)\n");
+    fprintf(stderr, "  -t, --time=SEC       Minimum time per repetition (default 0.2)\n");
+    fprintf(stderr, "  -r, --repeat=N       Timed repetitions, the median is reported (default 5)\n");
+    fprintf(stderr, "  -s, --skip-after=SEC Skip larger sizes once one operation would take this\n");
+    fprintf(stderr, "                       long, extrapolating linearly (default 1)\n");
+    fprintf(stderr, "  -o, --output=FILE    Write the JSON results to FILE (default stdout)\n");
+    fprintf(stderr, "  -h, --help           Show this help message\n");
+    fprintf(stderr, "\nBenchmarks:");
+    for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+        fprintf(stderr, " %s", benchmarks[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    char *end;
+    const char *output = NULL;
+    FILE *out = stdout;
+    
+    // Default options
+    MicroOptions options = {
+        .cpu = -1,
+        .warmup = 0.1,
+        .minTime = 0.2,
+        .maxOpTime = 1.0,
+        .repetitions = 5,
+        .maxSize = 1000000,
+        .only = NULL
+    };
+    
+    static struct option longopts[] = {
+        { "only",       required_argument, NULL, 'b' },
+        { "max-size",   required_argument, NULL, 'm' },
+        { "cpu",        required_argument, NULL, 'c' },
+        { "warmup",     required_argument, NULL, 'w' },
+        { "time",       required_argument, NULL, 't' },
+        { "repeat",     required_argument, NULL, 'r' },
+        { "skip-after", required_argument, NULL, 's' },
+        { "output",     required_argument, NULL, 'o' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL,         0,                 NULL,  0  }
+    };
+    
+    while ((ch = getopt_long(argc, argv, "b:m:c:w:t:r:s:o:h", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'b':
+                options.only = optarg;
+                break;
+            case 'm':
+                options.maxSize = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0') {
+                    errx(EXIT_FAILURE, "Invalid size: %s", optarg);
+                }
+                break;
+            case 'c':
+                options.cpu = (int)strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || options.cpu < 0) {
+                    errx(EXIT_FAILURE, "Invalid CPU: %s", optarg);
+                }
+                break;
+            case 'w':
+            case 't':
+            case 's': {
+                double value = strtod(optarg, &end);
+                if (*optarg == '\0' || *end != '\0' || value < 0) {
+                    errx(EXIT_FAILURE, "Invalid time: %s", optarg);
+                }
+                *(ch == 'w' ? &options.warmup : ch == 't' ? &options.minTime : &options.maxOpTime) = value;
+                break;
+            }
+            case 'r':
+                options.repetitions = (int)strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || options.repetitions <= 0) {
+                    errx(EXIT_FAILURE, "Invalid repetition count: %s", optarg);
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+    
+    // The largest inputs have more tags than the default limit allows
+    initMetContext(&met);
+    met.limits.maxTags = 0xFFFFFFFFU;
+    
+    int cpu = pinCpu(options.cpu);
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        err(EXIT_FAILURE, "Cannot create %s", output);
+    }
+    fprintf(out, "{\"cpu\":%d,\"repetitions\":%d,\"benchmarks\":[", cpu, options.repetitions);
+    fprintf(stderr, "%-16s %10s %14s %12s %10s\n", "benchmark", "size", "ns/op", "bytes/op", "MB/s");
+    
+    int first = 1;
+    for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+        const Benchmark *benchmark = &benchmarks[i];
+        int skipping = 0;
+        if (!benchmarkSelected(&options, benchmark->name)) {
+            continue;
+        }
+        
+        for (int j = 0; benchmark->sizes[j] != 0 && benchmark->sizes[j] <= options.maxSize; j++) {
+            Input input = { 0 };
+            double samples[options.repetitions];
+            
+            fprintf(out, "%s{\"name\":\"%s\",\"unit\":\"%s\",\"size\":%zu",
+                    first ? "" : ",", benchmark->name, benchmark->unit, benchmark->sizes[j]);
+            first = 0;
+            if (skipping) {
+                fprintf(out, ",\"skipped\":true}");
+                fprintf(stderr, "%-16s %10zu %14s\n", benchmark->name, benchmark->sizes[j], "skipped");
+                continue;
+            }
+            
+            input.size = benchmark->sizes[j];
+            benchmark->setup(&input);
+            
+            // Warm up, then find a run count that takes at least minTime
+            double deadline = now() + options.warmup;
+            size_t runs = 1;
+            double elapsed;
+            do {
+                elapsed = timeRuns(benchmark, &input, 1);
+            } while (now() < deadline && elapsed < options.maxOpTime);
+            while (elapsed < options.minTime && elapsed < options.maxOpTime) {
+                runs *= 2;
+                elapsed = timeRuns(benchmark, &input, runs);
+            }
+            
+            for (int k = 0; k < options.repetitions; k++) {
+                samples[k] = timeRuns(benchmark, &input, runs) / runs;
+            }
+            qsort(samples, options.repetitions, sizeof(double), compareDoubles);
+            double median = samples[options.repetitions / 2];
+            
+            fprintf(out, ",\"runs\":%zu,\"ns_per_op\":%.1f,\"min_ns_per_op\":%.1f,\"bytes_per_op\":%zu,\"mb_per_sec\":%.2f}",
+                    runs, median * 1e9, samples[0] * 1e9, input.bytes, input.bytes / 1048576.0 / median);
+            fprintf(stderr, "%-16s %10zu %14.1f %12zu %10.2f\n", benchmark->name, benchmark->sizes[j],
+                    median * 1e9, input.bytes, input.bytes / 1048576.0 / median);
+            fflush(out);
+            
+            // Assume at least linear growth when predicting the next size
+            size_t next = benchmark->sizes[j + 1];
+            skipping = next != 0 && median * next / benchmark->sizes[j] > options.maxOpTime;
+            freeInput(&input);
+        }
+    }
+    fprintf(out, "]}\n");
+    
+    if (out != stdout && fclose(out) != 0) {
+        err(EXIT_FAILURE, "Error writing %s", output);
+    }
+    return EXIT_SUCCESS;
+}
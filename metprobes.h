@@ -0,0 +1,26 @@
+#ifndef METPROBES_H
+#define METPROBES_H
+
+/**
+ * Static tracepoints under the provider "metinfo", for bpftrace, perf or
+ * SystemTap. A probe is a nop plus an ELF note, and its arguments are only
+ * read once a tracer attaches. Without sys/sdt.h (HAVE_SYS_SDT_H is set by
+ * make) the probes compile to nothing.
+ *
+ *   file__open(path, fd)                           a file was opened
+ *   header__decoded(metVersion, numTags, numBlocks)
+ *   tag__decoded(type, nameLength, valueLength)    one per meta tag
+ *   gaps__collected(numTags, numGaps)              collectGaps finished
+ *   output__emitted(path, status)                  printFile finished
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define MET_PROBE2(name, a, b)      DTRACE_PROBE2(metinfo, name, a, b)
+#define MET_PROBE3(name, a, b, c)   DTRACE_PROBE3(metinfo, name, a, b, c)
+#else
+#define MET_PROBE2(name, a, b)      ((void)0)
+#define MET_PROBE3(name, a, b, c)   ((void)0)
+#endif
+
+#endif
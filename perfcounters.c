@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <string.h>
+
+#include "perfcounters.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * Hardware counters, and the software counters used when the PMU is not
+ * available (virtual machines, perf_event_paranoid, other platforms)
+ */
+typedef struct {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} CounterType;
+
+static const CounterType hardwareCounters[] = {
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-misses",    PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "LLC-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { NULL, 0, 0 }
+};
+
+static const CounterType softwareCounters[] = {
+    { "task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "page-faults",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "ctx-switches",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations",PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { NULL, 0, 0 }
+};
+
+/**
+ * Open one counter of the calling thread, user space only, in the group
+ * of leader (-1 to start a group)
+ */
+static int openCounter(unsigned int type, unsigned long long config, int leader) {
+    struct perf_event_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/**
+ * Open the counters of a list as one group, skipping those the CPU does
+ * not have. Returns the number opened.
+ */
+static int openGroup(PerfCounters *counters, const CounterType *types) {
+    counters->numCounters = 0;
+    
+    for (int i = 0; types[i].name && counters->numCounters < PERF_MAX_COUNTERS; i++) {
+        int leader = counters->numCounters > 0 ? counters->fds[0] : -1;
+        int fd = openCounter(types[i].type, types[i].config, leader);
+        if (fd != -1) {
+            counters->fds[counters->numCounters] = fd;
+            counters->names[counters->numCounters++] = types[i].name;
+        }
+    }
+    return counters->numCounters;
+}
+
+/**
+ * Open the hardware counters, or the software counters if no hardware
+ * counter can be opened. Returns 0, or -1 if no counter is available.
+ */
+int openPerfCounters(PerfCounters *counters) {
+    counters->hardware = 1;
+    if (openGroup(counters, hardwareCounters) == 0) {
+        counters->hardware = 0;
+        if (openGroup(counters, softwareCounters) == 0) {
+            return -1;
+        }
+    }
+    
+    ioctl(counters->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+/**
+ * Read the current values of all counters with a single system call.
+ * Returns 0, or -1 if the read failed.
+ */
+int readPerfCounters(const PerfCounters *counters, unsigned long long *values) {
+    unsigned long long buffer[1 + PERF_MAX_COUNTERS];
+    size_t size = (1 + counters->numCounters) * sizeof(unsigned long long);
+    
+    if (counters->numCounters == 0 || read(counters->fds[0], buffer, size) != (ssize_t)size) {
+        return -1;
+    }
+    memcpy(values, buffer + 1, counters->numCounters * sizeof(unsigned long long));
+    return 0;
+}
+
+/**
+ * Close the counters
+ */
+void closePerfCounters(PerfCounters *counters) {
+    for (int i = 0; i < counters->numCounters; i++) {
+        close(counters->fds[i]);
+    }
+    counters->numCounters = 0;
+}
+
+#else
+
+int openPerfCounters(PerfCounters *counters) {
+    counters->numCounters = 0;
+    counters->hardware = 0;
+    return -1;
+}
+
+int readPerfCounters(const PerfCounters *counters, unsigned long long *values) {
+    (void)counters;
+    (void)values;
+    return -1;
+}
+
+void closePerfCounters(PerfCounters *counters) {
+    counters->numCounters = 0;
+}
+
+#endif
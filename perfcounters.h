@@ -0,0 +1,20 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+/**
+ * Counters measured around the phases of a run (--perf-counters)
+ */
+#define PERF_MAX_COUNTERS   5
+
+typedef struct {
+    int fds[PERF_MAX_COUNTERS];             // Group leader first
+    int numCounters;                        // Counters opened
+    const char *names[PERF_MAX_COUNTERS];   // Counter names, in read order
+    int hardware;                           // 1 for PMU counters, 0 for the software fallback
+} PerfCounters;
+
+int openPerfCounters(PerfCounters *counters);
+int readPerfCounters(const PerfCounters *counters, unsigned long long *values);
+void closePerfCounters(PerfCounters *counters);
+
+#endif